@@ -0,0 +1,153 @@
+#!/bin/bash
+# Check that --cache gives the same result as a full walk. Builds trees
+# with bench/mktree.sh, then for every engine and thread count writes the
+# cache, mutates the tree by adding, removing, renaming and moving files
+# and directories, and compares the -j output of a run with the cache to
+# a run without it, both after the mutation and once the cache has been
+# rewritten. Also checks that the options a cache cannot serve are
+# rejected. Exits with 1 if any output differs.
+#
+# USAGE: bench/cachetest.sh [-T topologies] [-e engines] [-t threads]
+#                           [-r rounds] [-k] <scratch dir>
+
+DUG=${DUG:-./dug}
+MKTREE=$(dirname "$0")/mktree.sh
+TOPOLOGIES="wide deep hardlinks"
+ENGINES="fts native uring"
+THREADS="1 4"
+ROUNDS=2
+KEEP=0
+
+while getopts "T:e:t:r:k" opt; do
+    case $opt in
+        T) TOPOLOGIES=$OPTARG ;;
+        e) ENGINES=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        r) ROUNDS=$OPTARG ;;
+        k) KEEP=1 ;;
+        *) sed -n '2,11p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND-1))
+if [ $# -ne 1 ]; then
+    sed -n '2,11p' "$0"
+    exit 1
+fi
+ROOT=$1/dug-cachetest
+FAILED=0
+
+mkdir -p "$ROOT" || exit 1
+trap '[ $KEEP -eq 1 ] || rm -rf "$ROOT"' EXIT
+
+# Print the -j output with every ID on a line with the directory it is
+# in, sorted, so runs that list IDs in a different order compare equal
+canonical() {
+    awk '/^    ".*\{$/ { dir = $0 } /^  "summary"/ { dir = "summary" }
+         { sub(/,$/, ""); print dir "\t" $0 }' | sort
+}
+
+# Compare a run with the cache to a run without it
+check() {
+    local tree=$1 engine=$2 threads=$3 what=$4
+    if ! cmp -s <("$DUG" -e "$engine" -t "$threads" -j --cache "$tree.cache" "$tree" | canonical) \
+                <("$DUG" -e "$engine" -t "$threads" -j "$tree" | canonical); then
+        echo "FAIL $(basename "$tree") -e $engine -t $threads: $what"
+        FAILED=1
+    fi
+}
+
+# Mutate a tree: files are added, removed, renamed and moved between
+# directories, and directories are added, removed, renamed and moved
+# under other directories. Round r picks different directories.
+mutate() {
+    local tree=$1 r=$2 dirs n a b c d f
+    mapfile -t dirs < <(find "$tree" -mindepth 1 -type d | sort)
+    n=${#dirs[@]}
+    a=${dirs[$(( (r*7) % n ))]}
+    b=${dirs[$(( (r*13+1) % n ))]}
+    c=${dirs[$(( (r*29+2) % n ))]}
+
+    head -c $((4096*r+100)) /dev/zero > "$a/new$r"
+    touch "$b/empty$r"
+    rm -f "$(find "$b" -maxdepth 1 -type f | sort | head -1)"
+    f=$(find "$c" -maxdepth 1 -type f | sort | head -1)
+    [ -n "$f" ] && mv "$f" "$c/renamed$r"
+    f=$(find "$a" -maxdepth 1 -type f -name 'f*' | sort | head -1)
+    [ -n "$f" ] && mv "$f" "$b/moved$r"
+    f=$(find "$c" -maxdepth 1 -type f | sort | tail -1)
+    [ -n "$f" ] && ln "$f" "$a/link$r"
+
+    mkdir "$a/sub$r" && head -c 10000 /dev/zero > "$a/sub$r/data"
+    if [ "$b" != "$c" ] && [ "${c#$b/}" = "$c" ] && [ "${b#$c/}" = "$b" ]; then
+        mv "$b" "$c/adopted$r"
+    fi
+    d=${dirs[$(( (r*37+3) % n ))]}
+    [ -d "$d" ] && [ "${a#$d}" = "$a" ] && rm -rf "$d"
+    d=${dirs[$(( (r*41+5) % n ))]}
+    [ -d "$d" ] && [ "${a#$d}" = "$a" ] && mv "$d" "$d.renamed$r"
+}
+
+for topology in $TOPOLOGIES; do
+    echo "# building $topology in $ROOT/$topology" >&2
+    rm -rf "$ROOT/$topology"
+    "$MKTREE" "$topology" "$ROOT/$topology" || exit 1
+
+    # Every engine and thread count gets its own copy of the tree and its
+    # own cache, and all copies are mutated the same way
+    trees=""
+    for engine in $ENGINES; do
+        for t in $THREADS; do
+            tree=$ROOT/$topology-$engine-$t
+            rm -rf "$tree" "$tree.cache"
+            cp -a "$ROOT/$topology" "$tree" || exit 1
+            trees="$trees $tree"
+        done
+    done
+    sleep 1
+
+    # A missing cache is written, and then read back
+    for engine in $ENGINES; do
+        for t in $THREADS; do
+            tree=$ROOT/$topology-$engine-$t
+            check "$tree" "$engine" "$t" "no cache"
+
+            # Directories holding files with multiple links are always
+            # read, so every directory of the hardlinks tree is
+            if [ "$topology" != hardlinks ] && [ "$("$DUG" -v -e "$engine" -t "$t" --cache "$tree.cache" "$tree" | grep -c '^+cached')" -eq 0 ]; then
+                echo "FAIL $topology -e $engine -t $t: no directory was taken from the cache"
+                FAILED=1
+            fi
+            check "$tree" "$engine" "$t" "unchanged tree"
+        done
+    done
+
+    for ((r=1; r<=ROUNDS; r++)); do
+        for tree in $trees; do
+            mutate "$tree" "$r"
+        done
+
+        # Directories changed in the second the walk starts are not
+        # cached, so let the clock move on before the next walk
+        sleep 1
+        for engine in $ENGINES; do
+            for t in $THREADS; do
+                tree=$ROOT/$topology-$engine-$t
+                check "$tree" "$engine" "$t" "round $r"
+                check "$tree" "$engine" "$t" "round $r, cache rewritten"
+            done
+        done
+    done
+    echo "# $topology done" >&2
+done
+
+# Files in cached directories are not stat'ed, so the reports that need
+# every file must be refused
+for opt in --accounting "--age atime" --sizes; do
+    if "$DUG" --cache "$ROOT/rejected.cache" $opt "$ROOT" > /dev/null; then
+        echo "FAIL $opt was accepted with --cache"
+        FAILED=1
+    fi
+done
+
+[ $FAILED -eq 0 ] && echo "cache results match"
+exit $FAILED
@@ -0,0 +1,89 @@
+#!/bin/bash
+# Build a synthetic directory tree for benchmarking dug. The size of every
+# topology grows linearly with the scale.
+#
+#   wide       1000*scale top level directories with 10 files each
+#   deep       10 chains of directories 100*scale levels deep, 5 files per
+#              level
+#   skewed     One subtree holding 100*scale directories of 100 files,
+#              next to 100 directories with one file each
+#   hardlinks  64 directories of 200*scale files, each file hard linked
+#              from the next directory so links are seen by different
+#              threads
+#   owners     50*scale directories of 20 files, each file owned by one
+#              of 1000 users and groups (needs root, otherwise files keep
+#              the owner of the caller)
+#
+# USAGE: bench/mktree.sh [-s scale] <topology> <directory>
+
+SCALE=1
+
+while getopts "s:" opt; do
+    case $opt in
+        s) SCALE=$OPTARG ;;
+        *) sed -n '2,17p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND-1))
+if [ $# -ne 2 ]; then
+    sed -n '2,17p' "$0"
+    exit 1
+fi
+TOPOLOGY=$1
+ROOT=$2
+
+# Create n files named f1..fn in a directory
+files() {
+    (cd "$1" && seq -f "f%g" 1 "$2" | xargs touch)
+}
+
+mkdir -p "$ROOT" || exit 1
+case $TOPOLOGY in
+    wide)
+        for ((d=0; d<1000*SCALE; d++)); do
+            mkdir "$ROOT/d$d" && files "$ROOT/d$d" 10
+        done
+        ;;
+    deep)
+        for ((c=0; c<10; c++)); do
+            dir="$ROOT/c$c"
+            for ((l=0; l<100*SCALE; l++)); do
+                mkdir -p "$dir" && files "$dir" 5
+                dir="$dir/l"
+            done
+        done
+        ;;
+    skewed)
+        for ((d=0; d<100*SCALE; d++)); do
+            mkdir -p "$ROOT/big/d$d" && files "$ROOT/big/d$d" 100
+        done
+        for ((d=0; d<100; d++)); do
+            mkdir "$ROOT/s$d" && files "$ROOT/s$d" 1
+        done
+        ;;
+    hardlinks)
+        for ((d=0; d<64; d++)); do
+            mkdir "$ROOT/d$d" && files "$ROOT/d$d" $((200*SCALE))
+        done
+        # Link every file of directory d into directory d+1
+        for ((d=0; d<64; d++)); do
+            n=$(( (d+1) % 64 ))
+            (cd "$ROOT" && seq -f "%g" 1 $((200*SCALE)) | xargs -I{} ln "d$d/f{}" "d$n/l{}")
+        done
+        ;;
+    owners)
+        for ((d=0; d<50*SCALE; d++)); do
+            mkdir "$ROOT/d$d" && files "$ROOT/d$d" 20
+            if [ "$(id -u)" -eq 0 ]; then
+                for ((f=1; f<=20; f++)); do
+                    id=$(( 1000 + (d*20+f) % 1000 ))
+                    echo "$id:$id $ROOT/d$d/f$f"
+                done | xargs -n 2 chown
+            fi
+        done
+        ;;
+    *)
+        echo "Unknown topology $TOPOLOGY" >&2
+        exit 1
+        ;;
+esac
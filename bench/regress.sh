@@ -0,0 +1,155 @@
+#!/bin/bash
+# Check the results of dug against du and against itself. Builds a hard
+# linked tree with bench/mktree.sh and writes data to some of its linked
+# files, then for every engine and thread count checks that the totals
+# match du, with and without -b and --exclude-name, that a snapshot
+# merged on its own and the snapshots of every shard merged together
+# give the result of a walk, and that --diff reports exactly the growth
+# of the tree. Also checks that --ndjson and -j output stays valid JSON
+# for names that are not valid UTF-8 or hold control characters (needs
+# python3). Exits with 1 if any check fails.
+#
+# USAGE: bench/regress.sh [-e engines] [-t threads] [-n shards] [-k]
+#                         <scratch dir>
+
+DUG=${DUG:-./dug}
+MKTREE=$(dirname "$0")/mktree.sh
+ENGINES="fts native uring"
+THREADS="1 4"
+SHARDS=3
+KEEP=0
+
+while getopts "e:t:n:k" opt; do
+    case $opt in
+        e) ENGINES=$OPTARG ;;
+        t) THREADS=$OPTARG ;;
+        n) SHARDS=$OPTARG ;;
+        k) KEEP=1 ;;
+        *) sed -n '2,13p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND-1))
+if [ $# -ne 1 ]; then
+    sed -n '2,13p' "$0"
+    exit 1
+fi
+ROOT=$1/dug-regress
+TREE=$ROOT/tree
+FAILED=0
+
+rm -rf "$ROOT"
+mkdir -p "$ROOT" || exit 1
+trap '[ $KEEP -eq 1 ] || rm -rf "$ROOT"' EXIT
+
+# Print the -j output with every ID on a line with the directory it is
+# in, sorted, so runs that list directories and IDs in a different order
+# compare equal
+canonical() {
+    awk '/^    ".*\{$/ { dir = $0 } /^  }/ { dir = "" } /^  "summary"/ { dir = "summary" }
+         { sub(/,$/, ""); print dir "\t" $0 }' | sort
+}
+
+# Print the summary and total of the -j output, the part of a report
+# that does not depend on which link of a file is found first
+summary() {
+    sed -n '/^  "summary"/,$p'
+}
+
+# Record a failure unless two outputs are the same
+expect() {
+    local what=$1 got=$2 want=$3
+    if [ "$got" != "$want" ]; then
+        echo "FAIL $what: got $got, expected $want"
+        FAILED=1
+    fi
+}
+
+echo "# building hardlinks in $TREE" >&2
+"$MKTREE" hardlinks "$TREE" || exit 1
+# Every file is linked from the next directory, so these sizes are seen
+# twice by the walk, often by different threads and shards
+for ((d=0; d<64; d+=3)); do
+    head -c $((5000*d+1)) /dev/zero > "$TREE/d$d/f1"
+    head -c 70000 /dev/zero > "$TREE/d$d/f2"
+done
+mkdir -p "$TREE/d5/sub/subsub" && head -c 123456 /dev/zero > "$TREE/d5/sub/subsub/data"
+ln "$TREE/d5/sub/subsub/data" "$TREE/d40/data"
+
+blocks=$(du -sB1 "$TREE" | cut -f1)
+apparent=$(du -sB1 --apparent-size "$TREE" | cut -f1)
+excluded=$(du -sB1 --exclude='l1*' --exclude='sub' "$TREE" | cut -f1)
+
+for engine in $ENGINES; do
+    for t in $THREADS; do
+        run="-e $engine -t $t"
+
+        # Each file with several links is counted once, like du does
+        expect "$run total" "$("$DUG" $run -j "$TREE" | sed -n 's/^  "total"://p')" "$blocks"
+        expect "$run -b total" "$("$DUG" $run -b -j "$TREE" | sed -n 's/^  "total"://p')" "$apparent"
+        expect "$run --exclude-name total" \
+            "$("$DUG" $run -j --exclude-name 'l1*' --exclude-name sub "$TREE" | sed -n 's/^  "total"://p')" "$excluded"
+
+        # A snapshot merged on its own gives back the walk that wrote it
+        "$DUG" $run -j --snapshot "$ROOT/walk.snap" "$TREE" > "$ROOT/walk.json" || FAILED=1
+        if ! cmp -s <(canonical < "$ROOT/walk.json") <("$DUG" -j --merge "$ROOT/walk.snap" | canonical); then
+            echo "FAIL $run: --merge of a single snapshot differs from the walk"
+            FAILED=1
+        fi
+
+        # Shards split the directories, and a file linked from several
+        # shards is counted by one of them only
+        snaps=""
+        for ((i=0; i<SHARDS; i++)); do
+            "$DUG" $run --shard "$i/$SHARDS" --snapshot "$ROOT/shard$i.snap" "$TREE" > /dev/null || FAILED=1
+            snaps="$snaps $ROOT/shard$i.snap"
+        done
+        if ! cmp -s <(summary < "$ROOT/walk.json") <("$DUG" -j --merge $snaps | summary); then
+            echo "FAIL $run: --merge of $SHARDS shards differs from the walk"
+            FAILED=1
+        fi
+
+        # Nothing grows between a snapshot and itself. A new directory
+        # grows by its size, and so does the total; other directories
+        # may trade the linked files they count between runs.
+        expect "$run --diff of a snapshot with itself" \
+            "$("$DUG" -j --diff "$ROOT/walk.snap" "$ROOT/walk.snap" | sed -n '/"growth"/,/^  }/p' | grep -c '": {')" 1
+        mkdir "$TREE/grown" && head -c 100000 /dev/zero > "$TREE/grown/data"
+        size=$(du -sB1 "$TREE/grown" | cut -f1)
+        grown=$(du -sB1 "$TREE" | cut -f1)
+        "$DUG" $run --snapshot "$ROOT/grown.snap" "$TREE" > /dev/null || FAILED=1
+        rm -r "$TREE/grown"
+        "$DUG" -j --diff "$ROOT/walk.snap" "$ROOT/grown.snap" > "$ROOT/diff.json" || FAILED=1
+        expect "$run --diff of a new directory" \
+            "$(grep -A1 '^    "'"$TREE"'/grown": {' "$ROOT/diff.json" | sed -n 's/.*"old":\([0-9]*\), "new":\([0-9]*\)}.*/\1 \2/p')" "0 $size"
+        expect "$run --diff total" "$(sed -n 's/^  "total": {"old":\([0-9]*\), "new":\([0-9]*\)}/\1 \2/p' "$ROOT/diff.json")" "$blocks $grown"
+    done
+done
+
+# Names are bytes: the JSON output must escape the ones that are not text
+if command -v python3 > /dev/null; then
+    names=$ROOT/names
+    mkdir -p "$names"
+    for name in $'bad\xff' $'ctrl\n\t\x01' 'quote"back\slash' $'utf8\xc3\xa9\xe2\x82\xac' $'cut\xe2\x82' $'surrogate\xed\xa0\x80'; do
+        mkdir "$names/$name" && head -c 1000 /dev/zero > "$names/$name/f"
+    done
+    for engine in $ENGINES; do
+        if ! "$DUG" -e "$engine" --ndjson "$names" | python3 -c '
+import json, sys
+for line in sys.stdin.buffer:
+    json.loads(line.decode("utf-8"))' 2> /dev/null; then
+            echo "FAIL -e $engine: --ndjson output is not valid JSON"
+            FAILED=1
+        fi
+        if ! "$DUG" -e "$engine" -j "$names" | python3 -c '
+import json, sys
+json.loads(sys.stdin.buffer.read().decode("utf-8"))' 2> /dev/null; then
+            echo "FAIL -e $engine: -j output is not valid JSON"
+            FAILED=1
+        fi
+    done
+else
+    echo "# python3 not found, JSON escaping not checked" >&2
+fi
+
+[ $FAILED -eq 0 ] && echo "regression checks passed"
+exit $FAILED
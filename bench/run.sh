@@ -0,0 +1,117 @@
+#!/bin/bash
+# Benchmark dug on synthetic trees. Builds each topology with
+# bench/mktree.sh, then runs dug with every engine and thread count and
+# reports one tab separated line per run: the best wall time of the runs,
+# entries counted per second, peak RSS, waits for the shared inode set,
+# and the scaling efficiency relative to the first thread count of the
+# same topology and engine. Unless -t is given, the hardlinks topology is
+# also run at 32 to 128 threads, where the threads contend for the shared
+# inode set.
+#
+# Trees are built in the scratch directory, or on a tmpfs or a loopback
+# ext4 image mounted in it with -f (both need root). Trees are reused
+# with -k.
+#
+# USAGE: bench/run.sh [-s scale] [-T topologies] [-e engines] [-t threads]
+#                     [-r runs] [-f dir|tmpfs|ext4] [-k] <scratch dir>
+
+DUG=${DUG:-./dug}
+MKTREE=$(dirname "$0")/mktree.sh
+SCALE=1
+TOPOLOGIES="wide deep skewed hardlinks owners"
+ENGINES="fts native uring"
+THREADS="1 2 4 8 16"
+CONTENDED_THREADS="32 64 128"
+RUNS=3
+FS=dir
+KEEP=0
+
+while getopts "s:T:e:t:r:f:k" opt; do
+    case $opt in
+        s) SCALE=$OPTARG ;;
+        T) TOPOLOGIES=$OPTARG ;;
+        e) ENGINES=$OPTARG ;;
+        t) THREADS=$OPTARG; CONTENDED_THREADS="" ;;
+        r) RUNS=$OPTARG ;;
+        f) FS=$OPTARG ;;
+        k) KEEP=1 ;;
+        *) sed -n '2,17p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND-1))
+if [ $# -ne 1 ]; then
+    sed -n '2,17p' "$0"
+    exit 1
+fi
+ROOT=$1/dug-bench
+METRICS=$(mktemp)
+
+mkdir -p "$ROOT" || exit 1
+case $FS in
+    dir) ;;
+    tmpfs)
+        mountpoint -q "$ROOT" || mount -t tmpfs -o size=$((2*SCALE))G tmpfs "$ROOT" || exit 1
+        ;;
+    ext4)
+        if ! mountpoint -q "$ROOT"; then
+            truncate -s $((2*SCALE))G "$1/dug-bench.img" &&
+                mkfs.ext4 -q -F -N $((500000*SCALE)) "$1/dug-bench.img" &&
+                mount -o loop "$1/dug-bench.img" "$ROOT" || exit 1
+        fi
+        ;;
+    *)
+        echo "Unknown filesystem $FS" >&2
+        exit 1
+        ;;
+esac
+
+# Unmount and remove everything that was built, unless it is kept
+cleanup() {
+    rm -f "$METRICS"
+    [ $KEEP -eq 1 ] && return
+    if [ "$FS" = dir ]; then
+        rm -rf "$ROOT"
+    else
+        umount "$ROOT" && rmdir "$ROOT"
+        rm -f "$1/dug-bench.img"
+    fi
+}
+trap 'cleanup "$1"' EXIT
+
+# Read a counter from the metrics dug leaves at the end of the walk
+metric() {
+    grep -o "\"$1\":[0-9]*" "$METRICS" | head -1 | cut -d: -f2
+}
+
+printf "topology\tengine\tthreads\tseconds\tentries\tentries_per_sec\tmax_rss_kb\tinode_waits\tefficiency\n"
+for topology in $TOPOLOGIES; do
+    if [ ! -d "$ROOT/$topology" ]; then
+        echo "# building $topology at scale $SCALE in $ROOT/$topology" >&2
+        "$MKTREE" -s "$SCALE" "$topology" "$ROOT/$topology" || exit 1
+    fi
+
+    # Warm the caches so every run sees the same state
+    "$DUG" "$ROOT/$topology" > /dev/null
+
+    threads=$THREADS
+    [ "$topology" = hardlinks ] && threads="$THREADS $CONTENDED_THREADS"
+    for engine in $ENGINES; do
+        base=""
+        for t in $threads; do
+            best=""
+            for ((r=0; r<RUNS; r++)); do
+                start=$(date +%s.%N)
+                "$DUG" -e "$engine" -t "$t" --metrics "$METRICS" "$ROOT/$topology" > /dev/null
+                end=$(date +%s.%N)
+                best=$(awk -v s="$start" -v f="$end" -v b="$best" \
+                    'BEGIN { d = f-s; if(b == "" || d < b) b = d; printf "%.4f", b }')
+            done
+            [ -n "$base" ] || base="$t $best"
+            awk -v topo="$topology" -v e="$engine" -v t="$t" -v s="$best" -v base="$base" \
+                -v n="$(metric entries)" -v rss="$(metric max_rss_kb)" -v w="$(metric inode_waits)" \
+                'BEGIN { split(base, b, " ");
+                         printf "%s\t%s\t%d\t%.4f\t%d\t%.0f\t%d\t%d\t%.2f\n",
+                                topo, e, t, s, n, n/s, rss, w, (b[2]*b[1])/(s*t) }'
+        done
+    done
+done
@@ -19,6 +19,9 @@
  * SOFTWARE.
  */
 #include<stdio.h>
+#include<stdint.h>
+#include<stddef.h>
+#include<time.h>
 #include<stdbool.h>
 #include<stdlib.h>
 #include<dirent.h>
@@ -30,13 +33,72 @@
 #include<grp.h>
 #include<pwd.h>
 #include<fts.h>
+#include<fnmatch.h>
 #include<pthread.h>
+#include<sched.h>
+#include<signal.h>
+#include<fcntl.h>
 #include<sys/stat.h>
-
-#define MAXGIDS    128
+#include<sys/sysmacros.h>
+#include<sys/syscall.h>
+#include<sys/resource.h>
+#include<sys/mman.h>
+#include<sys/uio.h>
+#include<linux/io_uring.h>
+
+#define IDHOT      3
 #define MAXEXCLUDE 128
 #define MAXPATHLEN 4096 
-#define INODETABLE 16384 
+#define INODETABLE 64
+#define INODESTRIPES 256
+#define DIRENTBUF  131072
+#define URING_DEPTH 1024
+#define URING_DIRS  16
+#define MAXNAMELEN  64
+#define NAMETHREADS 4
+#define OUTFLUSH    (1<<20)
+#define OUTCHUNK    4096
+#define LATENCY_BUCKETS 160
+#define BACKOFFWINDOW   100000000ull
+#define MAXINTERVAL     100000000ull
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_CLASS_SHIFT 13
+#define ACCTEMPTY   ULLONG_MAX
+#define MAXAGES     8
+#define SIZEBUCKETS 65
+#define NAMEBATCH   512
+#define MAXTHREADS  512
+#define MAXSHARDS   65536
+#define TUNEWINDOW  1000000000ull
+#define TUNEHOLDS   5
+#define ARENABLOCK  (1<<20)
+
+// Format of the incremental cache file
+#define CACHEMAGIC   "DUGCACHE"
+#define CACHEVERSION 1
+
+// Format of snapshot files
+#define SNAPMAGIC    "DUGSNAP1"
+#define SNAPVERSION  1
+#define SNAP_BY_USER 1
+#define SNAP_BLOCKS  2
+
+// Traversal engines
+#define ENGINE_FTS    0
+#define ENGINE_NATIVE 1
+#define ENGINE_URING  2
+
+// Time fields that --age measures
+#define AGE_NONE  0
+#define AGE_ATIME 1
+#define AGE_MTIME 2
+#define AGE_CTIME 3
+
+// Kinds of operations submitted to io_uring
+#define URING_OPEN  0
+#define URING_SELF  1
+#define URING_ENTRY 2
 
 extern errno;
 
@@ -58,6 +120,10 @@ bool json = false;
 // Resolve GIDs to group names in output 
 bool output_names = false;
 
+// passwd or group file that names are read from instead of the system
+// databases, or NULL
+char* names_path = NULL;
+
 // Summarize the usage by UID rather than GID
 bool summarize_by_user = false;
 
@@ -79,6 +145,70 @@ int n_errors = 0;
 // Number of threads to use
 int n_threads = 1;
 
+// Traversal engine used by the workers
+int engine = ENGINE_FTS;
+
+// Depth of the directories reported. 1 reports the subdirectories of the
+// target, and deeper directories are reported with --depth
+unsigned int max_depth = 1;
+
+// Metadata fields requested from statx, computed from the options
+unsigned int stat_mask = STATX_BASIC_STATS;
+
+// Do not revalidate attributes with the server on network filesystems
+bool dont_sync = false;
+
+// Cleared if the kernel does not support statx
+bool use_statx = true;
+
+// Run in the idle I/O scheduling class, and at a nice level above 0
+bool idle_io = false;
+int nice_level = 0;
+
+// Output each result as a line of JSON as soon as it is complete
+bool ndjson = false;
+
+// Snapshot file the result is also written to, or NULL
+char* snapshot_path = NULL;
+
+// Slice of the top level subdirectories of each target that this process
+// walks with --shard, out of n_shards. The target itself and its other
+// entries are counted by slice 0.
+unsigned int shard = 0;
+unsigned int n_shards = 1;
+
+// Also report the usage summed over all targets
+bool grand_summary = false;
+
+// Also count bytes, apparent bytes and files by group, by user and by
+// user and group pair
+bool accounting = false;
+
+// Time field, thresholds in days in increasing order, and reference time
+// of the age histograms of --age
+int age_field = AGE_NONE;
+unsigned int age_days[MAXAGES];
+int n_ages = 0;
+time_t age_now = 0;
+
+// Count the regular files of each ID by powers of two of their size
+bool size_histogram = false;
+
+// Growth in bytes below which --diff does not report a directory
+long long unsigned int diff_threshold = 0;
+
+// Incremental cache file, or NULL when every directory is read
+char* cache_path = NULL;
+
+// Metadata fields requested from statx for directories, which include
+// the times the incremental cache is keyed on
+unsigned int dir_stat_mask = STATX_BASIC_STATS;
+
+// Number of directory handles held open for relative lookups, and the
+// limit past which subdirectories are opened by full path instead
+int open_handles = 0;
+int max_handles = 512;
+
 // Exit status. Volitile because it can be set in any thread.
 volatile int exit_status = 0;
 
@@ -88,21 +218,582 @@ char **error_strs;
 // Array of inode numbers that should be excluded
 long long unsigned int exclude_inodes[MAXEXCLUDE];
 
+// Struct to hold the patterns of --exclude-name. Names without wildcards
+// are kept in an open addressed set so each is matched with one lookup,
+// and the other patterns are matched in turn with fnmatch. Empty slots of
+// the set are NULL.
+struct name_patterns {
+    char** literals;
+    unsigned int capacity;
+    unsigned int n_literals;
+    char** globs;
+    unsigned int n_globs;
+    unsigned int globs_capacity;
+};
+
+// Names of files and directories that are skipped without a stat
+struct name_patterns exclude_names;
+bool using_exclude_names = false;
+
 // Mutex to lock error table on insert
 pthread_mutex_t error_mutex;
 
-// Struct to hold inode linked-list entry
+// Struct to hold inode table entry. The all zero pair marks an empty slot
 struct inode_entry {
+    long long unsigned int dev;
+    long long unsigned int num;
+};
+
+// Struct to hold one stripe of the inode set. Each stripe has its own lock
+// and open addressed table, and is aligned so that stripes do not share
+// cache lines. Grown is set once the table no longer lives in inode_arena.
+struct inode_stripe {
+    pthread_mutex_t lock;
+    struct inode_entry *entries;
+    unsigned int capacity;
+    unsigned int n_entries;
+    bool grown;
+} __attribute__((aligned(64)));
+
+// Set of (device, inode) pairs with multiple links that have been counted,
+// shared by all threads so each hard linked file is counted once
+struct inode_stripe inode_set[INODESTRIPES];
+
+// Single allocation holding the initial table of every stripe
+struct inode_entry *inode_arena = NULL;
+
+// Number of times a thread had to wait for a stripe of the inode set
+long long unsigned int inode_contention = 0;
+
+// Struct to hold a file with multiple links counted by a walk with
+// --shard, with the usage it added to its result, so that --merge can
+// take it off the other shards that counted it
+struct shard_link {
+    long long unsigned int dev;
     long long unsigned int num;
-    void* next;
+    long long unsigned int size;
+    unsigned int id;
+    struct tr_args *slot;
+};
+
+// Struct to hold the files with multiple links counted by a worker, or by
+// the whole walk once the workers exit
+struct link_table {
+    struct shard_link *entries;
+    size_t n_entries;
+    size_t capacity;
+};
+
+// Struct to hold the usage accumulated for one UID/GID
+struct id_entry {
+    unsigned int id;
+    long long unsigned int size;
+};
+
+// Struct to hold usage by UID/GID. The first IDHOT IDs are stored inline,
+// and further IDs in an open addressed table that grows as needed. Empty
+// table slots have id UINT_MAX.
+struct id_table {
+    struct id_entry hot[IDHOT];
+    unsigned int n_hot;
+    struct id_entry *entries;
+    unsigned int capacity;
+    unsigned int n_entries;
+};
+
+// Struct to hold the usage of one key of --accounting: a (UID, GID) pair
+// with the UID in the high half, or a UID or GID once the pairs are summed
+struct acct_entry {
+    long long unsigned int key;
+    long long unsigned int bytes;
+    long long unsigned int apparent;
+    long long unsigned int files;
+};
+
+// Struct to hold usage by accounting key in an open addressed table that
+// grows as needed. Empty slots have key ACCTEMPTY.
+struct acct_table {
+    struct acct_entry *entries;
+    unsigned int capacity;
+    unsigned int n_entries;
+};
+
+// Struct to hold the age and size histograms of the regular files of one
+// UID/GID. Age bucket i holds the files at least age_days[i-1] days old,
+// and size bucket i the files of 2^(i-1) to 2^i-1 bytes.
+struct histogram {
+    unsigned int id;
+    long long unsigned int age_bytes[MAXAGES+1];
+    long long unsigned int age_files[MAXAGES+1];
+    long long unsigned int size_bytes[SIZEBUCKETS];
+    long long unsigned int size_files[SIZEBUCKETS];
+};
+
+// Struct to hold histograms by UID/GID. The index maps each ID to its
+// position in hists.
+struct hist_table {
+    struct id_table index;
+    struct histogram *hists;
+    unsigned int n_hists;
+    unsigned int capacity;
+};
+
+// Output that is formatted in memory and written to stdout in one call
+struct out_buffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+};
+
+// A range of directories of the output that a thread formats into its
+// own buffer
+struct out_job {
+    struct tr_args **results;
+    int first;
+    int last;
+    struct out_buffer out;
+    pthread_t thread;
+    bool started;
+};
+
+// Names of user/group IDs, resolved once per ID. The index maps each ID
+// to its position in names, which is NULL until the name is resolved and
+// empty if the ID has no name. Positions from next onwards are waiting
+// for a resolver thread.
+struct name_cache {
+    struct id_table index;
+    unsigned int *ids;
+    char **names;
+    unsigned int n_names;
+    unsigned int capacity;
+    unsigned int next;
+    bool from_file;
+    bool stop;
+    unsigned int n_threads;
+    pthread_t threads[NAMETHREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
 };
 
-// Struct to hold arguments passed to threads
+// Block of an arena, filled from the start
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    _Alignas(max_align_t) char data[];
+};
+
+// Struct to hold results and their paths in large blocks that are
+// released together. Each thread fills its own arena, so results are
+// created without locks, and the arenas of the workers are spliced into
+// one once the workers exit.
+struct arena {
+    struct arena_block *head;
+};
+
+// Struct to hold the result for a directory. Workers accumulate usage
+// into the table under the lock, and the table is packed into pairs of
+// ID and size once all workers have finished. Directories below the subdirectories
+// of the target link to the result of their parent directory, and rank
+// is the index of the subdirectory of the target they are under. Root
+// is the index of the target. Pending counts the work items and child
+// results that are not yet complete. Skipped marks subdirectories of the
+// target that the workers found excluded or on another device.
 struct tr_args {
     char* path;
-    int** n_results;
-    unsigned long long **data;
+    unsigned int n_pairs;
+    long long unsigned int *pairs;
+    struct id_table usage;
+    pthread_mutex_t lock;
+    struct tr_args *parent;
+    unsigned int depth;
+    unsigned int rank;
+    unsigned int root;
+    long pending;
+    bool skipped;
+};
+
+// Struct to hold a target directory. Descendents holds the result of the
+// target itself, then its subdirectories, then its summary, and grows as
+// the target is read. Report lists them in output order with the deeper
+// directories of --depth.
+struct root {
+    char* path;
+    long long unsigned int devnum;
+    struct tr_args **descendents;
+    unsigned int capacity;
+    unsigned int subdir_count;
+    struct tr_args **report;
+    unsigned int n_report;
+    long long unsigned int total;
+    bool scanned;
+};
+
+// Header of an incremental cache file. The header is followed by the
+// directory records sorted by device and inode, then by the usage pairs
+// that the records refer to
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t options;
+    uint64_t n_records;
+    uint64_t n_pairs;
+};
+
+// Record of a directory in the incremental cache: the times the directory
+// had when it was read, and the usage of its entries that are not
+// directories, held in pairs [first,first+n_pairs)
+struct cache_record {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint64_t first;
+    uint64_t n_pairs;
+};
+
+// Usage by one UID/GID in the incremental cache
+struct cache_pair {
+    uint64_t id;
+    uint64_t size;
+};
+
+// Struct to hold cache records that are collected during the walk
+struct cache_store {
+    struct cache_record *records;
+    size_t n_records;
+    size_t records_cap;
+    struct cache_pair *pairs;
+    size_t n_pairs;
+    size_t pairs_cap;
+};
+
+// Struct to hold a directory whose entries are being counted. Entries are
+// counted into table, which is the local usage of the worker unless they
+// are collected in usage for the incremental cache
+struct dir_scan {
+    const struct cache_record *cached;
+    struct id_table usage;
+    struct id_table *table;
+    struct stat meta;
+    bool store;
+};
+
+// Header of a snapshot file. The header is followed by the directories,
+// the ID column padded to 8 bytes, the size column, the files with
+// multiple links, and the strings that hold the target path and the paths
+// of the directories. The summary is held in the last n_summary pairs. A
+// snapshot of a whole walk is shard 0 of 1 and holds no links.
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    int64_t created;
+    uint64_t total;
+    uint64_t n_dirs;
+    uint64_t n_pairs;
+    uint64_t n_summary;
+    uint64_t n_links;
+    uint64_t root_len;
+    uint64_t strings_len;
+    uint32_t shard;
+    uint32_t n_shards;
+};
+
+// Directory of a snapshot. Its path relative to the target is the first
+// shared bytes of the previous path followed by length bytes at name in
+// the strings, and its usage is in pairs [first,first+n_pairs).
+struct snapshot_dir {
+    uint64_t first;
+    uint32_t n_pairs;
+    uint32_t depth;
+    uint32_t shared;
+    uint32_t length;
+    uint64_t name;
+};
+
+// File with multiple links counted by the shard that wrote a snapshot,
+// which added size to ID id of directory dir and of its ancestors
+struct snapshot_link {
+    uint64_t dev;
+    uint64_t num;
+    uint64_t size;
+    uint32_t id;
+    uint32_t dir;
+};
+
+// Struct to hold a snapshot mapped for reading, and the path of the
+// directory it was last advanced to
+struct snapshot {
+    void *map;
+    size_t len;
+    const struct snapshot_header *header;
+    const struct snapshot_dir *dirs;
+    const uint32_t *ids;
+    const uint64_t *sizes;
+    const struct snapshot_link *links;
+    const char *strings;
+    uint64_t next;
+    char* path;
+    size_t path_len;
+    size_t path_cap;
+};
+
+// Struct to hold a directory entry as returned by getdents64
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Struct to hold an open directory that queued subdirectories are opened
+// relative to. The descriptor is closed when the last reference is released
+struct dir_handle {
+    int fd;
+    int refs;
+};
+
+// Struct to hold a directory that is waiting to be walked. The usage
+// under the directory rolls up into the result slot, and depth is the
+// depth of the directory below the target. If parent is set, the
+// directory is opened relative to it using name, which points at the
+// last component of path. Items with names instead hold a batch of
+// n_names entries of the top level of a target to stat, packed one
+// after another with their terminating null, relative to parent.
+struct work_item {
+    char* path;
+    char* name;
+    char* names;
+    unsigned int n_names;
+    struct dir_handle *parent;
+    struct tr_args *slot;
+    unsigned int depth;
+    long long unsigned int devnum;
+};
+
+// Struct to hold a directory being walked by the io_uring engine. Status
+// is the result of opening and stat'ing the directory, 0 or -errno
+struct uring_dir {
+    struct work_item *item;
+    struct dir_handle *handle;
+    struct stat meta;
+    struct dir_scan scan;
+    int status;
+};
+
+// Struct to hold an operation that is in flight on an io_uring. The
+// statx result and the entry name must stay valid until it completes
+struct uring_op {
+    int kind;
+    struct uring_dir *dir;
+    long long unsigned int start;
+    struct statx stx;
+    char name[NAME_MAX+1];
+};
+
+// Struct to hold an io_uring instance mapped into memory, and the pool of
+// operation slots. The number of slots equals the number of submission
+// entries, so submissions never overflow the rings.
+struct uring {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+    unsigned int entries;
+    unsigned int queued;
+    struct uring_op *ops;
+    unsigned int *free_ops;
+    unsigned int n_free;
+};
+
+// Struct to hold a double-ended queue of work items. The owning worker
+// pushes and pops at the tail, and idle workers steal from the head so
+// they take the oldest (typically largest) subtrees
+struct work_deque {
+    struct work_item **items;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int capacity;
+    pthread_mutex_t lock;
+};
+
+// Counters of a thread. Each thread updates only its own counters, with
+// relaxed atomic stores, so the reporter can read them at any time
+// without locks. Stat latencies are counted in a log-linear histogram
+// with 4 buckets per power of two nanoseconds. The path is the directory
+// the thread is working on, and seq is odd while it is being copied.
+struct metrics {
+    long long unsigned int entries;
+    long long unsigned int bytes;
+    long long unsigned int dirs;
+    long long unsigned int errors;
+    long long unsigned int latency[LATENCY_BUCKETS];
+    unsigned int seq;
+    char path[MAXPATHLEN];
+};
+
+// Struct to hold the state of a worker thread. Usage is accumulated
+// locally for one result slot at a time and flushed to the shared
+// result when the worker moves to a different slot, along with the
+// number of work items of the slot that the worker has finished
+struct worker {
+    unsigned int id;
+    pthread_t thread;
+    struct work_deque deque;
+    struct tr_args *slot;
+    long done;
+    struct id_table usage;
+    struct id_table named;
+    struct acct_table acct;
+    struct hist_table hist;
+    struct link_table links;
+    struct cache_store cache;
+    char* dirbuf;
+    char* pathbuf;
+    size_t pathbuf_len;
+    struct uring *ring;
+    struct metrics metrics;
+    struct arena arena;
+};
+
+// Workers that walk the directory tree. With -t auto, workers are added
+// while the walk runs, so n_workers is read atomically by other threads.
+struct worker *workers = NULL;
+unsigned int n_workers = 0;
+
+// Struct to hold one window of the tuning of the number of workers: the
+// workers that were active, the stats completed per second and their
+// mean latency
+struct tune_step {
+    long long unsigned int elapsed_ms;
+    unsigned int workers;
+    long long unsigned int stats_per_sec;
+    long long unsigned int latency_ns;
+};
+
+// With -t auto, the tuner thread sets the number of active workers after
+// each window from the stats completed in it. Workers with an index of at
+// least active_workers wait on bench_cond until it is raised again, and
+// tune_steps holds the trajectory for the output.
+bool auto_threads = false;
+unsigned int active_workers = 0;
+unsigned int initial_workers = 0;
+pthread_cond_t bench_cond = PTHREAD_COND_INITIALIZER;
+long long unsigned int tune_ops = 0;
+long long unsigned int tune_ns = 0;
+struct tune_step *tune_steps = NULL;
+unsigned int n_tune_steps = 0;
+unsigned int tune_capacity = 0;
+pthread_t tuner;
+bool tuner_started = false;
+
+// Results for directories deeper than the subdirectories of the target,
+// in the order they were created, so every result follows its parent
+struct tr_args **tree_nodes = NULL;
+unsigned int n_tree_nodes = 0;
+unsigned int tree_capacity = 0;
+pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The cache read at startup, the time the walk started, and the records
+// for the cache that is written when the walk completes
+const struct cache_header *cache_in = NULL;
+size_t cache_in_len = 0;
+time_t cache_start = 0;
+struct cache_store cache_out;
+
+// Usage by accounting key of the whole walk. The top level of each target
+// is added as it is read, and the table of each worker once it exits.
+struct acct_table walk_acct;
+
+// Histograms by ID of the whole walk, collected like walk_acct
+struct hist_table walk_hist;
+
+// Files with multiple links counted by a walk with --shard, collected
+// like walk_acct
+struct link_table walk_links;
+
+// Serializes streamed results, and holds the summary they add up to
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+struct id_table stream_summary;
+long long unsigned int stream_total = 0;
+
+// Number of work items that are queued or being processed. Updated
+// atomically, and the walk is complete when it reaches 0
+long pending_work = 0;
+
+// Number of workers that are searching for work. Updated atomically,
+// and used by busy workers to decide when to give away subtrees
+int idle_workers = 0;
+
+// Workers that find no work wait on the condition until work is queued,
+// the walk is complete or the walk is cut short. The number waiting is
+// updated atomically so that queueing work only takes the lock when a
+// worker needs to be woken.
+pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+int n_parked = 0;
+
+// Seconds between progress reports on stderr, or 0
+unsigned int progress_interval = 0;
+
+// File that SIGUSR1 dumps the metrics to instead of stderr, or NULL
+char* metrics_path = NULL;
+
+// Time each stat, which is only done when the latencies are reported
+// or drive the backoff
+bool time_stats = false;
+
+// Shared limit on the rate of stat and readdir operations. Interval is
+// the time between operations at the current rate, or 0 when the rate is
+// not limited, and next is the time the next operation may start. With a
+// backoff target, the interval is doubled after each window in which the
+// average stat latency was above the target, and shortened again toward
+// min_interval otherwise.
+struct throttle {
+    pthread_mutex_t lock;
+    long long unsigned int interval;
+    long long unsigned int min_interval;
+    long long unsigned int next;
+    long long unsigned int target;
+    long long unsigned int window_start;
+    long long unsigned int window_ns;
+    long long unsigned int window_ops;
+    long long unsigned int waits;
+    long long unsigned int backoffs;
 };
+struct throttle throttle = {.lock = PTHREAD_MUTEX_INITIALIZER};
+bool throttling = false;
+
+// Arena the current thread creates results in, and the arena that holds
+// the results of the launching thread and, once they exit, the workers
+__thread struct arena *thread_arena = NULL;
+struct arena result_arena;
+
+// Counters of the current thread, the launching thread and the walk
+__thread struct metrics *thread_metrics = NULL;
+struct metrics walk_metrics;
+long long unsigned int walk_start = 0;
+unsigned int n_top = 0;
+unsigned int n_top_done = 0;
+
+// Thread that prints progress and dumps the metrics on SIGUSR1. The
+// stop flag is set by the launching thread and read atomically.
+pthread_t reporter;
+bool reporter_started = false;
+bool reporter_stop = false;
+
+// Names of the IDs in the output, and of the IDs of the other kind that
+// --accounting also reports
+struct name_cache name_cache = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+struct name_cache other_names = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
 
 /* SYNOPSIS
  *   Convenience routine to parse a command line argument to a positive integer
@@ -129,1124 +820,7573 @@ int parse_num(char* arg) {
     return (int)i; 
 }
 
+
 /* SYNOPSIS
- *   Find the index where the argument GID is stored in the GID table. This
- *   operation uses hashing to locate an initial location and then searches
- *   forward incrementally to find the actual position. If the GID is not
- *   found the index where it should be inserted is returned.
+ *   Parse a size in bytes, with an optional K, M, G, T or P suffix for
+ *   powers of 1024
  *
- * ARGUMENT
- *   int gid : The GID to locate
- *   unsigned int gids[] : The GID array to search
+ * ARGUMENTS
+ *   char* arg : The character data to parse
+ *   long long unsigned int *size : Where the size is stored
  *
  * RETURNS
- *   int : >=0 on success, -1 on error
+ *   int : 0 on success, 1 on error
  */
-int find_index(int gid, unsigned int gids[]) {
-    int index = gid % MAXGIDS;
-    int i = index;
-  
-    do {
-        if(gids[i] == gid)
-            return i;
-        else if(gids[i] == UINT_MAX) {
-            gids[i] = gid;
-            return i;
-        }
-        i = (i+1)%MAXGIDS;
-    } while(i!=index);
-    
-    // Table is full and does not contain
-    // an entry for the query GID
-    return -1;
-}
+int parse_size(char* arg, long long unsigned int *size) {
+    char* units = "KMGTP";
+    char* end;
+    char* unit;
+    long long unsigned int value;
+    int shift;
 
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if(arg == end || arg[0] == '-' || errno == ERANGE)
+        return 1;
+    if(*end != '\0') {
+        if((unit=strchr(units, *end)) == NULL || end[1] != '\0')
+            return 1;
+        // Reject sizes that do not fit once scaled by the unit
+        shift = 10*(int)(unit-units+1);
+        if(value > ULLONG_MAX >> shift)
+            return 1;
+        value <<= shift;
+    }
+    *size = value;
+    return 0;
+}
 
 /* SYNOPSIS
- *   Copy the user/group name corresponding to the argument UID/GID to the 
- *   argument buffer. If the UID/GID cannot be mapped to a name, the numeric
- *   UID/GID is copied to the buffer as a string.
+ *   Parse the argument of --age: a time field, atime, mtime or ctime,
+ *   optionally followed by a colon and increasing ages in days separated
+ *   by commas. The ages default to 30, 90 and 365 days.
  *
- * ARGUMENT
- *   unsigned int id : The UID/GID to map to a name
- *   char* name : Buffer to copy the name to
+ * ARGUMENTS
+ *   char* arg : The character data to parse
  *
  * RETURNS
- *   0 on success, 1 if the GID could not be mapped
+ *   int : 0 on success, 1 on error
  */
-int get_name(unsigned int id, char* name) {
-    if(summarize_by_user) {
-        struct passwd *usr = getpwuid(id);
-        if(usr == NULL) {
-            sprintf(name, "%u", id);
-            return 1;
-        }
-        else {
-            sprintf(name, "%s", usr->pw_name);
-            return 0;
-        }
+int parse_ages(char* arg) {
+    char* end = strchr(arg, ':');
+    size_t n = end == NULL ? strlen(arg) : (size_t)(end-arg);
+    long value;
+
+    if(n == 5 && strncmp(arg, "atime", 5) == 0)
+        age_field = AGE_ATIME;
+    else if(n == 5 && strncmp(arg, "mtime", 5) == 0)
+        age_field = AGE_MTIME;
+    else if(n == 5 && strncmp(arg, "ctime", 5) == 0)
+        age_field = AGE_CTIME;
+    else
+        return 1;
+
+    if(end == NULL) {
+        age_days[0] = 30;
+        age_days[1] = 90;
+        age_days[2] = 365;
+        n_ages = 3;
+        return 0;
     }
-    else {
-        struct group *grp = getgrgid(id); 
-        if(grp == NULL) {
-            sprintf(name, "%u", id);
+
+    n_ages = 0;
+    do {
+        arg = end+1;
+        errno = 0;
+        value = strtol(arg, &end, 10);
+        if(arg == end || errno == ERANGE || value < 1 || value > 1000000 || n_ages == MAXAGES)
             return 1;
-        }
-        else {
-            sprintf(name, "%s", grp->gr_name);
-            return 0;
-        }
-    }
+        if(n_ages > 0 && value <= age_days[n_ages-1])
+            return 1;
+        age_days[n_ages++] = value;
+    } while(*end == ',');
+    return *end == '\0' ? 0 : 1;
 }
 
+/* SYNOPSIS
+ *   Parse the argument of --shard: the slice walked by this process and
+ *   the number of slices, as in 2/8. Slices are numbered from 0.
+ *
+ * ARGUMENTS
+ *   char* arg : The character data to parse
+ *
+ * RETURNS
+ *   int : 0 on success, 1 on error
+ */
+int parse_shard(char* arg) {
+    char* end;
+    long index, count;
+
+    errno = 0;
+    index = strtol(arg, &end, 10);
+    if(arg == end || *end != '/' || errno == ERANGE)
+        return 1;
+    arg = end+1;
+    count = strtol(arg, &end, 10);
+    if(arg == end || *end != '\0' || errno == ERANGE)
+        return 1;
+    if(count < 1 || count > MAXSHARDS || index < 0 || index >= count)
+        return 1;
+    shard = index;
+    n_shards = count;
+    return 0;
+}
 
 /* SYNOPSIS
- *   Adds an inode to the database if it does not exist
+ *   Initialize an empty ID table
  *
  * ARGUMENT
- *   long long unsigned int num : inode number
- *   struct inode_entry* table[] : inode database
+ *   struct id_table *table : The table to initialize
  *
  * RETURN
- *   0 if the inode was added, 1 if it already existed
+ *   Void
  */
-int insert_inode(long long unsigned int num, struct inode_entry* table[]) {
-    int index = num % INODETABLE;
-    struct inode_entry *entry = table[index];
-    
-    // Starting new linked list
-    if(entry == NULL) {
-        entry = malloc(sizeof(struct inode_entry));
-        entry->num = num;
-        entry->next = NULL;
-	if(trace)
-            printf("Added new entry for inode %llu\n", num);
-	table[index] = entry;
-	return 0;
-    }
-
-    // Find existing inode or end of linked list
-    while(1) {
-	if(entry->num == num)
-	    return 1;
-	else if(entry->next == NULL)
-	    break;
-	else
-	    entry = entry->next;
-    }
-
-    // Insert new inode
-    entry->next = malloc(sizeof(struct inode_entry));
-    ((struct inode_entry *)(entry->next))->num = num;
-    ((struct inode_entry *)(entry->next))->next = NULL;
-    if(trace)
-        printf("Added LL node for inode %llu\n", num);
-    return 0;
+void id_table_init(struct id_table *table) {
+    table->n_hot = 0;
+    table->entries = NULL;
+    table->capacity = 0;
+    table->n_entries = 0;
 }
 
 
 /* SYNOPSIS
- *   Frees the memory allocated to tracking inodes
+ *   Free the memory held by an ID table, leaving it empty
  *
  * ARGUMENT
- *   struct inode_entry* table[] : inode database
+ *   struct id_table *table : The table to free
  *
  * RETURN
- *   Always 0
+ *   Void
  */
-int free_inode_table(struct inode_entry* table[]) {
-    int i;
-    struct inode_entry *entry, *next;
-    for(i=0;i<INODETABLE;i++) {
-	entry = NULL;
-	next = NULL;
-        if(table[i] != NULL)
-            entry = table[i];
-            
-	while(entry != NULL) {
-            next = entry->next;
-	    free(entry);
-	    entry = next;
-        }
-    }
-    return 0;
+void id_table_free(struct id_table *table) {
+    free(table->entries);
+    id_table_init(table);
 }
 
+
 /* SYNOPSIS
- *   Add a new GID to the group database with intial size, or update an 
- *   existing entry
+ *   Remove all IDs from a table, keeping its memory for reuse
  *
  * ARGUMENT
- *   unsigned int gid : GID to insert/update
- *    long long unsigned int size : size for initialization or increment
- *    unsigned int gids[]: GID database
- *    long long unsigned int sizes[]: Size database
+ *   struct id_table *table : The table to clear
  *
  * RETURN
- *   0 on success, 1 if the database is full and the GID cannot be inserted
+ *   Void
  */
-int insert_or_update(unsigned int gid, long long unsigned int size, unsigned int gids[], long long unsigned int sizes[]) {
-    int index = find_index(gid, gids);
-    if(index == -1) {
-        exit_now = true;
-        exit_status = 2;
-        return 1;
+void id_table_clear(struct id_table *table) {
+    unsigned int i;
+    table->n_hot = 0;
+    if(table->n_entries > 0) {
+        for(i=0;i<table->capacity;i++)
+            table->entries[i].id = UINT_MAX;
+        table->n_entries = 0;
     }
-    sizes[index] += size;
-    return 0;
 }
 
 
 /* SYNOPSIS
- *   Store an error message
+ *   Double the capacity of the overflow table of an ID table and reinsert
+ *   its entries
  *
  * ARGUMENT
- *   char* path : The file/directory path where the error was encountered
- *   char* error : The error message
+ *   struct id_table *table : The table to grow
  *
  * RETURN
- *   0 on success, 1 if the maximum number of errors has been exceeded
+ *   0 on success, 1 if memory could not be allocated
  */
-int store_error(char* path, char* error) {
-    if(n_errors >= max_errors) {
-        exit_now = true;
-        exit_status = 3;
-        return 1;
-    }
+int id_table_grow(struct id_table *table) {
+    unsigned int i, j, capacity = table->capacity == 0 ? 16 : table->capacity*2;
+    struct id_entry *entries = malloc(capacity*sizeof(struct id_entry));
 
-    // Use mutex to manage concurrent access to global
-    // errors array
-    pthread_mutex_lock(&error_mutex);
+    if(entries == NULL)
+        return 1;
+    for(i=0;i<capacity;i++)
+        entries[i].id = UINT_MAX;
 
-    int total_length = strlen(path)+strlen(error);
-    error_strs[n_errors] = malloc(total_length+10);
-    if(error_strs[n_errors] == NULL) {
-        printf("Could not allocate memory to store errors. Exiting as memory appears exhausted\n");
-	exit_now = true;
-	exit_status = 4;
-	return 1;
+    for(i=0;i<table->capacity;i++) {
+        if(table->entries[i].id == UINT_MAX)
+            continue;
+        j = (table->entries[i].id * 0x9e3779b1u) & (capacity-1);
+        while(entries[j].id != UINT_MAX)
+            j = (j+1) & (capacity-1);
+        entries[j] = table->entries[i];
     }
-
-    sprintf(error_strs[n_errors], "%s: %s", path, error);
-    n_errors++;
-
-    pthread_mutex_unlock(&error_mutex);
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
     return 0;
 }
 
 
-int find_or_store_exclude_inode(long long unsigned int inode, bool store) {
-    int index = inode % MAXEXCLUDE;
-    int i = index;
+/* SYNOPSIS
+ *   Add usage for an ID to a table, inserting the ID if it is new. The
+ *   first IDHOT IDs are kept inline in the table, which covers most
+ *   directories, and further IDs go to a growable open addressed table.
+ *
+ * ARGUMENT
+ *   struct id_table *table : The table to update
+ *   unsigned int id : UID/GID to insert/update
+ *   long long unsigned int size : size for initialization or increment
+ *
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int id_table_add(struct id_table *table, unsigned int id, long long unsigned int size) {
+    unsigned int i;
 
-    do {
-        if(exclude_inodes[i] == inode)
+    for(i=0;i<table->n_hot;i++) {
+        if(table->hot[i].id == id) {
+            table->hot[i].size += size;
             return 0;
-        else if(exclude_inodes[i] == 0) { 
-            if(store) {
-                exclude_inodes[i] = inode;
-		return 0;
-	    }
-	    else
-                return 1;
         }
-        i = (i+1)%MAXEXCLUDE;
-    } while(i!=index);
-
-    // Table is full and does not already contain
-    // an inode for the argument path
-    return 2;
-}
+    }
+    if(table->n_hot < IDHOT) {
+        table->hot[table->n_hot].id = id;
+        table->hot[table->n_hot].size = size;
+        table->n_hot++;
+        return 0;
+    }
 
+    // Grow the overflow table when it is 3/4 full
+    if((table->n_entries+1)*4 > table->capacity*3 && id_table_grow(table) != 0)
+        return 1;
 
-int is_excluded(long long unsigned int inode) {
-    return find_or_store_exclude_inode(inode, false) == 0;
+    i = (id * 0x9e3779b1u) & (table->capacity-1);
+    while(table->entries[i].id != id) {
+        if(table->entries[i].id == UINT_MAX) {
+            table->entries[i].id = id;
+            table->entries[i].size = 0;
+            table->n_entries++;
+            break;
+        }
+        i = (i+1) & (table->capacity-1);
+    }
+    table->entries[i].size += size;
+    return 0;
 }
 
 
-/*
+/* SYNOPSIS
+ *   Find the entry of an ID in a table
+ *
+ * ARGUMENT
+ *   struct id_table *table : The table
+ *   unsigned int id : UID/GID to find
+ *
+ * RETURN
+ *   The entry, or NULL if the ID is not in the table
  */
-int store_exclude(char* path) {
-    struct stat meta;
-    if(lstat(path, &meta) != 0) {
-        printf("Error: argument path %s does not exist\n", path);
-        return 1;
+struct id_entry* id_table_find(struct id_table *table, unsigned int id) {
+    unsigned int i;
+
+    for(i=0;i<table->n_hot;i++) {
+        if(table->hot[i].id == id)
+            return &table->hot[i];
     }
-    int status = find_or_store_exclude_inode(meta.st_ino, true);
-    if(status == 0 && verbose)
-        printf("+dug       Added exclude entry for %s using inode %lu\n", path, meta.st_ino);
-    if(status == 2)
-	printf("-dug       Could not store inode for %s. The inode table for tracking exclude files is full\n", path);
-    return status;
+    if(table->n_entries == 0)
+        return NULL;
+
+    i = (id * 0x9e3779b1u) & (table->capacity-1);
+    while(table->entries[i].id != UINT_MAX) {
+        if(table->entries[i].id == id)
+            return &table->entries[i];
+        i = (i+1) & (table->capacity-1);
+    }
+    return NULL;
 }
 
 
-
-
 /* SYNOPSIS
- *   Escape/remove special characters so the string is a valid JSON string
+ *   Iterate over the entries of an ID table
  *
  * ARGUMENT
- *   char* path : The initial string
- *   char* escaped : Buffer to hold the escaped string
+ *   struct id_table *table : The table
+ *   unsigned int *pos : Iteration state, set to 0 before the first call
  *
  * RETURN
- *   Always 0
+ *   The next entry, or NULL when all entries have been returned
  */
-int json_escape_str(char* path, char* escaped) {
-    int len = strlen(path);
-    int i,j=0;
-    for(i=0;i<len;i++) {
-        if(path[i] == '\\') {
-            escaped[j] = '\\';
-            escaped[j+1] = '\\';
-            j+=2; 
-        }
-        else if(path[i] == '\n' || path[i] == '\r' || path[i] == '\b') {
-            escaped[j] = '_';
-            j+=1;
-        }
-        else {
-            escaped[j] = path[i];
-            j+=1;
-        }   
+struct id_entry* id_table_next(struct id_table *table, unsigned int *pos) {
+    while(*pos < table->n_hot + table->capacity) {
+        (*pos)++;
+        if(*pos <= table->n_hot)
+            return &table->hot[*pos-1];
+        if(table->entries[*pos-1-table->n_hot].id != UINT_MAX)
+            return &table->entries[*pos-1-table->n_hot];
     }
-    escaped[j] = '\0';
-    return 0;
+    return NULL;
 }
 
 
 /* SYNOPSIS
- *   If the command failed, outputs a JSON formatted failure
+ *   Add all usage in one ID table to another
  *
  * ARGUMENT
- *   None
+ *   struct id_table *dst : The table to update
+ *   struct id_table *src : The table to add
  *
  * RETURN
- *   Always 0
+ *   0 on success, 1 if memory could not be allocated
  */
-int json_output_failure() {
-    int i;
-
-    printf("{\n  \"failure\": true,\n  \"errors\": [\n");
-    for(i=0;i<n_errors;i++) {
-        if(i > 0)
-            printf(",\n");
-        printf("    \"%s\"", error_strs[i]);
+int id_table_merge(struct id_table *dst, struct id_table *src) {
+    unsigned int pos = 0;
+    struct id_entry *entry;
+    while((entry=id_table_next(src, &pos)) != NULL) {
+        if(id_table_add(dst, entry->id, entry->size) != 0)
+            return 1;
     }
-    printf("\n  ]\n}\n");
-
     return 0;
 }
 
+
 /* SYNOPSIS
- *   Format size in bytes to a human readable number (size and unit B,K,M,G,T,P)
- *   if human_readable is true and stores in return buffer. If human_readable
- *   is false, stores the size in bytes in the buffer with no unit.
+ *   Number of IDs in a table
  *
  * ARGUMENT
- *   unsigned long long int: usage in bytes
- *   char* buffer: Buffer where formatted size is stored
+ *   struct id_table *table : The table
  *
  * RETURN
- *   0 on success, 1 on failure
+ *   The number of IDs
  */
-int format_size(unsigned long long int size, char* buffer) {
-    char units[7] = {'B','K','M','G','T','P','E'};
-    unsigned long long step = 1024;
-    unsigned long long int mag = 1;
-    unsigned int i=0, reduced;
-
-    if(!human_readable) {
-        sprintf(buffer, "%llu", size);
-	return 0;
-    }
-
-    while(i<6) {
-        if(size < mag*step) {
-	    reduced = (int)(size/mag);
-            sprintf(buffer, "%u%c", reduced, units[i]);
-	    return 0;
-	}
-	i++; 
-	mag=mag*step;
-    }
-
-    // Default to exabytes
-    reduced = (int)(size/mag);
-    sprintf(buffer, "%u%c", reduced, units[i]);
-    return 1;
+unsigned int id_table_size(struct id_table *table) {
+    return table->n_hot + table->n_entries;
 }
 
 
 /* SYNOPSIS
- *   Output result in plain text format
+ *   Add usage to an accounting key, growing the table when it is three
+ *   quarters full
  *
  * ARGUMENT
- *   void* results : Results database
- *   int n_results : Number of results
- *   long long unsigned int total: The total use across all files in result
+ *   struct acct_table *table : The table
+ *   long long unsigned int key : The key
+ *   long long unsigned int bytes : Size of the blocks occupied
+ *   long long unsigned int apparent : Apparent size
+ *   long long unsigned int files : Number of files
  *
  * RETURN
- *   Always 0
+ *   0 on success, 1 if memory could not be allocated
  */
-int output_table(void* results, int n_results, long long unsigned int total) {
-    struct tr_args **descendents = results;
-    int i, j;
-    unsigned long long int gid, size;
-    char* name_buffer = malloc(MAXPATHLEN);
-    char* size_buffer = malloc(1024);
-    if(n_errors > 0) {
-        printf("=================== Errors ===================\n");
-        for(i=0;i<n_errors;i++)
-            printf("%s\n", error_strs[i]);
-        printf("\n\n");
-    }
-   
-    printf("=================== Sub Directories ====================\n"); 
-    for(i=0;i<n_results-1;i++) {
-        json_escape_str(descendents[i]->path, name_buffer);
-        printf("%s\n", name_buffer);
-        for(j=0;j<**(descendents[i]->n_results)*2;j+=2) {
-            gid = (*(descendents[i]->data))[j];
-            size = (*(descendents[i]->data))[j+1];
-            if(output_names)
-                get_name(gid, name_buffer);
-            else
-                sprintf(name_buffer, "%llu", gid);
-            format_size(size, size_buffer);
-            printf("%24s  %s\n", name_buffer, size_buffer);
+int acct_add(struct acct_table *table, long long unsigned int key, long long unsigned int bytes, long long unsigned int apparent, long long unsigned int files) {
+    struct acct_entry *old = table->entries, *entry;
+    unsigned int i, capacity = table->capacity, mask;
+
+    if(4*(table->n_entries+1) > 3*table->capacity) {
+        table->capacity = capacity == 0 ? 64 : capacity*2;
+        table->entries = malloc(table->capacity*sizeof(struct acct_entry));
+        if(table->entries == NULL) {
+            table->entries = old;
+            table->capacity = capacity;
+            return 1;
         }
-        printf("\n");
+        for(i=0;i<table->capacity;i++)
+            table->entries[i].key = ACCTEMPTY;
+        table->n_entries = 0;
+        for(i=0;i<capacity;i++)
+            if(old[i].key != ACCTEMPTY)
+                acct_add(table, old[i].key, old[i].bytes, old[i].apparent, old[i].files);
+        free(old);
     }
-    printf("\n=================== Summaries ===================\n");
-    for(j=0;j<**(descendents[n_results-1]->n_results)*2;j+=2) {
-        gid = (*(descendents[n_results-1]->data))[j];
-        size = (*(descendents[n_results-1]->data))[j+1];
-        if(output_names)
-            get_name(gid, name_buffer);
-        else
-            sprintf(name_buffer, "%llu", gid);
-        format_size(size, size_buffer);
-        printf("%24s  %s\n", name_buffer, size_buffer);
-    }
-    format_size(total, size_buffer);
-    printf("%24s  %s\n", "Total", size_buffer);
-    free(name_buffer);
-    free(size_buffer);
+
+    mask = table->capacity-1;
+    i = (key*0x9e3779b97f4a7c15ULL) >> 32 & mask;
+    while(table->entries[i].key != key && table->entries[i].key != ACCTEMPTY)
+        i = (i+1) & mask;
+    entry = &table->entries[i];
+    if(entry->key == ACCTEMPTY) {
+        entry->key = key;
+        entry->bytes = entry->apparent = entry->files = 0;
+        table->n_entries++;
+    }
+    entry->bytes += bytes;
+    entry->apparent += apparent;
+    entry->files += files;
     return 0;
 }
 
 
 /* SYNOPSIS
- *   Outputs the result of the command as a JSON object
+ *   Add all usage of one accounting table to another
  *
  * ARGUMENT
- *   void* results : Results database
- *   int n_results : Number of results
- *   long long unsigned int total: The total use across all files in result
+ *   struct acct_table *dst : The table added to
+ *   struct acct_table *src : The table added
  *
  * RETURN
- *   Always 0
+ *   0 on success, 1 if memory could not be allocated
  */
-int output_json(void* results, int n_results, long long unsigned int total) {
-    struct tr_args **descendents = results;
-    int i, j;
-    int out_dir = 0, out_size = 0;
-    unsigned long long int gid, size;
-    char* name_buffer = malloc(MAXPATHLEN);
-    printf("{\n  \"errors\": [\n");
-    
-    for(i=0;i<n_errors;i++) {
-        if(i > 0)
-            printf(",\n");
-        printf("    \"%s\"", error_strs[i]);
-    }
-    printf("\n  ],\n  \"subdirs\": {\n");
-    for(i=0;i<n_results-1;i++) {
-        out_size = 0;
-        if(out_dir > 0)
-            printf(",\n");
-        out_dir += 1;
-
-        json_escape_str(descendents[i]->path, name_buffer);
-        printf("    \"%s\": {\n", name_buffer);
-        for(j=0;j<**(descendents[i]->n_results)*2;j+=2) {
-            gid = (*(descendents[i]->data))[j];
-            size = (*(descendents[i]->data))[j+1];
-            if(output_names)
-                get_name(gid, name_buffer);
-            else
-                sprintf(name_buffer, "%llu", gid);
-            if(out_size > 0)
-                printf(",\n");
-            out_size += 1;
-            printf("      \"%s\":%llu", name_buffer, size);
-        }
-        printf("\n    }");
-    }
-    printf("\n  },\n");
+int acct_merge(struct acct_table *dst, struct acct_table *src) {
+    unsigned int i;
 
-    // Output the group totals summary
-    out_size = 0;
-    printf("  \"summary\": {\n");
-    for(j=0;j<**(descendents[n_results-1]->n_results)*2;j+=2) {
-        gid = (*(descendents[n_results-1]->data))[j];
-        size = (*(descendents[n_results-1]->data))[j+1];
-        if(output_names)
-            get_name(gid, name_buffer);
-        else
-            sprintf(name_buffer, "%llu", gid);
-        if(out_size > 0)
-            printf(",\n");
-        out_size += 1;
-        printf("    \"%s\":%llu", name_buffer, size);
-    }
-    printf("\n  },\n");
+    for(i=0;i<src->capacity;i++)
+        if(src->entries[i].key != ACCTEMPTY && acct_add(dst, src->entries[i].key, src->entries[i].bytes, src->entries[i].apparent, src->entries[i].files) != 0)
+            return 1;
+    return 0;
+}
 
-    // Output the grand total 
-    printf("  \"total\":%llu", total);
-    printf("\n}\n");
-    free(name_buffer);
+
+/* SYNOPSIS
+ *   Compare accounting entries by key, for qsort and bsearch
+ */
+int compare_acct(const void* a, const void* b) {
+    const struct acct_entry *x = a, *y = b;
+
+    if(x->key != y->key)
+        return x->key < y->key ? -1 : 1;
     return 0;
 }
 
-/* SYNOPSIS:
- *   Initialize a new empty result
+
+/* SYNOPSIS
+ *   Copy the entries of an accounting table to an array sorted by key
  *
  * ARGUMENT
- *   struct tr_args **result : Pointer to an address where we will initialize the
- *                             result 
- *   char* dir : The file/directory path associated with the result
+ *   struct acct_table *table : The table
+ *
+ * RETURN
+ *   The array of table->n_entries entries, or NULL if memory could not be
+ *   allocated
+ */
+struct acct_entry* acct_sorted(struct acct_table *table) {
+    struct acct_entry *sorted = malloc((table->n_entries+1)*sizeof(struct acct_entry));
+    unsigned int i, n = 0;
+
+    if(sorted == NULL)
+        return NULL;
+    for(i=0;i<table->capacity;i++)
+        if(table->entries[i].key != ACCTEMPTY)
+            sorted[n++] = table->entries[i];
+    qsort(sorted, n, sizeof(struct acct_entry), compare_acct);
+    return sorted;
+}
+
+
+/* SYNOPSIS
+ *   Free the storage of an accounting table, leaving it empty
+ *
+ * ARGUMENT
+ *   struct acct_table *table : The table
  *
  * RETURN
  *   Void
  */
-void init_result(struct tr_args **result, char* dir) {
-    (*result) = (struct tr_args*)malloc(sizeof(struct tr_args));
-    (*result)->path = malloc(strlen(dir)+1);
-    sprintf((*result)->path, "%s", dir);
-    (*result)->n_results = (int**)malloc(sizeof(int**));
-    (*result)->data = (long long unsigned int**)malloc(sizeof(long long unsigned int**));
+void acct_free(struct acct_table *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = table->n_entries = 0;
 }
 
 
 /* SYNOPSIS
- *   Free the memory allocated to a result
+ *   Find the histograms of an ID, adding empty histograms if it is new
  *
  * ARGUMENT
- *   struct tr_args **result : Pointer to the address of a result
+ *   struct hist_table *table : The table
+ *   unsigned int id : The UID/GID
  *
  * RETURN
- *   Void 
+ *   The histograms, or NULL if memory could not be allocated
  */
-void free_result(struct tr_args **result) {
-  free(*((*result)->data));
-  free((*result)->data);
-  free(*((*result)->n_results));
-  free((*result)->n_results);
-  free((*result)->path);
-  free(*result);
+struct histogram* hist_find(struct hist_table *table, unsigned int id) {
+    struct id_entry *entry = id_table_find(&table->index, id);
+    struct histogram *grown;
+
+    if(entry != NULL)
+        return &table->hists[entry->size];
+
+    if(table->n_hists == table->capacity) {
+        grown = realloc(table->hists, (table->capacity == 0 ? 8 : table->capacity*2)*sizeof(struct histogram));
+        if(grown == NULL)
+            return NULL;
+        table->hists = grown;
+        table->capacity = table->capacity == 0 ? 8 : table->capacity*2;
+    }
+    if(id_table_add(&table->index, id, table->n_hists) != 0)
+        return NULL;
+    memset(&table->hists[table->n_hists], 0, sizeof(struct histogram));
+    table->hists[table->n_hists].id = id;
+    return &table->hists[table->n_hists++];
 }
 
 
 /* SYNOPSIS
- *   Copies the database of storage-by-gid into a result structure. The
- *   method interleaves the arrays of gid[] and size[] into a single
- *   array of pairs
+ *   Add a regular file to the age and size histograms of its ID
+ *
  * ARGUMENT
- *   struct tr_args *result : Address of result to populate
- *   unsigned int gids[]: GIDs of groups that were encountered
- *   long long unsigned int sizes[]: Storage usage for each GID encountered
+ *   struct hist_table *table : The table
+ *   unsigned int id : The UID/GID the file is counted under
+ *   struct stat *meta : Metadata of the file
+ *   long long unsigned int audit_size : Size the file is counted with
+ *
  * RETURN
- *   Void
+ *   0 on success, 1 if memory could not be allocated
  */
-void pack_result(struct tr_args *result, unsigned int gids[], long long unsigned int sizes[]) {
-    int n_groups = 0;
-    int i, j;
+int hist_add(struct hist_table *table, unsigned int id, struct stat *meta, long long unsigned int audit_size) {
+    struct histogram *hist;
+    time_t when = 0;
+    long long int days;
+    int i = 0;
+
+    if(!S_ISREG(meta->st_mode))
+        return 0;
+    if((hist=hist_find(table, id)) == NULL)
+        return 1;
 
-    // Size of packed result is size of groups encoutered,
-    // so we sweep the GID table one time to find how many
-    // groups are stored
-    for(i=0;i<MAXGIDS;i++) {
-        if(gids[i] != UINT_MAX)
-            n_groups += 1;
+    if(age_field != AGE_NONE) {
+        if(age_field == AGE_ATIME)
+            when = meta->st_atim.tv_sec;
+        else if(age_field == AGE_MTIME)
+            when = meta->st_mtim.tv_sec;
+        else
+            when = meta->st_ctim.tv_sec;
+        days = (age_now - when)/86400;
+        while(i < n_ages && days >= age_days[i])
+            i++;
+        hist->age_bytes[i] += audit_size;
+        hist->age_files[i]++;
     }
-    *(result->n_results) = (int*)malloc(sizeof(int)); 
-    *(*(result->n_results)) = n_groups;
-    *(result->data) = calloc(n_groups*2, sizeof(long long unsigned int));
-    j = 0;
-    for(i=0;i<MAXGIDS;i++) {
-        if(gids[i] != UINT_MAX) {
-            (*(result->data))[j] = gids[i];
-            (*(result->data))[j+1] = sizes[i];
-            j += 2;
-        }
+
+    if(size_histogram) {
+        i = meta->st_size <= 0 ? 0 : 64-__builtin_clzll(meta->st_size);
+        hist->size_bytes[i] += audit_size;
+        hist->size_files[i]++;
     }
+    return 0;
 }
 
+
 /* SYNOPSIS
- *   Iterates over all results generated to compile a summary of total
- *   usage by group
+ *   Add all histograms of one table to another
+ *
  * ARGUMENT
- *   void* tstructs: A pointer to the array oif results
- *   int n_results: The number of results in the array
- *   long long unsigned int *total: Address where a grand total is stored
+ *   struct hist_table *dst : The table added to
+ *   struct hist_table *src : The table added
+ *
  * RETURN
- *   0 on success, 1 on failure
+ *   0 on success, 1 if memory could not be allocated
  */
-int add_summary(void* tstructs, int n_results, long long unsigned int *total) {
-    struct tr_args **results = tstructs;
-    int i, j;
-    unsigned long long int size, sizes[MAXGIDS];
-    unsigned int gid, gids[MAXGIDS];
-
-    // Fil the hash table with initialization values
-    for(i=0;i<MAXGIDS;i++) {
-        gids[i] = UINT_MAX;
-        sizes[i] = 0;
-    }
+int hist_merge(struct hist_table *dst, struct hist_table *src) {
+    struct histogram *hist;
+    unsigned int i, j;
 
-    // i<n_results-1 because the results of the target
-    // directory and sub-directories are in indices
-    // [0,n_results-2] and the summary is stored at
-    // index n_results-1
-    for(i=0;i<n_results-1;i++) {
-        for(j=0;j<**(results[i]->n_results)*2;j+=2) {
-            gid = (*(results[i]->data))[j];
-            size = (*(results[i]->data))[j+1];
-            if(insert_or_update(gid, size, gids, sizes) != 0)
-                return 1;
-            *total += size;
+    for(i=0;i<src->n_hists;i++) {
+        if((hist=hist_find(dst, src->hists[i].id)) == NULL)
+            return 1;
+        for(j=0;j<=MAXAGES;j++) {
+            hist->age_bytes[j] += src->hists[i].age_bytes[j];
+            hist->age_files[j] += src->hists[i].age_files[j];
+        }
+        for(j=0;j<SIZEBUCKETS;j++) {
+            hist->size_bytes[j] += src->hists[i].size_bytes[j];
+            hist->size_files[j] += src->hists[i].size_files[j];
         }
     }
-    
-    pack_result(results[n_results-1], gids, sizes);
     return 0;
 }
 
 
 /* SYNOPSIS
- *   Compiles a summary of file usage in a directory and all descendents,
- *   organized by group (GID). The method is designed to be launched as 
- *   a thread.
- * ARGUMENT:
- *  void *arg : Thread argument that stores the path to traverse, along
- *              with pointers to addresses where the result will be
- *              stored when the method completes
+ *   Free the storage of a histogram table, leaving it empty
+ *
+ * ARGUMENT
+ *   struct hist_table *table : The table
+ *
  * RETURN
- *   char* status: "OK" on success, and other strings on error
+ *   Void
  */
-static void* fts_walk(void *arg) {
-    FTS *stream;
-    FTSENT *entry;
-    int i;
-    bool insert = false;
-    bool error = false;
-    long long unsigned int audit_size;
-    long long unsigned int sizes[MAXGIDS];
-    unsigned int id;
-    unsigned int gids[MAXGIDS];
-    struct inode_entry *table[INODETABLE];
-    struct tr_args *targs = arg;
-    char* path = targs->path;
+void hist_free(struct hist_table *table) {
+    id_table_free(&table->index);
+    free(table->hists);
+    table->hists = NULL;
+    table->n_hists = table->capacity = 0;
+}
 
-    // FTS needs a null-terminated list of paths as argument
-    char *paths[2] = {path, NULL};
 
-    // FTS_PHSYCIAL: do not follow symbolic links
-    // FTS_XDEV    : do not descend into directories on devices
-    //               that differ from the starting directory
-    // FTS_NOCHDIR : do not chdir into each sub-directory. This
-    //               allows us use multiple fts threads from 
-    //               one process
-    stream = fts_open(paths, FTS_PHYSICAL|FTS_XDEV|FTS_NOCHDIR, NULL);
-    if(stream == NULL) {
-        store_error(paths[0], strerror(errno));
-        return "FTSOPENFAIL"; 
+/* SYNOPSIS
+ *   Look up the name of a UID/GID in the system databases. The reentrant
+ *   lookups are used so that several threads can resolve names at once.
+ *
+ * ARGUMENT
+ *   unsigned int id : The UID/GID to map to a name
+ *   bool user : Look up a UID rather than a GID
+ *
+ * RETURNS
+ *   The name, an empty string if the ID has no name, or NULL if memory
+ *   could not be allocated
+ */
+char* resolve_name(unsigned int id, bool user) {
+    struct passwd usr, *usr_found = NULL;
+    struct group grp, *grp_found = NULL;
+    long length = sysconf(user ? _SC_GETPW_R_SIZE_MAX : _SC_GETGR_R_SIZE_MAX);
+    char *buffer = NULL, *grown, *name = NULL;
+    int status = ERANGE;
+
+    // Entries with many members do not fit the suggested buffer size, so
+    // grow the buffer until they do
+    if(length <= 0)
+        length = 1024;
+    while(status == ERANGE && length <= 1<<20) {
+        if((grown=realloc(buffer, length)) == NULL)
+            break;
+        buffer = grown;
+        if(user)
+            status = getpwuid_r(id, &usr, buffer, length, &usr_found);
+        else
+            status = getgrgid_r(id, &grp, buffer, length, &grp_found);
+        length *= 2;
     }
 
-    // Fil the group/usage hash table with initialization values
-    // We use UINT_MAX for uninitialized GID because root GID is 0
-    // We use 0 for uninitialized size so that we can update using +=
-    for(i=0;i<MAXGIDS;i++) {
-        gids[i] = UINT_MAX;
-        sizes[i] = 0;
+    if(usr_found != NULL)
+        name = strdup(usr.pw_name);
+    else if(grp_found != NULL)
+        name = strdup(grp.gr_name);
+    else if(status != ERANGE || buffer != NULL)
+        name = strdup("");
+    free(buffer);
+    return name;
+}
+
+
+/* SYNOPSIS
+ *   Find the position of an ID in a name cache, adding it if it is new.
+ *   The caller holds the lock of the cache.
+ *
+ * ARGUMENT
+ *   struct name_cache *cache : The cache
+ *   unsigned int id : The UID/GID
+ *   unsigned int *pos : Where the position is stored
+ *   bool *added : Set if the ID was added
+ *
+ * RETURNS
+ *   0 on success, 1 if memory could not be allocated
+ */
+int name_position(struct name_cache *cache, unsigned int id, unsigned int *pos, bool *added) {
+    struct id_entry *entry = id_table_find(&cache->index, id);
+    unsigned int *ids;
+    char **names;
+
+    *added = false;
+    if(entry != NULL) {
+        *pos = entry->size;
+        return 0;
     }
 
-    // Fill the inode lookup table with NULL to indicate empty for all entries 
-    for(i=0;i<INODETABLE;i++) {
-        table[i] = NULL;
+    if(cache->n_names == cache->capacity) {
+        ids = realloc(cache->ids, (cache->capacity == 0 ? 64 : cache->capacity*2)*sizeof(unsigned int));
+        if(ids == NULL)
+            return 1;
+        cache->ids = ids;
+        names = realloc(cache->names, (cache->capacity == 0 ? 64 : cache->capacity*2)*sizeof(char*));
+        if(names == NULL)
+            return 1;
+        cache->names = names;
+        cache->capacity = cache->capacity == 0 ? 64 : cache->capacity*2;
     }
+    if(id_table_add(&cache->index, id, cache->n_names) != 0)
+        return 1;
+    *pos = cache->n_names++;
+    cache->ids[*pos] = id;
+    cache->names[*pos] = NULL;
+    *added = true;
+    return 0;
+}
 
-    // Read from the FTS stream until it is empty
-    while((entry=fts_read(stream))) {
-        // FTS error, entry was null. We store the error and continue,
-        // but this increments number of errors and potentially sets
-        // exit_now=true if maximum errors is reached
-        if(entry == NULL) {
-            store_error("fts_error", strerror(errno));
+
+/* SYNOPSIS
+ *   Queue the IDs of a usage table to be resolved while the walk runs
+ *
+ * ARGUMENT
+ *   struct id_table *seen : IDs the caller already queued, updated with the
+ *                           new IDs, or NULL to check every ID
+ *   struct id_table *usage : The usage table
+ *
+ * RETURNS
+ *   Void
+ */
+void prefetch_names(struct id_table *seen, struct id_table *usage) {
+    struct name_cache *cache = &name_cache;
+    struct id_entry *entry;
+    unsigned int pos = 0, position;
+    bool added, queued = false;
+
+    if(cache->n_threads == 0)
+        return;
+
+    while((entry=id_table_next(usage, &pos)) != NULL) {
+        if(seen != NULL && id_table_find(seen, entry->id) != NULL)
+            continue;
+        if(seen != NULL && id_table_add(seen, entry->id, 0) != 0)
+            return;
+        pthread_mutex_lock(&cache->lock);
+        if(name_position(cache, entry->id, &position, &added) == 0 && added)
+            queued = true;
+        pthread_mutex_unlock(&cache->lock);
+    }
+    if(queued) {
+        pthread_mutex_lock(&cache->lock);
+        pthread_cond_broadcast(&cache->cond);
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+
+/* SYNOPSIS
+ *   Resolve the names of queued IDs until the cache is stopped and the
+ *   queue is empty
+ *
+ * ARGUMENT
+ *   void *arg : The name cache
+ *
+ * RETURNS
+ *   NULL
+ */
+static void* name_main(void *arg) {
+    struct name_cache *cache = arg;
+    unsigned int pos, id;
+    bool user = cache == &name_cache ? summarize_by_user : !summarize_by_user;
+    char* name;
+
+    pthread_mutex_lock(&cache->lock);
+    while(true) {
+        if(cache->next == cache->n_names) {
+            if(cache->stop)
+                break;
+            pthread_cond_wait(&cache->cond, &cache->lock);
             continue;
         }
+        pos = cache->next++;
+        id = cache->ids[pos];
+        if(cache->names[pos] != NULL)
+            continue;
 
-        if(using_exclude && is_excluded(entry->fts_statp->st_ino)) {
-            if(verbose)
-                printf("-skip     The file %s is in the exclude list (skipping it an any descendants)\n", entry->fts_path);
-	    fts_set(stream, entry, FTS_SKIP);
-	    continue;
-	}
+        pthread_mutex_unlock(&cache->lock);
+        name = resolve_name(id, user);
+        pthread_mutex_lock(&cache->lock);
+        if(cache->names[pos] == NULL)
+            cache->names[pos] = name;
+        else
+            free(name);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
 
-        // If maximum errors were encountered, or other unrecoverable
-        // errors occured, this indicates to terminate execution
-        if(exit_now)
-            return "TASKEXIT";
 
-        // Process the file or directory
-        insert = false;
-        error = false;
-        switch(entry->fts_info) {
-            // Regular file
-            case FTS_F:
-                if(verbose)
-                    printf("+file      %s (%ld)\n", entry->fts_path, entry->fts_statp->st_size);
-		insert = true;
-                break;
-            // Directory
-            case FTS_D:
-                if(verbose)
-                    printf("+directory %s (%ld)\n", entry->fts_path, entry->fts_statp->st_size);
-                insert = true;
-                break;
-            // Symbolic link
-            case FTS_SL:
-                if(verbose)
-                    printf("+symlnk    %s (%ld)\n", entry->fts_path, entry->fts_statp->st_size);
-                insert = true;
-                break;
-            // Broken symlink
-            case FTS_SLNONE:
-                if(verbose)
-                    printf("+brksymlnk %s (%ld)\n", entry->fts_path, entry->fts_statp->st_size);
-                insert = true;
-                break;
-            // Uncategorized file
-            case FTS_DEFAULT:
-                if(verbose)
-                    printf("+uncat     %s (%ld)\n", entry->fts_path, entry->fts_statp->st_size);
-                insert = true;
-                break;
-            // A directory we could not descend into
-            case FTS_DNR:
-                error = true;
-                break;
-            // A directory we already traversed in pre-order
-            case FTS_DP:
-                // We already saw this directory in preorder FTS_D,
-                // so ignore it
-                break;
-            // A file we could not stat
-            case FTS_NS:
-                if(verbose)
+/* SYNOPSIS
+ *   Launch the threads that resolve the names queued in a cache. Names are
+ *   only prefetched when they are output and come from the system
+ *   databases, which may be slow network services.
+ *
+ * ARGUMENT
+ *   struct name_cache *cache : The cache
+ *
+ * RETURNS
+ *   Void
+ */
+void start_names(struct name_cache *cache) {
+    if(!output_names || cache->from_file)
+        return;
+    cache->stop = false;
+    while(cache->n_threads < NAMETHREADS) {
+        if(pthread_create(&cache->threads[cache->n_threads], NULL, &name_main, cache) != 0)
+            break;
+        cache->n_threads++;
+    }
+}
+
+
+/* SYNOPSIS
+ *   Wait for the resolver threads of a cache to finish the queued IDs and
+ *   exit
+ *
+ * ARGUMENT
+ *   struct name_cache *cache : The cache
+ *
+ * RETURNS
+ *   Void
+ */
+void stop_names(struct name_cache *cache) {
+    unsigned int i;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->stop = true;
+    pthread_cond_broadcast(&cache->cond);
+    pthread_mutex_unlock(&cache->lock);
+    for(i=0;i<cache->n_threads;i++)
+        pthread_join(cache->threads[i], NULL);
+    cache->n_threads = 0;
+}
+
+
+/* SYNOPSIS
+ *   Read the names of IDs from a passwd(5) file, or a group(5) file when
+ *   summarizing by group, instead of the system databases
+ *
+ * ARGUMENT
+ *   char* path : The file
+ *
+ * RETURNS
+ *   0 on success, 1 on error
+ */
+int load_names(char* path) {
+    struct name_cache *cache = &name_cache;
+    struct passwd usr, *usr_found;
+    struct group grp, *grp_found;
+    size_t length = 65536;
+    char *buffer, *grown;
+    unsigned int id, pos;
+    char* name;
+    bool added;
+    off_t start;
+    int status;
+    FILE *in = fopen(path, "r");
+
+    if(in == NULL) {
+        printf("Could not open name file %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if((buffer=malloc(length)) == NULL) {
+        printf("Could not allocate memory to read name file %s\n", path);
+        fclose(in);
+        return 1;
+    }
+
+    // The first entry for an ID wins, as with the system databases
+    while(true) {
+        start = ftello(in);
+        if(summarize_by_user)
+            status = fgetpwent_r(in, &usr, buffer, length, &usr_found);
+        else
+            status = fgetgrent_r(in, &grp, buffer, length, &grp_found);
+
+        // Entries with many members do not fit the buffer, so grow it
+        // and read the entry again
+        if(status == ERANGE && length < 1<<24 && start >= 0) {
+            if((grown=realloc(buffer, length*2)) == NULL) {
+                printf("Could not allocate memory to read name file %s\n", path);
+                free(buffer);
+                fclose(in);
+                return 1;
+            }
+            buffer = grown;
+            length *= 2;
+            if(fseeko(in, start, SEEK_SET) != 0) {
+                printf("Could not read name file %s: %s\n", path, strerror(errno));
+                free(buffer);
+                fclose(in);
+                return 1;
+            }
+            continue;
+        }
+        if(status == ENOENT)
+            break;
+        if(status != 0) {
+            printf("Could not read name file %s: %s\n", path, strerror(status));
+            free(buffer);
+            fclose(in);
+            return 1;
+        }
+
+        id = summarize_by_user ? usr.pw_uid : grp.gr_gid;
+        name = summarize_by_user ? usr.pw_name : grp.gr_name;
+        if(name_position(cache, id, &pos, &added) != 0 || (added && (cache->names[pos]=strdup(name)) == NULL)) {
+            printf("Could not allocate memory to read name file %s\n", path);
+            free(buffer);
+            fclose(in);
+            return 1;
+        }
+    }
+    free(buffer);
+    fclose(in);
+
+    // The names of the other kind of ID are not looked up either
+    cache->from_file = true;
+    other_names.from_file = true;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Free the names of IDs of both kinds
+ *
+ * ARGUMENT
+ *   None
+ *
+ * RETURNS
+ *   Void
+ */
+void free_names() {
+    struct name_cache *caches[2] = {&name_cache, &other_names}, *cache;
+    unsigned int i, j;
+
+    for(j=0;j<2;j++) {
+        cache = caches[j];
+        for(i=0;i<cache->n_names;i++)
+            free(cache->names[i]);
+        free(cache->names);
+        free(cache->ids);
+        id_table_free(&cache->index);
+        cache->names = NULL;
+        cache->ids = NULL;
+        cache->n_names = cache->capacity = cache->next = 0;
+    }
+}
+
+
+/* SYNOPSIS
+ *   Copy the user/group name corresponding to the argument UID/GID to the 
+ *   argument buffer. If the UID/GID cannot be mapped to a name, the numeric
+ *   UID/GID is copied to the buffer as a string. Each ID is looked up once,
+ *   and the names are cached for all threads.
+ *
+ * ARGUMENT
+ *   struct name_cache *cache : The cache of the kind of the ID
+ *   unsigned int id : The UID/GID to map to a name
+ *   char* name : Buffer of MAXNAMELEN bytes to copy the name to
+ *
+ * RETURNS
+ *   0 on success, 1 if the GID could not be mapped
+ */
+int get_name(struct name_cache *cache, unsigned int id, char* name) {
+    unsigned int pos = UINT_MAX;
+    bool added;
+    char* resolved = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if(name_position(cache, id, &pos, &added) == 0 && cache->names[pos] == NULL && !cache->from_file) {
+        // Resolve here rather than wait for the resolver threads
+        pthread_mutex_unlock(&cache->lock);
+        resolved = resolve_name(id, cache == &name_cache ? summarize_by_user : !summarize_by_user);
+        pthread_mutex_lock(&cache->lock);
+        if(cache->names[pos] == NULL)
+            cache->names[pos] = resolved;
+        else
+            free(resolved);
+    }
+    if(pos < cache->n_names && cache->names[pos] != NULL && cache->names[pos][0] != '\0') {
+        snprintf(name, MAXNAMELEN, "%s", cache->names[pos]);
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    sprintf(name, "%u", id);
+    return 1;
+}
+
+
+/* SYNOPSIS
+ *   Copy the fields the walk uses from a statx result into a struct stat
+ *
+ * ARGUMENT
+ *   struct statx *stx : The statx result
+ *   struct stat *meta : Address where the metadata is stored
+ *
+ * RETURN
+ *   Void
+ */
+void statx_to_stat(struct statx *stx, struct stat *meta) {
+    meta->st_mode = stx->stx_mode;
+    meta->st_nlink = stx->stx_nlink;
+    meta->st_ino = stx->stx_ino;
+    meta->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    meta->st_size = stx->stx_size;
+    meta->st_blocks = stx->stx_blocks;
+    meta->st_uid = stx->stx_uid;
+    meta->st_gid = stx->stx_gid;
+    meta->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    meta->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    meta->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    meta->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    meta->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    meta->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+
+/* SYNOPSIS
+ *   Add to a counter of the current thread. Only the owning thread
+ *   writes the counter, so a relaxed load and store are enough for the
+ *   reporter to read whole values.
+ *
+ * ARGUMENT
+ *   long long unsigned int *counter : The counter
+ *   long long unsigned int n : Amount to add
+ *
+ * RETURN
+ *   Void
+ */
+void metric_add(long long unsigned int *counter, long long unsigned int n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+
+/* SYNOPSIS
+ *   Read the monotonic clock
+ *
+ * ARGUMENT
+ *   None
+ *
+ * RETURN
+ *   Nanoseconds since an arbitrary point
+ */
+long long unsigned int now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long unsigned int)now.tv_sec*1000000000ull + now.tv_nsec;
+}
+
+
+/* SYNOPSIS
+ *   Find the histogram bucket of a latency. Latencies below 4ns have a
+ *   bucket each, and every power of two above is split into 4 buckets.
+ *
+ * ARGUMENT
+ *   long long unsigned int ns : The latency
+ *
+ * RETURN
+ *   The bucket
+ */
+unsigned int latency_bucket(long long unsigned int ns) {
+    unsigned int msb, bucket;
+
+    if(ns < 4)
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    bucket = 4*(msb-1) + ((ns >> (msb-2)) & 3);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS-1;
+}
+
+
+/* SYNOPSIS
+ *   Smallest latency counted in a histogram bucket
+ *
+ * ARGUMENT
+ *   unsigned int bucket : The bucket
+ *
+ * RETURN
+ *   The latency in nanoseconds
+ */
+long long unsigned int bucket_latency(unsigned int bucket) {
+    if(bucket < 4)
+        return bucket;
+    return (4ull + bucket%4) << (bucket/4 - 1);
+}
+
+
+/* SYNOPSIS
+ *   Count the latency of a stat that started at the argument time, if
+ *   stats are timed
+ *
+ * ARGUMENT
+ *   struct metrics *metrics : Counters of the current thread, or NULL
+ *   long long unsigned int start : When the stat started
+ *
+ * RETURN
+ *   Void
+ */
+void count_stat(struct metrics *metrics, long long unsigned int start) {
+    long long unsigned int latency;
+
+    if(start == 0)
+        return;
+    latency = now_ns() - start;
+    if(metrics != NULL)
+        metric_add(&metrics->latency[latency_bucket(latency)], 1);
+    if(throttle.target > 0) {
+        __atomic_add_fetch(&throttle.window_ns, latency, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&throttle.window_ops, 1, __ATOMIC_RELAXED);
+    }
+    if(auto_threads) {
+        __atomic_add_fetch(&tune_ns, latency, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&tune_ops, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* SYNOPSIS
+ *   Adjust the rate limit to the stat latency of the window that ended.
+ *   The rate is halved while the latency is above the target, and raised
+ *   by an eighth otherwise. Without a maximum rate, the limit is lifted
+ *   once it is well above the rate the walk reaches. Called with the lock
+ *   of the throttle held.
+ *
+ * ARGUMENT
+ *   long long unsigned int now : The end of the window
+ *
+ * RETURN
+ *   Void
+ */
+void adjust_rate(long long unsigned int now) {
+    long long unsigned int ops, latency, elapsed, observed;
+
+    ops = __atomic_exchange_n(&throttle.window_ops, 0, __ATOMIC_RELAXED);
+    latency = __atomic_exchange_n(&throttle.window_ns, 0, __ATOMIC_RELAXED);
+    elapsed = now - throttle.window_start;
+    throttle.window_start = now;
+    if(ops == 0)
+        return;
+
+    // Interval between the operations of the window
+    observed = elapsed / ops;
+    if(latency / ops > throttle.target) {
+        if(throttle.interval == 0 || throttle.interval < observed)
+            throttle.interval = observed;
+        throttle.interval *= 2;
+        if(throttle.interval > MAXINTERVAL)
+            throttle.interval = MAXINTERVAL;
+        throttle.backoffs++;
+    }
+    else if(throttle.interval > 0) {
+        throttle.interval -= throttle.interval/9;
+        if(throttle.interval < throttle.min_interval)
+            throttle.interval = throttle.min_interval;
+        if(throttle.min_interval == 0 && throttle.interval < observed/2)
+            throttle.interval = 0;
+    }
+}
+
+
+/* SYNOPSIS
+ *   Wait until the rate limit allows another stat or readdir operation.
+ *   Each operation takes the next free time, so threads that arrive
+ *   together sleep for consecutive intervals.
+ *
+ * ARGUMENT
+ *   None
+ *
+ * RETURN
+ *   Void
+ */
+void throttle_op() {
+    long long unsigned int now, start;
+    struct timespec wait;
+
+    if(!throttling)
+        return;
+
+    pthread_mutex_lock(&throttle.lock);
+    now = now_ns();
+    if(throttle.target > 0 && now - throttle.window_start >= BACKOFFWINDOW)
+        adjust_rate(now);
+    start = now;
+    if(throttle.interval > 0) {
+        if(throttle.next > now)
+            start = throttle.next;
+        throttle.next = start + throttle.interval;
+    }
+    pthread_mutex_unlock(&throttle.lock);
+
+    if(start > now) {
+        __atomic_add_fetch(&throttle.waits, 1, __ATOMIC_RELAXED);
+        wait.tv_sec = (start - now) / 1000000000ull;
+        wait.tv_nsec = (start - now) % 1000000000ull;
+        while(nanosleep(&wait, &wait) != 0 && errno == EINTR);
+    }
+}
+
+
+/* SYNOPSIS
+ *   Record the directory a thread starts working on
+ *
+ * ARGUMENT
+ *   struct metrics *metrics : Counters of the thread
+ *   char* path : The directory
+ *
+ * RETURN
+ *   Void
+ */
+void metric_path(struct metrics *metrics, char* path) {
+    size_t n = strlen(path);
+
+    if(n >= MAXPATHLEN)
+        n = MAXPATHLEN-1;
+    metric_add(&metrics->dirs, 1);
+    __atomic_add_fetch(&metrics->seq, 1, __ATOMIC_ACQ_REL);
+    memcpy(metrics->path, path, n);
+    metrics->path[n] = '\0';
+    __atomic_add_fetch(&metrics->seq, 1, __ATOMIC_RELEASE);
+}
+
+
+/* SYNOPSIS
+ *   Stat a file with statx, requesting only the fields in the argument mask,
+ *   and copy the fields the walk uses into a struct stat. Falls back to
+ *   fstatat if the kernel does not support statx.
+ *
+ * ARGUMENT
+ *   int dirfd : Directory that path is relative to, or AT_FDCWD
+ *   char* path : Path of the file ("" with AT_EMPTY_PATH to stat dirfd)
+ *   int flags : AT_* flags passed to statx
+ *   unsigned int mask : STATX_* fields that are needed
+ *   struct stat *meta : Address where the metadata is stored
+ *
+ * RETURN
+ *   0 on success, -1 on error with errno set
+ */
+int dug_stat(int dirfd, char* path, int flags, unsigned int mask, struct stat *meta) {
+    struct statx stx;
+    long long unsigned int start;
+    int status;
+
+    throttle_op();
+    start = time_stats ? now_ns() : 0;
+    if(use_statx) {
+        if(dont_sync)
+            flags |= AT_STATX_DONT_SYNC;
+        if(statx(dirfd, path, flags, mask, &stx) == 0) {
+            statx_to_stat(&stx, meta);
+            count_stat(thread_metrics, start);
+            return 0;
+        }
+        if(errno != ENOSYS)
+            return -1;
+        use_statx = false;
+    }
+    status = fstatat(dirfd, path, meta, flags & (AT_SYMLINK_NOFOLLOW|AT_EMPTY_PATH));
+    count_stat(thread_metrics, start);
+    return status;
+}
+
+
+/* SYNOPSIS
+ *   Compute the statx fields the walk needs for the selected options: type,
+ *   inode and link count for every file, plus blocks or apparent size and
+ *   the group or owner being summarized
+ *
+ * ARGUMENT
+ *   None
+ *
+ * RETURN
+ *   The STATX_* mask
+ */
+unsigned int compute_stat_mask() {
+    unsigned int mask = STATX_TYPE|STATX_INO|STATX_NLINK;
+    mask |= size_in_blocks ? STATX_BLOCKS : STATX_SIZE;
+    mask |= summarize_by_user ? STATX_UID : STATX_GID;
+    if(accounting)
+        mask |= STATX_UID|STATX_GID|STATX_BLOCKS|STATX_SIZE;
+    if(size_histogram)
+        mask |= STATX_SIZE;
+    if(age_field == AGE_ATIME)
+        mask |= STATX_ATIME;
+    else if(age_field == AGE_MTIME)
+        mask |= STATX_MTIME;
+    else if(age_field == AGE_CTIME)
+        mask |= STATX_CTIME;
+
+    // Sizes are reported for every file in verbose mode
+    if(verbose)
+        mask |= STATX_SIZE;
+    return mask;
+}
+
+
+/* SYNOPSIS
+ *   Hash a (device, inode) pair. The low bits select the stripe of the
+ *   inode set and the high bits select the slot within the stripe.
+ *
+ * ARGUMENT
+ *   long long unsigned int dev : device number
+ *   long long unsigned int num : inode number
+ *
+ * RETURN
+ *   The hash
+ */
+long long unsigned int hash_inode(long long unsigned int dev, long long unsigned int num) {
+    long long unsigned int h = num ^ (dev * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+/* SYNOPSIS
+ *   Double the number of slots in a stripe of the inode set and reinsert
+ *   its entries. The caller holds the stripe lock.
+ *
+ * ARGUMENT
+ *   struct inode_stripe *stripe : The stripe to grow
+ *
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int grow_inode_stripe(struct inode_stripe *stripe) {
+    unsigned int i, j, capacity = stripe->capacity*2;
+    struct inode_entry *entries = calloc(capacity, sizeof(struct inode_entry));
+
+    if(entries == NULL)
+        return 1;
+
+    for(i=0;i<stripe->capacity;i++) {
+        if(stripe->entries[i].num == 0 && stripe->entries[i].dev == 0)
+            continue;
+        j = (hash_inode(stripe->entries[i].dev, stripe->entries[i].num) >> 32) & (capacity-1);
+        while(entries[j].num != 0 || entries[j].dev != 0)
+            j = (j+1) & (capacity-1);
+        entries[j] = stripe->entries[i];
+    }
+    if(stripe->grown)
+        free(stripe->entries);
+    stripe->entries = entries;
+    stripe->grown = true;
+    stripe->capacity = capacity;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Adds a (device, inode) pair to the inode set if it does not exist. The
+ *   set is shared by all threads, and each stripe has its own lock so
+ *   threads rarely wait on each other. Each stripe is an open addressed
+ *   table with linear probing that doubles when it is 3/4 full, so lookups
+ *   touch one or two cache lines however many links are tracked.
+ *
+ * ARGUMENT
+ *   long long unsigned int dev : device number
+ *   long long unsigned int num : inode number
+ *
+ * RETURN
+ *   0 if the inode was added, 1 if it already existed, -1 if memory could
+ *   not be allocated
+ */
+int insert_inode(long long unsigned int dev, long long unsigned int num) {
+    long long unsigned int h = hash_inode(dev, num);
+    struct inode_stripe *stripe = &inode_set[h & (INODESTRIPES-1)];
+    struct inode_entry *entry;
+    unsigned int i;
+
+    // The all zero pair marks an empty slot. Device 0 does not hold
+    // files, so the pair is remapped rather than tracked separately.
+    if(dev == 0 && num == 0)
+        dev = ULLONG_MAX;
+
+    if(pthread_mutex_trylock(&stripe->lock) != 0) {
+        __atomic_add_fetch(&inode_contention, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&stripe->lock);
+    }
+
+    // Find the existing inode or the empty slot where it belongs
+    i = (h >> 32) & (stripe->capacity-1);
+    while(1) {
+        entry = &stripe->entries[i];
+        if(entry->num == num && entry->dev == dev) {
+            pthread_mutex_unlock(&stripe->lock);
+            return 1;
+        }
+        if(entry->num == 0 && entry->dev == 0)
+            break;
+        i = (i+1) & (stripe->capacity-1);
+    }
+
+    // Insert new inode, growing the table first if it is getting full
+    if((stripe->n_entries+1)*4 > stripe->capacity*3) {
+        if(grow_inode_stripe(stripe) != 0) {
+            pthread_mutex_unlock(&stripe->lock);
+            return -1;
+        }
+        i = (h >> 32) & (stripe->capacity-1);
+        while(stripe->entries[i].num != 0 || stripe->entries[i].dev != 0)
+            i = (i+1) & (stripe->capacity-1);
+        entry = &stripe->entries[i];
+    }
+    entry->dev = dev;
+    entry->num = num;
+    stripe->n_entries++;
+    pthread_mutex_unlock(&stripe->lock);
+
+    if(trace)
+        printf("Added entry for device %llu inode %llu\n", dev, num);
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Initialize the shared inode set. The initial tables of all stripes
+ *   are carved from a single allocation.
+ *
+ * ARGUMENT
+ *   None
+ *
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int init_inode_set() {
+    int i;
+
+    inode_arena = calloc(INODESTRIPES*INODETABLE, sizeof(struct inode_entry));
+    if(inode_arena == NULL)
+        return 1;
+    for(i=0;i<INODESTRIPES;i++) {
+        pthread_mutex_init(&inode_set[i].lock, NULL);
+        inode_set[i].entries = inode_arena + i*INODETABLE;
+        inode_set[i].capacity = INODETABLE;
+        inode_set[i].n_entries = 0;
+        inode_set[i].grown = false;
+    }
+    inode_contention = 0;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Frees the memory allocated to tracking inodes. Stripes that did not
+ *   grow are still in the initial allocation, so a run with few hard
+ *   links frees the whole set at once.
+ *
+ * ARGUMENT
+ *   None
+ *
+ * RETURN
+ *   Number of inodes that were tracked
+ */
+long long unsigned int free_inode_set() {
+    int i;
+    long long unsigned int n = 0;
+    for(i=0;i<INODESTRIPES;i++) {
+        if(inode_set[i].grown)
+            free(inode_set[i].entries);
+        inode_set[i].entries = NULL;
+        n += inode_set[i].n_entries;
+        inode_set[i].n_entries = 0;
+        pthread_mutex_destroy(&inode_set[i].lock);
+    }
+    free(inode_arena);
+    inode_arena = NULL;
+    return n;
+}
+
+
+/* SYNOPSIS
+ *   Add a file with multiple links to a table of links, doubling the
+ *   table as needed
+ *
+ * ARGUMENT
+ *   struct link_table *table : The table
+ *   struct stat *meta : Metadata of the file
+ *   unsigned int id : UID/GID the file was counted to
+ *   long long unsigned int size : Usage the file was counted with
+ *   struct tr_args *slot : Result the usage was added to
+ *
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int link_add(struct link_table *table, struct stat *meta, unsigned int id, long long unsigned int size, struct tr_args *slot) {
+    struct shard_link *grown, *entry;
+
+    if(table->n_entries == table->capacity) {
+        grown = realloc(table->entries, (table->capacity == 0 ? 64 : table->capacity*2)*sizeof(struct shard_link));
+        if(grown == NULL)
+            return 1;
+        table->entries = grown;
+        table->capacity = table->capacity == 0 ? 64 : table->capacity*2;
+    }
+    entry = &table->entries[table->n_entries++];
+    entry->dev = meta->st_dev;
+    entry->num = meta->st_ino;
+    entry->size = size;
+    entry->id = id;
+    entry->slot = slot;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Move the links of one table to the end of another
+ *
+ * ARGUMENT
+ *   struct link_table *dst : The table added to
+ *   struct link_table *src : The table added, left empty
+ *
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int link_merge(struct link_table *dst, struct link_table *src) {
+    struct shard_link *grown;
+
+    if(dst->n_entries + src->n_entries > dst->capacity) {
+        grown = realloc(dst->entries, (dst->n_entries + src->n_entries)*sizeof(struct shard_link));
+        if(grown == NULL)
+            return 1;
+        dst->entries = grown;
+        dst->capacity = dst->n_entries + src->n_entries;
+    }
+    if(src->n_entries > 0)
+        memcpy(dst->entries + dst->n_entries, src->entries, src->n_entries*sizeof(struct shard_link));
+    dst->n_entries += src->n_entries;
+    src->n_entries = 0;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Free the storage of a table of links, leaving it empty
+ *
+ * ARGUMENT
+ *   struct link_table *table : The table
+ *
+ * RETURN
+ *   Void
+ */
+void link_free(struct link_table *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->n_entries = table->capacity = 0;
+}
+
+
+/* SYNOPSIS
+ *   Store an error message
+ *
+ * ARGUMENT
+ *   char* path : The file/directory path where the error was encountered
+ *   char* error : The error message
+ *
+ * RETURN
+ *   0 on success, 1 if the maximum number of errors has been exceeded
+ */
+int store_error(char* path, char* error) {
+    if(n_errors >= max_errors) {
+        exit_now = true;
+        exit_status = 3;
+        return 1;
+    }
+
+    // Use mutex to manage concurrent access to global
+    // errors array
+    pthread_mutex_lock(&error_mutex);
+
+    int total_length = strlen(path)+strlen(error);
+    error_strs[n_errors] = malloc(total_length+10);
+    if(error_strs[n_errors] == NULL) {
+        printf("Could not allocate memory to store errors. Exiting as memory appears exhausted\n");
+	exit_now = true;
+	exit_status = 4;
+	return 1;
+    }
+
+    sprintf(error_strs[n_errors], "%s: %s", path, error);
+    n_errors++;
+    if(thread_metrics != NULL)
+        metric_add(&thread_metrics->errors, 1);
+
+    pthread_mutex_unlock(&error_mutex);
+    return 0;
+}
+
+
+int find_or_store_exclude_inode(long long unsigned int inode, bool store) {
+    int index = inode % MAXEXCLUDE;
+    int i = index;
+
+    do {
+        if(exclude_inodes[i] == inode)
+            return 0;
+        else if(exclude_inodes[i] == 0) { 
+            if(store) {
+                exclude_inodes[i] = inode;
+		return 0;
+	    }
+	    else
+                return 1;
+        }
+        i = (i+1)%MAXEXCLUDE;
+    } while(i!=index);
+
+    // Table is full and does not already contain
+    // an inode for the argument path
+    return 2;
+}
+
+
+int is_excluded(long long unsigned int inode) {
+    return find_or_store_exclude_inode(inode, false) == 0;
+}
+
+
+/*
+ */
+int store_exclude(char* path) {
+    struct stat meta;
+    if(lstat(path, &meta) != 0) {
+        printf("Error: argument path %s does not exist\n", path);
+        return 1;
+    }
+    int status = find_or_store_exclude_inode(meta.st_ino, true);
+    if(status == 0 && verbose)
+        printf("+dug       Added exclude entry for %s using inode %lu\n", path, meta.st_ino);
+    if(status == 2)
+	printf("-dug       Could not store inode for %s. The inode table for tracking exclude files is full\n", path);
+    return status;
+}
+
+
+
+
+/* SYNOPSIS
+ *   Hash a file name
+ *
+ * ARGUMENT
+ *   const char* name : The name
+ *
+ * RETURN
+ *   The hash
+ */
+unsigned int hash_name(const char* name) {
+    uint32_t h = 2166136261u;
+
+    while(*name != '\0')
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+
+/* SYNOPSIS
+ *   Add a pattern of --exclude-name. A pattern without the wildcards of
+ *   fnmatch(3) is added to the set of literal names.
+ *
+ * ARGUMENT
+ *   char* pattern : The pattern
+ *
+ * RETURN
+ *   0 on success, 1 on error
+ */
+int store_exclude_name(char* pattern) {
+    struct name_patterns *set = &exclude_names;
+    char **old = set->literals, **grown;
+    unsigned int i, capacity = set->capacity;
+
+    if(pattern[0] == '\0' || strchr(pattern, '/') != NULL)
+        return 1;
+
+    if(strpbrk(pattern, "*?[\\") != NULL) {
+        if(set->n_globs == set->globs_capacity) {
+            grown = realloc(set->globs, (set->globs_capacity == 0 ? 8 : set->globs_capacity*2)*sizeof(char*));
+            if(grown == NULL)
+                return 1;
+            set->globs = grown;
+            set->globs_capacity = set->globs_capacity == 0 ? 8 : set->globs_capacity*2;
+        }
+        set->globs[set->n_globs++] = pattern;
+        using_exclude_names = true;
+        return 0;
+    }
+
+    // Grow the set when it is half full, so lookups of names that are not
+    // in it stop early
+    if(2*(set->n_literals+1) > set->capacity) {
+        set->capacity = capacity == 0 ? 64 : capacity*2;
+        set->literals = calloc(set->capacity, sizeof(char*));
+        if(set->literals == NULL) {
+            set->literals = old;
+            set->capacity = capacity;
+            return 1;
+        }
+        set->n_literals = 0;
+        for(i=0;i<capacity;i++)
+            if(old[i] != NULL)
+                store_exclude_name(old[i]);
+        free(old);
+    }
+
+    i = hash_name(pattern) & (set->capacity-1);
+    while(set->literals[i] != NULL && strcmp(set->literals[i], pattern) != 0)
+        i = (i+1) & (set->capacity-1);
+    if(set->literals[i] == NULL) {
+        set->literals[i] = pattern;
+        set->n_literals++;
+    }
+    using_exclude_names = true;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Check a name from a directory against the patterns of --exclude-name
+ *
+ * ARGUMENT
+ *   const char* name : The name of the entry
+ *
+ * RETURN
+ *   true if the entry is excluded
+ */
+bool is_excluded_name(const char* name) {
+    struct name_patterns *set = &exclude_names;
+    unsigned int i;
+
+    if(set->n_literals > 0) {
+        i = hash_name(name) & (set->capacity-1);
+        while(set->literals[i] != NULL) {
+            if(strcmp(set->literals[i], name) == 0)
+                return true;
+            i = (i+1) & (set->capacity-1);
+        }
+    }
+    for(i=0;i<set->n_globs;i++)
+        if(fnmatch(set->globs[i], name, 0) == 0)
+            return true;
+    return false;
+}
+
+
+/* SYNOPSIS
+ *   Make room for more output in a buffer
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   size_t n : Number of bytes to make room for
+ *
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int out_reserve(struct out_buffer *out, size_t n) {
+    size_t capacity = out->capacity == 0 ? 4096 : out->capacity;
+    char* grown;
+
+    if(out->failed)
+        return 1;
+    if(out->length + n <= out->capacity)
+        return 0;
+    while(capacity < out->length + n)
+        capacity *= 2;
+    if((grown=realloc(out->data, capacity)) == NULL) {
+        out->failed = true;
+        return 1;
+    }
+    out->data = grown;
+    out->capacity = capacity;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Append bytes to an output buffer
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   const char* data : The bytes
+ *   size_t n : Number of bytes
+ *
+ * RETURN
+ *   Void
+ */
+void out_mem(struct out_buffer *out, const char* data, size_t n) {
+    if(out_reserve(out, n) != 0)
+        return;
+    memcpy(out->data + out->length, data, n);
+    out->length += n;
+}
+
+
+/* SYNOPSIS
+ *   Append a string to an output buffer
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   const char* str : The string
+ *
+ * RETURN
+ *   Void
+ */
+void out_str(struct out_buffer *out, const char* str) {
+    out_mem(out, str, strlen(str));
+}
+
+
+/* SYNOPSIS
+ *   Write an unsigned integer in decimal, ending at the argument address.
+ *   Digits are produced two at a time from a table.
+ *
+ * ARGUMENT
+ *   long long unsigned int value : The integer
+ *   char* end : Address after the last digit
+ *
+ * RETURN
+ *   Address of the first digit
+ */
+char* format_u64(long long unsigned int value, char* end) {
+    static const char pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+    unsigned int pair;
+
+    while(value >= 100) {
+        pair = (value % 100) * 2;
+        value /= 100;
+        end -= 2;
+        end[0] = pairs[pair];
+        end[1] = pairs[pair+1];
+    }
+    if(value >= 10) {
+        end -= 2;
+        end[0] = pairs[value*2];
+        end[1] = pairs[value*2+1];
+    }
+    else
+        *--end = '0' + value;
+    return end;
+}
+
+
+/* SYNOPSIS
+ *   Append an unsigned integer in decimal to an output buffer
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   long long unsigned int value : The integer
+ *
+ * RETURN
+ *   Void
+ */
+void out_u64(struct out_buffer *out, long long unsigned int value) {
+    char digits[24];
+    char* first = format_u64(value, digits+sizeof(digits));
+    out_mem(out, first, digits+sizeof(digits)-first);
+}
+
+
+/* SYNOPSIS
+ *   Find the length of the UTF-8 sequence at the start of a string
+ *
+ * ARGUMENT
+ *   const unsigned char* s : The string
+ *   size_t n : Bytes left in the string
+ *
+ * RETURN
+ *   Length of the sequence, or 0 if it is not valid UTF-8
+ */
+size_t utf8_length(const unsigned char* s, size_t n) {
+    size_t len, k;
+    unsigned char low = 0x80, high = 0xbf;
+
+    if(s[0] >= 0xc2 && s[0] <= 0xdf)
+        len = 2;
+    else if(s[0] >= 0xe0 && s[0] <= 0xef)
+        len = 3;
+    else if(s[0] >= 0xf0 && s[0] <= 0xf4)
+        len = 4;
+    else
+        return 0;
+
+    // Overlong forms, surrogates and code points above U+10FFFF are
+    // ruled out by the range of the second byte
+    if(s[0] == 0xe0)
+        low = 0xa0;
+    else if(s[0] == 0xed)
+        high = 0x9f;
+    else if(s[0] == 0xf0)
+        low = 0x90;
+    else if(s[0] == 0xf4)
+        high = 0x8f;
+    if(len > n || s[1] < low || s[1] > high)
+        return 0;
+    for(k=2;k<len;k++)
+        if(s[k] < 0x80 || s[k] > 0xbf)
+            return 0;
+    return len;
+}
+
+
+/* SYNOPSIS
+ *   Escape a string so it is a valid JSON string. Quotes and backslashes
+ *   are escaped, and control characters are written as escape sequences.
+ *   Names are bytes rather than text, so a byte that is not part of a
+ *   valid UTF-8 sequence is written as the escape of the code point of
+ *   the same value, \u0080 to \u00ff. Bytes are checked 16 at a time
+ *   with a loop the compiler vectorizes, and blocks of plain ASCII are
+ *   copied as they are.
+ *
+ * ARGUMENT
+ *   const char* src : The string
+ *   size_t n : Length of the string
+ *   char* dst : Buffer of at least 6*n bytes for the escaped string
+ *
+ * RETURN
+ *   Length of the escaped string
+ */
+size_t json_escape(const char* src, size_t n, char* dst) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i = 0, j = 0, k, len;
+    unsigned char c, special;
+
+    while(i < n) {
+        while(i + 16 <= n) {
+            special = 0;
+            for(k=0;k<16;k++)
+                special |= (s[i+k] < 0x20) | (s[i+k] >= 0x80) | (s[i+k] == '"') | (s[i+k] == '\\');
+            if(special)
+                break;
+            memcpy(dst+j, s+i, 16);
+            i += 16;
+            j += 16;
+        }
+
+        // Handle bytes one at a time up to the end of the block that
+        // needs escaping
+        for(k=i+16;i<n && i<k;i++) {
+            c = s[i];
+            if(c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+                dst[j++] = c;
+                continue;
+            }
+            if(c >= 0x80 && (len=utf8_length(s+i, n-i)) > 0) {
+                memcpy(dst+j, s+i, len);
+                j += len;
+                i += len-1;
+                continue;
+            }
+            dst[j++] = '\\';
+            switch(c) {
+                case '"':  dst[j++] = '"'; break;
+                case '\\': dst[j++] = '\\'; break;
+                case '\b': dst[j++] = 'b'; break;
+                case '\f': dst[j++] = 'f'; break;
+                case '\n': dst[j++] = 'n'; break;
+                case '\r': dst[j++] = 'r'; break;
+                case '\t': dst[j++] = 't'; break;
+                default:
+                    memcpy(dst+j, "u00", 3);
+                    dst[j+3] = hex[c >> 4];
+                    dst[j+4] = hex[c & 15];
+                    j += 5;
+            }
+        }
+    }
+    return j;
+}
+
+
+/* SYNOPSIS
+ *   Escape special characters so the string is a valid JSON string
+ *
+ * ARGUMENT
+ *   char* path : The initial string
+ *   char* escaped : Buffer of at least 6*strlen(path)+1 bytes to hold the
+ *                   escaped string
+ *
+ * RETURN
+ *   Always 0
+ */
+int json_escape_str(char* path, char* escaped) {
+    escaped[json_escape(path, strlen(path), escaped)] = '\0';
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Append a string to an output buffer as a quoted JSON string
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   const char* str : The string
+ *
+ * RETURN
+ *   Void
+ */
+void out_json_str(struct out_buffer *out, const char* str) {
+    size_t n = strlen(str);
+    if(out_reserve(out, 6*n+2) != 0)
+        return;
+    out->data[out->length++] = '"';
+    out->length += json_escape(str, n, out->data + out->length);
+    out->data[out->length++] = '"';
+}
+
+
+/* SYNOPSIS
+ *   Append a path to an output buffer as plain text, as the table output
+ *   has always written paths: backslashes are doubled, and newlines,
+ *   carriage returns and backspaces are replaced with '_'
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   const char* path : The path
+ *
+ * RETURN
+ *   Void
+ */
+void out_text(struct out_buffer *out, const char* path) {
+    size_t i, j = 0, n = strlen(path);
+    char* dst;
+
+    if(out_reserve(out, 2*n) != 0)
+        return;
+    dst = out->data + out->length;
+    for(i=0;i<n;i++) {
+        if(path[i] == '\\') {
+            dst[j++] = '\\';
+            dst[j++] = '\\';
+        }
+        else if(path[i] == '\n' || path[i] == '\r' || path[i] == '\b')
+            dst[j++] = '_';
+        else
+            dst[j++] = path[i];
+    }
+    out->length += j;
+}
+
+
+/* SYNOPSIS
+ *   Write all of the data in a list of buffers to a file, continuing
+ *   after partial writes. Anything printed to stdout before is flushed
+ *   first so the output stays in order.
+ *
+ * ARGUMENT
+ *   int fd : The file
+ *   struct iovec *iov : The buffers, which are updated as they are written
+ *   int n : Number of buffers
+ *
+ * RETURN
+ *   0 on success, 1 if the output could not be written
+ */
+int write_all(int fd, struct iovec *iov, int n) {
+    ssize_t written;
+
+    if(fd == STDOUT_FILENO)
+        fflush(stdout);
+    while(n > 0) {
+        if(iov->iov_len == 0) {
+            iov++;
+            n--;
+            continue;
+        }
+        written = writev(fd, iov, n > IOV_MAX ? IOV_MAX : n);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written < 0)
+            return 1;
+        while(n > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if(n > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Write an output buffer to stdout and empty it, keeping its memory
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *
+ * RETURN
+ *   0 on success, 1 if memory ran out or the output could not be written
+ */
+int out_flush(struct out_buffer *out) {
+    struct iovec iov = {out->data, out->length};
+    int status = out->failed;
+
+    if(out->failed) {
+        printf("Could not allocate memory for output\n");
+        exit_status = 4;
+    }
+    else if(write_all(STDOUT_FILENO, &iov, 1) != 0)
+        status = 1;
+    out->length = 0;
+    return status;
+}
+
+
+/* SYNOPSIS
+ *   Free the memory of an output buffer
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *
+ * RETURN
+ *   Void
+ */
+void out_free(struct out_buffer *out) {
+    free(out->data);
+    memset(out, 0, sizeof(struct out_buffer));
+}
+
+
+/* SYNOPSIS
+ *   If the command failed, outputs a JSON formatted failure
+ *
+ * ARGUMENT
+ *   None
+ *
+ * RETURN
+ *   Always 0
+ */
+int json_output_failure() {
+    struct out_buffer out = {0};
+    int i;
+
+    out_str(&out, "{\n  \"failure\": true,\n  \"errors\": [\n");
+    for(i=0;i<n_errors;i++) {
+        if(i > 0)
+            out_str(&out, ",\n");
+        out_str(&out, "    ");
+        out_json_str(&out, error_strs[i]);
+    }
+    out_str(&out, "\n  ]\n}\n");
+    out_flush(&out);
+    out_free(&out);
+
+    return 0;
+}
+
+/* SYNOPSIS
+ *   Format size in bytes to a human readable number (size and unit B,K,M,G,T,P)
+ *   if human_readable is true and stores in return buffer. If human_readable
+ *   is false, stores the size in bytes in the buffer with no unit.
+ *
+ * ARGUMENT
+ *   unsigned long long int: usage in bytes
+ *   char* buffer: Buffer of at least 24 bytes where formatted size is stored
+ *
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int format_size(unsigned long long int size, char* buffer) {
+    char units[7] = {'B','K','M','G','T','P','E'};
+    char digits[24];
+    char* first;
+    unsigned long long step = 1024;
+    unsigned long long int mag = 1;
+    unsigned int i=0, length;
+
+    if(human_readable) {
+        // Default to exabytes
+        while(i<6 && size >= mag*step) {
+            i++;
+            mag=mag*step;
+        }
+        size /= mag;
+    }
+
+    first = format_u64(size, digits+sizeof(digits));
+    length = digits+sizeof(digits)-first;
+    memcpy(buffer, first, length);
+    if(human_readable)
+        buffer[length++] = units[i];
+    buffer[length] = '\0';
+    return i == 6;
+}
+
+
+/* SYNOPSIS
+ *   Copy the name of a UID/GID to a buffer, or the number when names are
+ *   not output
+ *
+ * ARGUMENT
+ *   unsigned int id : The UID/GID
+ *   char* name : Buffer of MAXNAMELEN bytes
+ *
+ * RETURN
+ *   Void
+ */
+void format_id(unsigned int id, char* name) {
+    char* first;
+
+    if(output_names) {
+        get_name(&name_cache, id, name);
+        return;
+    }
+    first = format_u64(id, name+MAXNAMELEN-1);
+    memmove(name, first, name+MAXNAMELEN-1-first);
+    name[name+MAXNAMELEN-1-first] = '\0';
+}
+
+
+/* SYNOPSIS
+ *   Append the name that starts a row of the plain text output, right
+ *   aligned in 24 columns
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   const char* name : Name of the row
+ *
+ * RETURN
+ *   Void
+ */
+void out_label(struct out_buffer *out, const char* name) {
+    size_t n = strlen(name);
+
+    if(n < 24 && out_reserve(out, 24-n) == 0) {
+        memset(out->data + out->length, ' ', 24-n);
+        out->length += 24-n;
+    }
+    out_mem(out, name, n);
+}
+
+
+/* SYNOPSIS
+ *   Append a column of a row of the plain text output holding a size, as
+ *   formatted by format_size
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   long long unsigned int size : Size in bytes
+ *
+ * RETURN
+ *   Void
+ */
+void out_size(struct out_buffer *out, long long unsigned int size) {
+    char size_buffer[32];
+
+    out_mem(out, "  ", 2);
+    format_size(size, size_buffer);
+    out_str(out, size_buffer);
+}
+
+
+/* SYNOPSIS
+ *   Append a row of the plain text output, with the name right aligned in
+ *   24 columns
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   char* name : Name of the row
+ *   long long unsigned int size : Size in bytes
+ *
+ * RETURN
+ *   Void
+ */
+void out_row(struct out_buffer *out, char* name, long long unsigned int size) {
+    out_label(out, name);
+    out_size(out, size);
+    out_mem(out, "\n", 1);
+}
+
+
+/* SYNOPSIS
+ *   Append the usage of one directory to the plain text or JSON output
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   struct tr_args *result : The directory
+ *   bool first : Whether this is the first directory of the output
+ *
+ * RETURN
+ *   Void
+ */
+void out_dir(struct out_buffer *out, struct tr_args *result, bool first) {
+    char name[MAXNAMELEN];
+    int j;
+
+    if(json) {
+        if(!first)
+            out_str(out, ",\n");
+        out_str(out, "    ");
+        out_json_str(out, result->path);
+        out_str(out, ": {\n");
+    }
+    else {
+        out_text(out, result->path);
+        out_mem(out, "\n", 1);
+    }
+
+    for(j=0;j<result->n_pairs*2;j+=2) {
+        format_id(result->pairs[j], name);
+        if(!json) {
+            out_row(out, name, result->pairs[j+1]);
+            continue;
+        }
+        if(j > 0)
+            out_str(out, ",\n");
+        out_str(out, "      ");
+        out_json_str(out, name);
+        out_mem(out, ":", 1);
+        out_u64(out, result->pairs[j+1]);
+    }
+    out_str(out, json ? "\n    }" : "\n");
+}
+
+
+/* SYNOPSIS
+ *   Thread that formats a range of directories into its own buffer
+ *
+ * ARGUMENT
+ *   void *arg : The range, a struct out_job
+ *
+ * RETURN
+ *   NULL
+ */
+static void* out_job_main(void *arg) {
+    struct out_job *job = arg;
+    int i;
+
+    for(i=job->first;i<job->last;i++)
+        out_dir(&job->out, job->results[i], i == 0);
+    return NULL;
+}
+
+
+/* SYNOPSIS
+ *   Append the usage of a list of directories to the output. Large lists
+ *   are split into ranges that threads format in parallel, and the
+ *   buffers of the ranges are written in order with one writev.
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   struct tr_args **results : The directories
+ *   int n : Number of directories
+ *
+ * RETURN
+ *   0 on success, 1 if memory ran out or the output could not be written
+ */
+int out_dirs(struct out_buffer *out, struct tr_args **results, int n) {
+    struct out_job *jobs = NULL;
+    struct iovec *iov = NULL;
+    int i, n_jobs = n/OUTCHUNK, status = 0;
+
+    if(n_jobs > n_threads)
+        n_jobs = n_threads;
+    if(n_jobs > 1) {
+        jobs = calloc(n_jobs, sizeof(struct out_job));
+        iov = calloc(n_jobs+1, sizeof(struct iovec));
+    }
+    if(n_jobs <= 1 || jobs == NULL || iov == NULL) {
+        free(jobs);
+        free(iov);
+        for(i=0;i<n && status == 0;i++) {
+            out_dir(out, results[i], i == 0);
+            if(out->length >= OUTFLUSH)
+                status = out_flush(out);
+        }
+        return status;
+    }
+
+    for(i=0;i<n_jobs;i++) {
+        jobs[i].results = results;
+        jobs[i].first = (long)n*i/n_jobs;
+        jobs[i].last = (long)n*(i+1)/n_jobs;
+        jobs[i].started = pthread_create(&jobs[i].thread, NULL, &out_job_main, &jobs[i]) == 0;
+        if(!jobs[i].started)
+            out_job_main(&jobs[i]);
+    }
+
+    iov[0].iov_base = out->data;
+    iov[0].iov_len = out->length;
+    for(i=0;i<n_jobs;i++) {
+        if(jobs[i].started)
+            pthread_join(jobs[i].thread, NULL);
+        status |= jobs[i].out.failed;
+        iov[i+1].iov_base = jobs[i].out.data;
+        iov[i+1].iov_len = jobs[i].out.length;
+    }
+    if(status != 0 || out->failed) {
+        printf("Could not allocate memory for output\n");
+        exit_status = 4;
+        status = 1;
+    }
+    else
+        status = write_all(STDOUT_FILENO, iov, n_jobs+1);
+    out->length = 0;
+
+    for(i=0;i<n_jobs;i++)
+        out_free(&jobs[i].out);
+    free(jobs);
+    free(iov);
+    return status;
+}
+
+
+/* SYNOPSIS
+ *   Copy the name of a UID or GID of --accounting to a buffer. IDs of the
+ *   kind the usage is summarized by share the name cache of the report,
+ *   and the others have a cache of their own.
+ *
+ * ARGUMENT
+ *   unsigned int id : The UID/GID
+ *   bool user : The ID is a UID
+ *   char* name : Buffer of MAXNAMELEN bytes
+ *
+ * RETURN
+ *   Void
+ */
+void format_acct_id(unsigned int id, bool user, char* name) {
+    if(!output_names || user == summarize_by_user)
+        format_id(id, name);
+    else
+        get_name(&other_names, id, name);
+}
+
+
+/* SYNOPSIS
+ *   Append one key of --accounting to the plain text or JSON output
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   char* name : Name of the key
+ *   struct acct_entry *entry : Usage of the key
+ *   bool first : The key is the first of its section
+ *   bool compact : Output JSON on a single line
+ *
+ * RETURN
+ *   Void
+ */
+void out_acct_row(struct out_buffer *out, char* name, struct acct_entry *entry, bool first, bool compact) {
+    if(json || compact) {
+        out_str(out, first ? "" : compact ? "," : ",\n");
+        out_str(out, compact ? "" : "      ");
+        out_json_str(out, name);
+        out_str(out, ":{\"bytes\":");
+        out_u64(out, entry->bytes);
+        out_str(out, ",\"apparent\":");
+        out_u64(out, entry->apparent);
+        out_str(out, ",\"files\":");
+        out_u64(out, entry->files);
+        out_mem(out, "}", 1);
+        return;
+    }
+
+    out_label(out, name);
+    out_size(out, entry->bytes);
+    out_size(out, entry->apparent);
+    out_mem(out, "  ", 2);
+    out_u64(out, entry->files);
+    out_mem(out, "\n", 1);
+}
+
+
+/* SYNOPSIS
+ *   Append the usage of --accounting by group, by user and by user and
+ *   group pair to the plain text output, or as the value of a JSON key.
+ *   Groups and users are summed from the pairs the walk counted.
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   bool compact : Output JSON on a single line
+ *
+ * RETURN
+ *   Void
+ */
+void out_accounting(struct out_buffer *out, bool compact) {
+    struct acct_table groups = {0}, users = {0};
+    struct acct_entry *pairs = NULL, *by_group = NULL, *by_user = NULL, *others, key, *found;
+    char (*group_names)[MAXNAMELEN] = NULL, (*user_names)[MAXNAMELEN] = NULL;
+    char name[2*MAXNAMELEN+1];
+    unsigned int i, g, u, n_others, pos;
+    bool added, failed = false, as_json = json || compact;
+
+    for(i=0;i<walk_acct.capacity && !failed;i++) {
+        if(walk_acct.entries[i].key == ACCTEMPTY)
+            continue;
+        key = walk_acct.entries[i];
+        failed = acct_add(&groups, key.key & UINT_MAX, key.bytes, key.apparent, key.files) != 0
+              || acct_add(&users, key.key >> 32, key.bytes, key.apparent, key.files) != 0;
+    }
+    if(!failed && (pairs=acct_sorted(&walk_acct)) != NULL && (by_group=acct_sorted(&groups)) != NULL && (by_user=acct_sorted(&users)) != NULL) {
+        group_names = malloc((groups.n_entries+1)*MAXNAMELEN);
+        user_names = malloc((users.n_entries+1)*MAXNAMELEN);
+    }
+    if(group_names == NULL || user_names == NULL) {
+        out->failed = true;
+        acct_free(&groups);
+        acct_free(&users);
+        free(pairs);
+        free(by_group);
+        free(by_user);
+        free(group_names);
+        free(user_names);
+        return;
+    }
+
+    // The walk only queued the IDs of the kind the usage is summarized by,
+    // so the others are resolved by the resolver threads before output
+    if(output_names && !other_names.from_file) {
+        others = summarize_by_user ? by_group : by_user;
+        n_others = summarize_by_user ? groups.n_entries : users.n_entries;
+        start_names(&other_names);
+        pthread_mutex_lock(&other_names.lock);
+        for(i=0;i<n_others;i++)
+            name_position(&other_names, others[i].key, &pos, &added);
+        pthread_cond_broadcast(&other_names.cond);
+        pthread_mutex_unlock(&other_names.lock);
+        stop_names(&other_names);
+    }
+
+    out_str(out, as_json ? (compact ? "{\"groups\":{" : "  \"accounting\": {\n    \"groups\": {\n") : "\n=================== Accounting by Group ===================\n");
+    if(!as_json)
+        out_str(out, "                   Group  Bytes  Apparent  Files\n");
+    for(g=0;g<groups.n_entries;g++) {
+        format_acct_id(by_group[g].key, false, group_names[g]);
+        out_acct_row(out, group_names[g], &by_group[g], g == 0, compact);
+    }
+
+    out_str(out, as_json ? (compact ? "},\"users\":{" : "\n    },\n    \"users\": {\n") : "\n=================== Accounting by User ===================\n");
+    if(!as_json)
+        out_str(out, "                    User  Bytes  Apparent  Files\n");
+    for(u=0;u<users.n_entries;u++) {
+        format_acct_id(by_user[u].key, true, user_names[u]);
+        out_acct_row(out, user_names[u], &by_user[u], u == 0, compact);
+    }
+
+    // Pairs are sorted by user, then group, and reuse the names above
+    out_str(out, as_json ? (compact ? "},\"user_groups\":{" : "\n    },\n    \"user_groups\": {\n") : "\n=================== Accounting by User and Group ===================\n");
+    if(!as_json)
+        out_str(out, "              User:Group  Bytes  Apparent  Files\n");
+    for(i=0;i<walk_acct.n_entries;i++) {
+        key.key = pairs[i].key >> 32;
+        found = bsearch(&key, by_user, users.n_entries, sizeof(struct acct_entry), compare_acct);
+        u = found - by_user;
+        key.key = pairs[i].key & UINT_MAX;
+        found = bsearch(&key, by_group, groups.n_entries, sizeof(struct acct_entry), compare_acct);
+        g = found - by_group;
+        snprintf(name, sizeof(name), "%s:%s", user_names[u], group_names[g]);
+        out_acct_row(out, name, &pairs[i], i == 0, compact);
+    }
+    if(as_json)
+        out_str(out, compact ? "}}" : "\n    }\n  }");
+
+    acct_free(&groups);
+    acct_free(&users);
+    free(pairs);
+    free(by_group);
+    free(by_user);
+    free(group_names);
+    free(user_names);
+}
+
+
+/* SYNOPSIS
+ *   Compare histograms by ID, for qsort
+ */
+int compare_hists(const void* a, const void* b) {
+    const struct histogram *x = *(struct histogram* const*)a, *y = *(struct histogram* const*)b;
+
+    if(x->id != y->id)
+        return x->id < y->id ? -1 : 1;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Append the age and size histograms of each ID of the walk to the plain
+ *   text output, or as the value of a JSON key. Only the buckets of the
+ *   size histogram that hold files are output.
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   bool compact : Output JSON on a single line
+ *
+ * RETURN
+ *   Void
+ */
+void out_histograms(struct out_buffer *out, bool compact) {
+    static const char* fields[] = {"", "atime", "mtime", "ctime"};
+    static const char units[] = " KMGTPE";
+    struct histogram **sorted = malloc((walk_hist.n_hists+1)*sizeof(struct histogram*));
+    struct histogram *hist;
+    char name[MAXNAMELEN];
+    unsigned int i;
+    int j;
+    bool as_json = json || compact, first;
+
+    if(sorted == NULL) {
+        out->failed = true;
+        return;
+    }
+    for(i=0;i<walk_hist.n_hists;i++)
+        sorted[i] = &walk_hist.hists[i];
+    qsort(sorted, walk_hist.n_hists, sizeof(struct histogram*), compare_hists);
+
+    if(as_json) {
+        out_str(out, compact ? "{" : "  \"histograms\": {\n");
+        if(age_field != AGE_NONE) {
+            out_str(out, compact ? "\"age\":{\"field\":\"" : "    \"age\": {\"field\":\"");
+            out_str(out, fields[age_field]);
+            out_str(out, "\",\"days\":[0");
+            for(j=0;j<n_ages;j++) {
+                out_mem(out, ",", 1);
+                out_u64(out, age_days[j]);
+            }
+            out_str(out, compact ? "]}," : "]},\n");
+        }
+        out_str(out, compact ? "\"ids\":{" : "    \"ids\": {\n");
+        for(i=0;i<walk_hist.n_hists;i++) {
+            hist = sorted[i];
+            format_id(hist->id, name);
+            out_str(out, i == 0 ? "" : compact ? "," : ",\n");
+            out_str(out, compact ? "" : "      ");
+            out_json_str(out, name);
+            out_mem(out, ":{", 2);
+            if(age_field != AGE_NONE) {
+                out_str(out, "\"age_bytes\":[");
+                for(j=0;j<=n_ages;j++) {
+                    out_str(out, j == 0 ? "" : ",");
+                    out_u64(out, hist->age_bytes[j]);
+                }
+                out_str(out, "],\"age_files\":[");
+                for(j=0;j<=n_ages;j++) {
+                    out_str(out, j == 0 ? "" : ",");
+                    out_u64(out, hist->age_files[j]);
+                }
+                out_str(out, size_histogram ? "]," : "]");
+            }
+            if(size_histogram) {
+                out_str(out, "\"sizes\":{");
+                first = true;
+                for(j=0;j<SIZEBUCKETS;j++) {
+                    if(hist->size_files[j] == 0)
+                        continue;
+                    out_str(out, first ? "\"" : ",\"");
+                    out_u64(out, j == 0 ? 0 : 1ULL << (j-1));
+                    out_str(out, "\":{\"bytes\":");
+                    out_u64(out, hist->size_bytes[j]);
+                    out_str(out, ",\"files\":");
+                    out_u64(out, hist->size_files[j]);
+                    out_mem(out, "}", 1);
+                    first = false;
+                }
+                out_mem(out, "}", 1);
+            }
+            out_mem(out, "}", 1);
+        }
+        out_str(out, compact ? "}}" : "\n    }\n  }");
+        free(sorted);
+        return;
+    }
+
+    // Age buckets are labeled by the age in days they start at, and hold
+    // the size counted followed by the number of files
+    if(age_field != AGE_NONE) {
+        out_str(out, "\n=================== Age by ");
+        out_str(out, fields[age_field]);
+        out_str(out, " ===================\n");
+        out_str(out, summarize_by_user ? "                    User" : "                   Group");
+        for(j=0;j<=n_ages;j++) {
+            out_mem(out, "  ", 2);
+            out_u64(out, j == 0 ? 0 : age_days[j-1]);
+            out_mem(out, "d", 1);
+        }
+        out_mem(out, "\n", 1);
+        for(i=0;i<walk_hist.n_hists;i++) {
+            hist = sorted[i];
+            format_id(hist->id, name);
+            out_label(out, name);
+            for(j=0;j<=n_ages;j++) {
+                out_size(out, hist->age_bytes[j]);
+                out_str(out, " (");
+                out_u64(out, hist->age_files[j]);
+                out_mem(out, ")", 1);
+            }
+            out_mem(out, "\n", 1);
+        }
+    }
+
+    // Size buckets are labeled by the power of two they start at
+    if(size_histogram) {
+        out_str(out, "\n=================== Files by Size ===================\n");
+        out_str(out, summarize_by_user ? "                    User" : "                   Group");
+        out_str(out, "  <smallest size>: <files>\n");
+        for(i=0;i<walk_hist.n_hists;i++) {
+            hist = sorted[i];
+            format_id(hist->id, name);
+            out_label(out, name);
+            for(j=0;j<SIZEBUCKETS;j++) {
+                if(hist->size_files[j] == 0)
+                    continue;
+                out_mem(out, "  ", 2);
+                out_u64(out, j == 0 ? 0 : 1ULL << (j-1)%10);
+                if(j > 10)
+                    out_mem(out, &units[(j-1)/10], 1);
+                out_str(out, ": ");
+                out_u64(out, hist->size_files[j]);
+            }
+            out_mem(out, "\n", 1);
+        }
+    }
+    free(sorted);
+}
+
+
+/* SYNOPSIS
+ *   Append the number of workers chosen by -t auto and its trajectory to
+ *   the JSON output, as the threads object
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   bool compact : Output JSON on a single line
+ *
+ * RETURN
+ *   Void
+ */
+void out_tuning(struct out_buffer *out, bool compact) {
+    unsigned int i;
+
+    out_str(out, compact ? "{\"initial\":" : "  \"threads\": {\"initial\":");
+    out_u64(out, initial_workers);
+    out_str(out, ",\"final\":");
+    out_u64(out, active_workers);
+    out_str(out, compact ? ",\"trajectory\":[" : ",\"trajectory\":[\n");
+    for(i=0;i<n_tune_steps;i++) {
+        out_str(out, i == 0 ? "" : compact ? "," : ",\n");
+        out_str(out, compact ? "{\"elapsed_ms\":" : "    {\"elapsed_ms\":");
+        out_u64(out, tune_steps[i].elapsed_ms);
+        out_str(out, ",\"workers\":");
+        out_u64(out, tune_steps[i].workers);
+        out_str(out, ",\"stats_per_sec\":");
+        out_u64(out, tune_steps[i].stats_per_sec);
+        out_str(out, ",\"stat_latency_ns\":");
+        out_u64(out, tune_steps[i].latency_ns);
+        out_mem(out, "}", 1);
+    }
+    out_str(out, compact ? "]}" : "\n  ]}");
+}
+
+
+/* SYNOPSIS
+ *   Append the rows of a summary to the plain text output
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   struct tr_args *summary : The summary
+ *   long long unsigned int total : The total use across all IDs
+ *
+ * RETURN
+ *   Void
+ */
+void out_summary_rows(struct out_buffer *out, struct tr_args *summary, long long unsigned int total) {
+    char name[MAXNAMELEN];
+    int j;
+
+    for(j=0;j<summary->n_pairs*2;j+=2) {
+        format_id(summary->pairs[j], name);
+        out_row(out, name, summary->pairs[j+1]);
+    }
+    out_row(out, "Total", total);
+}
+
+
+/* SYNOPSIS
+ *   Output result in plain text format, with a section for each target
+ *
+ * ARGUMENT
+ *   struct root *roots : The targets. Targets without a report are skipped.
+ *   int n_roots : Number of targets
+ *   struct tr_args *grand : Summary over all targets, or NULL
+ *   long long unsigned int grand_total: The total use across all targets
+ *
+ * RETURN
+ *   0 on success, 1 if the output could not be written
+ */
+int output_table(struct root *roots, int n_roots, struct tr_args *grand, long long unsigned int grand_total) {
+    struct out_buffer out = {0};
+    int i, n_out = 0, status = 0;
+
+    if(n_errors > 0) {
+        out_str(&out, "=================== Errors ===================\n");
+        for(i=0;i<n_errors;i++) {
+            out_str(&out, error_strs[i]);
+            out_mem(&out, "\n", 1);
+        }
+        out_str(&out, "\n\n");
+    }
+
+    for(i=0;i<n_roots;i++) {
+        if(roots[i].report == NULL)
+            continue;
+        if(n_out++ > 0)
+            out_mem(&out, "\n", 1);
+        out_str(&out, "=================== Sub Directories ====================\n"); 
+        status |= out_dirs(&out, roots[i].report, roots[i].n_report-1);
+        out_str(&out, "\n=================== Summaries ===================\n");
+        out_summary_rows(&out, roots[i].report[roots[i].n_report-1], roots[i].total);
+    }
+
+    if(grand != NULL) {
+        out_str(&out, "\n=================== Grand Summary ===================\n");
+        out_summary_rows(&out, grand, grand_total);
+    }
+    if(accounting)
+        out_accounting(&out, false);
+    if(age_field != AGE_NONE || size_histogram)
+        out_histograms(&out, false);
+    status |= out_flush(&out);
+    out_free(&out);
+    return status;
+}
+
+
+/* SYNOPSIS
+ *   Append a summary and its total to the JSON output
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   struct tr_args *summary : The summary
+ *   long long unsigned int total: The total use across all IDs
+ *
+ * RETURN
+ *   Void
+ */
+void out_json_summary(struct out_buffer *out, struct tr_args *summary, long long unsigned int total) {
+    char name[MAXNAMELEN];
+    int j;
+
+    // Output the group totals summary
+    out_str(out, "  \"summary\": {\n");
+    for(j=0;j<summary->n_pairs*2;j+=2) {
+        format_id(summary->pairs[j], name);
+        if(j > 0)
+            out_str(out, ",\n");
+        out_str(out, "    ");
+        out_json_str(out, name);
+        out_mem(out, ":", 1);
+        out_u64(out, summary->pairs[j+1]);
+    }
+    out_str(out, "\n  },\n");
+
+    // Output the grand total 
+    out_str(out, "  \"total\":");
+    out_u64(out, total);
+}
+
+
+/* SYNOPSIS
+ *   Append the subdirectories, summary and total of one target to the JSON
+ *   output
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   struct root *target : The target, with its report ending in its summary
+ *
+ * RETURN
+ *   0 on success, 1 if the output could not be written
+ */
+int out_json_target(struct out_buffer *out, struct root *target) {
+    int status;
+
+    out_str(out, "  \"subdirs\": {\n");
+    status = out_dirs(out, target->report, target->n_report-1);
+    out_str(out, "\n  },\n");
+    out_json_summary(out, target->report[target->n_report-1], target->total);
+    return status;
+}
+
+
+/* SYNOPSIS
+ *   Outputs the result of the command as a JSON object. With several
+ *   targets, each target is an object in a list of roots, followed by the
+ *   summary over all targets when requested.
+ *
+ * ARGUMENT
+ *   struct root *roots : The targets. Targets without a report are skipped.
+ *   int n_roots : Number of targets
+ *   bool sections : Output the list of roots, even for one target
+ *   struct tr_args *grand : Summary over all targets, or NULL
+ *   long long unsigned int grand_total: The total use across all targets
+ *
+ * RETURN
+ *   0 on success, 1 if the output could not be written
+ */
+int output_json(struct root *roots, int n_roots, bool sections, struct tr_args *grand, long long unsigned int grand_total) {
+    struct out_buffer out = {0};
+    int i, n_out = 0, status = 0;
+
+    out_str(&out, "{\n  \"errors\": [\n");
+    for(i=0;i<n_errors;i++) {
+        if(i > 0)
+            out_str(&out, ",\n");
+        out_str(&out, "    ");
+        out_json_str(&out, error_strs[i]);
+    }
+    out_str(&out, "\n  ],\n");
+
+    if(!sections) {
+        status = out_json_target(&out, &roots[0]);
+        if(accounting) {
+            out_str(&out, ",\n");
+            out_accounting(&out, false);
+        }
+        if(age_field != AGE_NONE || size_histogram) {
+            out_str(&out, ",\n");
+            out_histograms(&out, false);
+        }
+        if(auto_threads) {
+            out_str(&out, ",\n");
+            out_tuning(&out, false);
+        }
+        out_str(&out, "\n}\n");
+        status |= out_flush(&out);
+        out_free(&out);
+        return status;
+    }
+
+    out_str(&out, "  \"roots\": [\n");
+    for(i=0;i<n_roots;i++) {
+        if(roots[i].report == NULL)
+            continue;
+        out_str(&out, n_out++ > 0 ? ",\n{\n  \"path\": " : "{\n  \"path\": ");
+        out_json_str(&out, roots[i].path);
+        out_str(&out, ",\n");
+        status |= out_json_target(&out, &roots[i]);
+        out_str(&out, "\n}");
+    }
+    out_str(&out, "\n  ]");
+    if(grand != NULL) {
+        out_str(&out, ",\n");
+        out_json_summary(&out, grand, grand_total);
+    }
+    if(accounting) {
+        out_str(&out, ",\n");
+        out_accounting(&out, false);
+    }
+    if(age_field != AGE_NONE || size_histogram) {
+        out_str(&out, ",\n");
+        out_histograms(&out, false);
+    }
+    if(auto_threads) {
+        out_str(&out, ",\n");
+        out_tuning(&out, false);
+    }
+    out_str(&out, "\n}\n");
+    status |= out_flush(&out);
+    out_free(&out);
+    return status;
+}
+
+/* SYNOPSIS
+ *   Append the usage by ID of a table to a line of streamed JSON
+ *
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   struct id_table *usage : Storage usage by ID
+ *
+ * RETURN
+ *   Total of the usage
+ */
+long long unsigned int out_usage(struct out_buffer *out, struct id_table *usage) {
+    char name[MAXNAMELEN];
+    unsigned int pos = 0;
+    struct id_entry *entry;
+    long long unsigned int total = 0;
+    int n_ids = 0;
+
+    out_mem(out, "{", 1);
+    while((entry=id_table_next(usage, &pos)) != NULL) {
+        if(n_ids++ > 0)
+            out_mem(out, ",", 1);
+        format_id(entry->id, name);
+        out_json_str(out, name);
+        out_mem(out, ":", 1);
+        out_u64(out, entry->size);
+        total += entry->size;
+    }
+    out_mem(out, "}", 1);
+    return total;
+}
+
+/* SYNOPSIS
+ *   Output the usage of one directory as a line of JSON, as soon as all
+ *   of the directories below it are complete. Subdirectories of the
+ *   target, and the target itself, are added to the streamed summary.
+ * ARGUMENT
+ *   char* path : The directory
+ *   unsigned int depth : Depth of the directory below the target
+ *   struct id_table *usage : Storage usage of the directory by ID
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int stream_result(char* path, unsigned int depth, struct id_table *usage) {
+    struct out_buffer out = {0};
+    long long unsigned int total;
+    int status = 0;
+
+    out_str(&out, "{\"path\":");
+    out_json_str(&out, path);
+    out_str(&out, ",\"depth\":");
+    out_u64(&out, depth);
+    out_str(&out, ",\"usage\":");
+    total = out_usage(&out, usage);
+    out_str(&out, "}\n");
+
+    pthread_mutex_lock(&output_lock);
+    status = out_flush(&out);
+    if(depth <= 1) {
+        stream_total += total;
+        if(id_table_merge(&stream_summary, usage) != 0) {
+            store_error(path, "Could not allocate memory for usage table");
+            exit_now = true;
+            exit_status = 4;
+            status = 1;
+        }
+    }
+    pthread_mutex_unlock(&output_lock);
+
+    out_free(&out);
+    return status;
+}
+
+/* SYNOPSIS
+ *   Output the summary of a streamed walk as the last line of JSON
+ * ARGUMENT
+ *   None
+ * RETURN
+ *   0 on success, 1 if the output could not be written
+ */
+int stream_summary_line() {
+    struct out_buffer out = {0};
+    int i, status;
+
+    out_str(&out, "{\"summary\":");
+    out_usage(&out, &stream_summary);
+    out_str(&out, ",\"total\":");
+    out_u64(&out, stream_total);
+    if(accounting) {
+        out_str(&out, ",\"accounting\":");
+        out_accounting(&out, true);
+    }
+    if(age_field != AGE_NONE || size_histogram) {
+        out_str(&out, ",\"histograms\":");
+        out_histograms(&out, true);
+    }
+    if(auto_threads) {
+        out_str(&out, ",\"threads\":");
+        out_tuning(&out, true);
+    }
+    out_str(&out, ",\"errors\":[");
+    for(i=0;i<n_errors;i++) {
+        if(i > 0)
+            out_mem(&out, ",", 1);
+        out_json_str(&out, error_strs[i]);
+    }
+    out_str(&out, "]}\n");
+    status = out_flush(&out);
+    out_free(&out);
+    return status;
+}
+
+/* SYNOPSIS
+ *   Allocate memory from an arena. Blocks are added as the arena fills,
+ *   and a request larger than a quarter of a block gets a block of its
+ *   own behind the block being filled, so the space left in it is kept.
+ *
+ * ARGUMENT
+ *   struct arena *a : The arena
+ *   size_t n : Number of bytes
+ *
+ * RETURN
+ *   The memory, aligned for any type, or NULL if it could not be allocated
+ */
+void* arena_alloc(struct arena *a, size_t n) {
+    struct arena_block *block = a->head;
+    size_t size;
+
+    n = (n + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    if(block != NULL && block->size - block->used >= n) {
+        block->used += n;
+        return block->data + block->used - n;
+    }
+    size = n > ARENABLOCK/4 ? n : ARENABLOCK;
+    block = malloc(sizeof(struct arena_block) + size);
+    if(block == NULL)
+        return NULL;
+    block->used = n;
+    block->size = size;
+    if(size == n && a->head != NULL) {
+        block->next = a->head->next;
+        a->head->next = block;
+    }
+    else {
+        block->next = a->head;
+        a->head = block;
+    }
+    return block->data;
+}
+
+
+/* SYNOPSIS
+ *   Move all blocks of an arena into another arena
+ *
+ * ARGUMENT
+ *   struct arena *dst : The arena that takes the blocks
+ *   struct arena *src : The arena that is emptied
+ *
+ * RETURN
+ *   Void
+ */
+void arena_merge(struct arena *dst, struct arena *src) {
+    struct arena_block *tail = src->head;
+
+    if(tail == NULL)
+        return;
+    while(tail->next != NULL)
+        tail = tail->next;
+    tail->next = dst->head;
+    dst->head = src->head;
+    src->head = NULL;
+}
+
+
+/* SYNOPSIS
+ *   Free all memory allocated from an arena
+ *
+ * ARGUMENT
+ *   struct arena *a : The arena
+ *
+ * RETURN
+ *   Void
+ */
+void arena_free(struct arena *a) {
+    struct arena_block *block;
+
+    while((block=a->head) != NULL) {
+        a->head = block->next;
+        free(block);
+    }
+}
+
+
+/* SYNOPSIS:
+ *   Initialize a new empty result in the arena of the current thread. The
+ *   path is stored directly after the result.
+ *
+ * ARGUMENT
+ *   struct tr_args **result : Pointer to an address where we will initialize the
+ *                             result 
+ *   char* dir : The file/directory path associated with the result
+ *
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int init_result(struct tr_args **result, char* dir) {
+    size_t len = strlen(dir)+1;
+
+    (*result) = arena_alloc(thread_arena, sizeof(struct tr_args)+len);
+    if(*result == NULL)
+        return 1;
+    (*result)->path = (char*)(*result + 1);
+    memcpy((*result)->path, dir, len);
+    (*result)->n_pairs = 0;
+    (*result)->pairs = NULL;
+    id_table_init(&(*result)->usage);
+    pthread_mutex_init(&(*result)->lock, NULL);
+    (*result)->parent = NULL;
+    (*result)->depth = 0;
+    (*result)->rank = 0;
+    (*result)->root = 0;
+    (*result)->pending = 0;
+    (*result)->skipped = false;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Free the memory a result holds outside the arena. The result itself
+ *   is released with its arena.
+ *
+ * ARGUMENT
+ *   struct tr_args **result : Pointer to the address of a result
+ *
+ * RETURN
+ *   Void 
+ */
+void free_result(struct tr_args **result) {
+  id_table_free(&(*result)->usage);
+  pthread_mutex_destroy(&(*result)->lock);
+}
+
+
+/* SYNOPSIS
+ *   Copies the database of storage-by-gid into a result structure. The
+ *   method interleaves the IDs and sizes of the table into a single
+ *   array of pairs in the arena of the current thread
+ * ARGUMENT
+ *   struct tr_args *result : Address of result to populate
+ *   struct id_table *usage : Storage usage for each GID encountered
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int pack_result(struct tr_args *result, struct id_table *usage) {
+    unsigned int n_groups = id_table_size(usage);
+    unsigned int pos = 0;
+    struct id_entry *entry;
+    int j;
+
+    result->pairs = arena_alloc(thread_arena, n_groups*2*sizeof(long long unsigned int));
+    if(result->pairs == NULL)
+        return 1;
+    result->n_pairs = n_groups;
+    j = 0;
+    while((entry=id_table_next(usage, &pos)) != NULL) {
+        result->pairs[j] = entry->id;
+        result->pairs[j+1] = entry->size;
+        j += 2;
+    }
+    return 0;
+}
+
+/* SYNOPSIS
+ *   Iterates over all results generated to compile a summary of total
+ *   usage by group
+ * ARGUMENT
+ *   void* tstructs: A pointer to the array oif results
+ *   int n_results: The number of results in the array
+ *   long long unsigned int *total: Address where a grand total is stored
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int add_summary(void* tstructs, int n_results, long long unsigned int *total) {
+    struct tr_args **results = tstructs;
+    int i, j;
+    unsigned long long int size;
+    unsigned int gid;
+    struct id_table usage;
+
+    id_table_init(&usage);
+
+    // i<n_results-1 because the results of the target
+    // directory and sub-directories are in indices
+    // [0,n_results-2] and the summary is stored at
+    // index n_results-1. Deeper directories are already
+    // included in the sub-directories.
+    for(i=0;i<n_results-1;i++) {
+        if(results[i]->depth > 1)
+            continue;
+        for(j=0;j<results[i]->n_pairs*2;j+=2) {
+            gid = results[i]->pairs[j];
+            size = results[i]->pairs[j+1];
+            if(id_table_add(&usage, gid, size) != 0) {
+                id_table_free(&usage);
+                return 1;
+            }
+            *total += size;
+        }
+    }
+    
+    if(pack_result(results[n_results-1], &usage) != 0) {
+        id_table_free(&usage);
+        return 1;
+    }
+    id_table_free(&usage);
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Wrap an open directory descriptor in a reference counted handle. The
+ *   caller holds the first reference.
+ *
+ * ARGUMENT
+ *   int fd : The open directory
+ *
+ * RETURN
+ *   The handle, or NULL if memory could not be allocated
+ */
+struct dir_handle* new_handle(int fd) {
+    struct dir_handle *handle = malloc(sizeof(struct dir_handle));
+    if(handle == NULL)
+        return NULL;
+    handle->fd = fd;
+    handle->refs = 1;
+    __atomic_add_fetch(&open_handles, 1, __ATOMIC_RELAXED);
+    return handle;
+}
+
+
+/* SYNOPSIS
+ *   Decide whether subdirectories may hold a reference to a directory
+ *   handle, keeping it open until they are opened relative to it
+ *
+ * ARGUMENT
+ *   struct dir_handle *handle : The handle to share
+ *
+ * RETURN
+ *   The handle, or NULL if too many directories are held open already
+ *   and subdirectories should be opened by full path
+ */
+struct dir_handle* share_handle(struct dir_handle *handle) {
+    if(handle == NULL || __atomic_load_n(&open_handles, __ATOMIC_RELAXED) > max_handles)
+        return NULL;
+    return handle;
+}
+
+
+/* SYNOPSIS
+ *   Release a reference to a directory handle, closing the directory when
+ *   the last reference is released
+ *
+ * ARGUMENT
+ *   struct dir_handle *handle : The handle to release
+ *
+ * RETURN
+ *   Void
+ */
+void release_handle(struct dir_handle *handle) {
+    if(__atomic_sub_fetch(&handle->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(handle->fd);
+        free(handle);
+        __atomic_sub_fetch(&open_handles, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* SYNOPSIS
+ *   Free a work item and release its reference to the parent directory
+ *
+ * ARGUMENT
+ *   struct work_item *item : The work item to free
+ *
+ * RETURN
+ *   Void
+ */
+void free_work_item(struct work_item *item) {
+    if(item->parent != NULL)
+        release_handle(item->parent);
+    free(item->path);
+    free(item->names);
+    free(item);
+}
+
+
+/* SYNOPSIS
+ *   Initialize an empty work deque
+ *
+ * ARGUMENT
+ *   struct work_deque *deque : The deque to initialize
+ *
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int deque_init(struct work_deque *deque) {
+    deque->capacity = 64;
+    deque->head = 0;
+    deque->tail = 0;
+    deque->items = malloc(deque->capacity*sizeof(struct work_item*));
+    if(deque->items == NULL)
+        return 1;
+    pthread_mutex_init(&deque->lock, NULL);
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Push a work item onto the tail of a deque, growing the deque if it
+ *   is full. The head and tail are free running counters, and the slot
+ *   for a counter is found by masking with the (power of 2) capacity.
+ *
+ * ARGUMENT
+ *   struct work_deque *deque : The deque to push onto
+ *   struct work_item *item : The work item
+ *
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int deque_push(struct work_deque *deque, struct work_item *item) {
+    unsigned int i, size;
+    struct work_item **grown;
+
+    pthread_mutex_lock(&deque->lock);
+    size = deque->tail - deque->head;
+    if(size == deque->capacity) {
+        grown = malloc(2*deque->capacity*sizeof(struct work_item*));
+        if(grown == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return 1;
+        }
+        for(i=0;i<size;i++)
+            grown[i] = deque->items[(deque->head+i) & (deque->capacity-1)];
+        free(deque->items);
+        deque->items = grown;
+        deque->capacity *= 2;
+        deque->head = 0;
+        deque->tail = size;
+    }
+    deque->items[deque->tail & (deque->capacity-1)] = item;
+    __atomic_store_n(&deque->tail, deque->tail+1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Pop the most recently pushed work item from the tail of a deque
+ *
+ * ARGUMENT
+ *   struct work_deque *deque : The deque to pop from
+ *
+ * RETURN
+ *   The work item, or NULL if the deque is empty
+ */
+struct work_item* deque_pop(struct work_deque *deque) {
+    struct work_item *item = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail != deque->head) {
+        __atomic_store_n(&deque->tail, deque->tail-1, __ATOMIC_RELEASE);
+        item = deque->items[deque->tail & (deque->capacity-1)];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return item;
+}
+
+
+/* SYNOPSIS
+ *   Take the oldest work item from the head of a deque
+ *
+ * ARGUMENT
+ *   struct work_deque *deque : The deque to steal from
+ *
+ * RETURN
+ *   The work item, or NULL if the deque is empty
+ */
+struct work_item* deque_steal(struct work_deque *deque) {
+    struct work_item *item = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail != deque->head) {
+        item = deque->items[deque->head & (deque->capacity-1)];
+        __atomic_store_n(&deque->head, deque->head+1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return item;
+}
+
+
+/* SYNOPSIS
+ *   Approximate number of items in a deque, read without taking the lock
+ *
+ * ARGUMENT
+ *   struct work_deque *deque : The deque to check
+ *
+ * RETURN
+ *   Number of items
+ */
+unsigned int deque_size(struct work_deque *deque) {
+    unsigned int tail = __atomic_load_n(&deque->tail, __ATOMIC_ACQUIRE);
+    unsigned int head = __atomic_load_n(&deque->head, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
+
+
+/* SYNOPSIS
+ *   Free a deque and any work items that are still queued in it
+ *
+ * ARGUMENT
+ *   struct work_deque *deque : The deque to free
+ *
+ * RETURN
+ *   Void
+ */
+void deque_free(struct work_deque *deque) {
+    struct work_item *item;
+    while((item=deque_pop(deque)) != NULL)
+        free_work_item(item);
+    free(deque->items);
+    pthread_mutex_destroy(&deque->lock);
+}
+
+
+/* SYNOPSIS
+ *   Create the result for a directory below the subdirectories of the
+ *   target when deeper directories are reported
+ *
+ * ARGUMENT
+ *   char* path : The directory
+ *   struct tr_args *parent : The result of the parent directory
+ *   unsigned int depth : Depth of the directory below the target
+ *
+ * RETURN
+ *   The result, or NULL if memory could not be allocated
+ */
+struct tr_args* new_node(char* path, struct tr_args *parent, unsigned int depth) {
+    struct tr_args *node, **grown;
+
+    pthread_mutex_lock(&tree_lock);
+    if(n_tree_nodes == tree_capacity) {
+        grown = realloc(tree_nodes, (tree_capacity == 0 ? 64 : tree_capacity*2)*sizeof(struct tr_args*));
+        if(grown == NULL) {
+            pthread_mutex_unlock(&tree_lock);
+            store_error(path, "Could not allocate memory to report directory");
+            return NULL;
+        }
+        tree_nodes = grown;
+        tree_capacity = tree_capacity == 0 ? 64 : tree_capacity*2;
+    }
+    if(init_result(&node, path) != 0) {
+        pthread_mutex_unlock(&tree_lock);
+        store_error(path, "Could not allocate memory to report directory");
+        return NULL;
+    }
+    node->parent = parent;
+    node->depth = depth;
+    node->rank = parent->rank;
+    node->root = parent->root;
+    __atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+    tree_nodes[n_tree_nodes++] = node;
+    pthread_mutex_unlock(&tree_lock);
+    return node;
+}
+
+
+/* SYNOPSIS
+ *   Wake workers that are waiting for work
+ *
+ * ARGUMENT
+ *   bool all : Wake all waiting workers instead of one
+ *
+ * RETURN
+ *   Void
+ */
+void wake_workers(bool all) {
+    pthread_mutex_lock(&park_lock);
+    if(all) {
+        pthread_cond_broadcast(&park_cond);
+        pthread_cond_broadcast(&bench_cond);
+    }
+    else
+        pthread_cond_signal(&park_cond);
+    pthread_mutex_unlock(&park_lock);
+}
+
+
+/* SYNOPSIS
+ *   Release one pending work item, and wake all waiting workers so they
+ *   can exit once the walk is complete
+ *
+ * ARGUMENT
+ *   None
+ *
+ * RETURN
+ *   Void
+ */
+void release_work() {
+    if(__atomic_sub_fetch(&pending_work, 1, __ATOMIC_ACQ_REL) == 0)
+        wake_workers(true);
+}
+
+
+/* SYNOPSIS
+ *   Push a work item on a worker's deque, and wake a parked worker
+ *
+ * ARGUMENT
+ *   struct worker *owner : The worker whose deque receives the item
+ *   struct work_item *item : The item
+ *
+ * RETURN
+ *   0 on success, 1 on error
+ */
+int push_work(struct worker *owner, struct work_item *item) {
+    struct tr_args *slot = item->slot;
+
+    // Count the item as pending before it becomes visible to other
+    // workers, so the count can never reach 0 while work remains
+    __atomic_add_fetch(&pending_work, 1, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&slot->pending, 1, __ATOMIC_RELAXED);
+    if(deque_push(&owner->deque, item) != 0) {
+        __atomic_sub_fetch(&pending_work, 1, __ATOMIC_ACQ_REL);
+        __atomic_sub_fetch(&slot->pending, 1, __ATOMIC_RELAXED);
+        store_error(item->path, "Could not allocate memory to queue directory");
+        free_work_item(item);
+        return 1;
+    }
+
+    // Pairs with the fence in park_worker, so either the parked worker
+    // sees the item or we see the parked worker
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&n_parked, __ATOMIC_RELAXED) > 0)
+        wake_workers(false);
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Create a work item for a directory and queue it on a worker's deque
+ *
+ * ARGUMENT
+ *   struct worker *owner : The worker whose deque receives the item
+ *   char* path : The directory to walk
+ *   struct dir_handle *parent : Open parent directory to resolve the last
+ *                               component of path against, or NULL to
+ *                               open the directory by full path
+ *   struct tr_args *slot : The result the usage rolls up into. Directories
+ *                          deeper than 1 that are reported get a result of
+ *                          their own that is folded into slot later
+ *   unsigned int depth : Depth of the directory below the target
+ *   long long unsigned int devnum : Device the walk is restricted to
+ *
+ * RETURN
+ *   0 on success, 1 on error
+ */
+int queue_work(struct worker *owner, char* path, struct dir_handle *parent, struct tr_args *slot, unsigned int depth, long long unsigned int devnum) {
+    struct work_item *item;
+
+    if(depth > 1 && depth <= max_depth && (slot=new_node(path, slot, depth)) == NULL)
+        return 1;
+
+    item = malloc(sizeof(struct work_item));
+    if(item == NULL) {
+        store_error(path, "Could not allocate memory to queue directory");
+        return 1;
+    }
+    item->path = strdup(path);
+    item->name = NULL;
+    item->names = NULL;
+    item->n_names = 0;
+    item->parent = NULL;
+    item->slot = slot;
+    item->depth = depth;
+    item->devnum = devnum;
+    if(item->path == NULL) {
+        store_error(path, "Could not allocate memory to queue directory");
+        free(item);
+        return 1;
+    }
+    if(parent != NULL) {
+        item->name = strrchr(item->path, '/') + 1;
+        item->parent = parent;
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    }
+    return push_work(owner, item);
+}
+
+
+/* SYNOPSIS
+ *   Queue a batch of entries of the top level of a target, so the workers
+ *   stat them in parallel
+ *
+ * ARGUMENT
+ *   struct worker *owner : The worker whose deque receives the item
+ *   char* path : The target, without a trailing separator
+ *   struct dir_handle *parent : The open target, or NULL to stat the
+ *                               entries by full path
+ *   struct tr_args *slot : The result of the target
+ *   char* names : The names, packed with their terminating null. The item
+ *                 takes ownership of them.
+ *   unsigned int n_names : Number of names
+ *
+ * RETURN
+ *   0 on success, 1 on error
+ */
+int queue_names(struct worker *owner, char* path, struct dir_handle *parent, struct tr_args *slot, char* names, unsigned int n_names) {
+    struct work_item *item = malloc(sizeof(struct work_item));
+
+    if(item == NULL || (item->path=strdup(path)) == NULL) {
+        store_error(path, "Could not allocate memory to queue directory");
+        free(item);
+        free(names);
+        return 1;
+    }
+    item->name = NULL;
+    item->names = names;
+    item->n_names = n_names;
+    item->parent = parent;
+    item->slot = slot;
+    item->depth = 0;
+    item->devnum = 0;
+    if(parent != NULL)
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    return push_work(owner, item);
+}
+
+
+/* SYNOPSIS
+ *   Build the path of a directory entry in the worker's path buffer,
+ *   growing the buffer as needed so paths are not limited in length
+ *
+ * ARGUMENT
+ *   struct worker *self : The worker that owns the buffer
+ *   char* dir : Path of the directory containing the entry
+ *   char* name : Name of the entry
+ *
+ * RETURN
+ *   The path, or NULL if memory could not be allocated
+ */
+char* child_path(struct worker *self, char* dir, char* name) {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    size_t needed = dir_len + name_len + 2;
+    char* grown;
+
+    if(needed > self->pathbuf_len) {
+        grown = realloc(self->pathbuf, needed*2);
+        if(grown == NULL)
+            return NULL;
+        self->pathbuf = grown;
+        self->pathbuf_len = needed*2;
+    }
+    memcpy(self->pathbuf, dir, dir_len);
+    self->pathbuf[dir_len] = '/';
+    memcpy(self->pathbuf+dir_len+1, name, name_len+1);
+    return self->pathbuf;
+}
+
+
+/* SYNOPSIS
+ *   Attempt to steal a work item from the other workers, starting with
+ *   the worker after this one so thieves spread across victims
+ *
+ * ARGUMENT
+ *   struct worker *self : The worker looking for work
+ *
+ * RETURN
+ *   The stolen work item, or NULL if no work was found
+ */
+struct work_item* steal_work(struct worker *self) {
+    unsigned int i, victim, n = __atomic_load_n(&n_workers, __ATOMIC_ACQUIRE);
+    struct work_item *item;
+
+    for(i=1;i<n;i++) {
+        victim = (self->id+i) % n;
+        if(deque_size(&workers[victim].deque) == 0)
+            continue;
+        if((item=deque_steal(&workers[victim].deque)) != NULL)
+            return item;
+    }
+    return NULL;
+}
+
+
+/* SYNOPSIS
+ *   Decide whether a busy worker should give away a subdirectory instead
+ *   of walking it. Subtrees are given away while there are more idle
+ *   workers than items already waiting in this worker's deque.
+ *
+ * ARGUMENT
+ *   struct worker *self : The busy worker
+ *
+ * RETURN
+ *   true if the subdirectory should be queued for another worker
+ */
+bool should_donate(struct worker *self) {
+    int idle = __atomic_load_n(&idle_workers, __ATOMIC_RELAXED);
+    return idle > 0 && (unsigned int)idle > deque_size(&self->deque);
+}
+
+
+/* SYNOPSIS
+ *   Release work items or child results that a result was waiting for.
+ *   Once nothing under the result is pending its usage is complete, so it
+ *   is streamed when requested and folded into the result of its parent,
+ *   which in turn stops waiting for it.
+ *
+ * ARGUMENT
+ *   struct tr_args *slot : The result
+ *   long n : Number of work items or child results to release
+ *
+ * RETURN
+ *   Void
+ */
+void release_slot(struct tr_args *slot, long n) {
+    struct tr_args *parent;
+
+    while(slot != NULL && __atomic_sub_fetch(&slot->pending, n, __ATOMIC_ACQ_REL) == 0) {
+        parent = slot->parent;
+        if(slot->depth == 1)
+            __atomic_add_fetch(&n_top_done, 1, __ATOMIC_RELAXED);
+        if(ndjson && !slot->skipped)
+            stream_result(slot->path, slot->depth, &slot->usage);
+        if(parent != NULL) {
+            pthread_mutex_lock(&parent->lock);
+            if(id_table_merge(&parent->usage, &slot->usage) != 0) {
+                store_error(slot->path, "Could not allocate memory for usage table");
+                exit_now = true;
+                exit_status = 4;
+            }
+            pthread_mutex_unlock(&parent->lock);
+        }
+
+        // Streamed results are not output again unless a snapshot of the
+        // whole result is written
+        if(ndjson && snapshot_path == NULL)
+            id_table_free(&slot->usage);
+        slot = parent;
+        n = 1;
+    }
+}
+
+
+/* SYNOPSIS
+ *   Add the usage a worker has accumulated locally to the result for the
+ *   slot it has been working on, reset the local tables, and release the
+ *   work items of the slot that the worker finished
+ *
+ * ARGUMENT
+ *   struct worker *self : The worker to flush
+ *
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int flush_worker(struct worker *self) {
+    int status = 0;
+    struct tr_args *result;
+
+    if(self->slot == NULL)
+        return 0;
+
+    result = self->slot;
+    prefetch_names(&self->named, &self->usage);
+    pthread_mutex_lock(&result->lock);
+    if(id_table_merge(&result->usage, &self->usage) != 0) {
+        store_error(result->path, "Could not allocate memory for usage table");
+        exit_now = true;
+        exit_status = 4;
+        status = 1;
+    }
+    pthread_mutex_unlock(&result->lock);
+    id_table_clear(&self->usage);
+
+    if(self->done > 0) {
+        release_slot(result, self->done);
+        self->done = 0;
+    }
+    return status;
+}
+
+
+/* SYNOPSIS
+ *   Point a worker's local tables at a result slot, flushing the usage it
+ *   accumulated for the previous slot
+ * ARGUMENT
+ *   struct worker *self : The worker
+ *   struct tr_args *slot : The slot that following usage rolls up into
+ * RETURN
+ *   Void
+ */
+void switch_slot(struct worker *self, struct tr_args *slot) {
+    if(slot != self->slot) {
+        flush_worker(self);
+        self->slot = slot;
+    }
+}
+
+
+/* SYNOPSIS
+ *   Add the usage of a file to the worker's local tables, skipping inodes
+ *   with multiple links that the worker has already counted
+ * ARGUMENT
+ *   struct worker *self : The worker that encountered the file
+ *   struct id_table *table : The table to add the usage to
+ *   char* path : Path of the file, used in messages
+ *   struct stat *meta : Metadata of the file
+ * RETURN
+ *   0 if counted, 1 if the inode was already counted, -1 if memory could
+ *   not be allocated
+ */
+int tally(struct worker *self, struct id_table *table, char* path, struct stat *meta) {
+    long long unsigned int audit_size;
+    unsigned int id;
+    int status;
+
+    // Skip inodes that have been previously visited. An inode that could
+    // not be tracked fails the walk rather than being dropped silently.
+    if(meta->st_nlink > 1 && (status=insert_inode(meta->st_dev, meta->st_ino)) != 0) {
+        if(status < 0) {
+            store_error(path, "Could not allocate memory to track inodes");
+            exit_now = true;
+            exit_status = 4;
+            return -1;
+        }
+        if(trace)
+            printf("-inode   %s inode %lu has already been counted\n", path, meta->st_ino);
+        return 1;
+    }
+
+    // Compute size as either file size, or size of
+    // blocks the file spans
+    audit_size = meta->st_size;
+    if(size_in_blocks)
+        audit_size = meta->st_blocks*512;
+    metric_add(&self->metrics.entries, 1);
+    metric_add(&self->metrics.bytes, audit_size);
+
+    id = meta->st_gid;
+    if(summarize_by_user)
+        id = meta->st_uid;
+
+    // A file linked from subdirectories in different shards is counted
+    // by each of them, so shards keep their files with multiple links
+    // for --merge to count once
+    if(id_table_add(table, id, audit_size) != 0
+       || (accounting && acct_add(&self->acct, (long long unsigned int)meta->st_uid << 32 | meta->st_gid, meta->st_blocks*512, meta->st_size, 1) != 0)
+       || ((n_ages > 0 || size_histogram) && hist_add(&self->hist, id, meta, audit_size) != 0)
+       || (n_shards > 1 && snapshot_path != NULL && meta->st_nlink > 1 && !S_ISDIR(meta->st_mode) && link_add(&self->links, meta, id, audit_size, self->slot) != 0)) {
+        store_error(path, "Could not allocate memory for usage table");
+        exit_now = true;
+        exit_status = 4;
+        return -1;
+    }
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Decide whether a subdirectory of a target is left out of the walk.
+ *   The top level is queued without a stat, so the worker that opens a
+ *   subdirectory checks that it is on the device of the target and not
+ *   in the exclude list, and drops its result otherwise.
+ * ARGUMENT
+ *   struct work_item *item : The directory being walked
+ *   long long unsigned int devnum : Device of the directory
+ *   long long unsigned int inode : Inode of the directory
+ * RETURN
+ *   true if the directory is skipped
+ */
+bool skip_top(struct work_item *item, long long unsigned int devnum, long long unsigned int inode) {
+    if(item->depth != 1)
+        return false;
+    if(devnum != item->devnum) {
+        if(verbose)
+            printf("-skip     %s on another device\n", item->path);
+    }
+    else if(using_exclude && is_excluded(inode)) {
+        if(verbose)
+            printf("-skip      %s is in the exclude list\n", item->path);
+    }
+    else
+        return false;
+    item->slot->skipped = true;
+    return true;
+}
+
+
+/* SYNOPSIS
+ *   Stat a batch of entries of the top level of a target and count them
+ *   in the result of the target. Regular files and symbolic links are
+ *   counted, and directories that appeared since the target was read and
+ *   other types of files are skipped, as they are in the target itself.
+ * ARGUMENT
+ *   struct worker *self : The worker
+ *   struct work_item *item : The batch of entries
+ * RETURN
+ *   char* status: "OK" on success, and other strings on error
+ */
+static char* stat_names(struct worker *self, struct work_item *item) {
+    struct stat meta;
+    unsigned int i;
+    char* name = item->names;
+    char* path;
+    int status;
+
+    for(i=0;i<item->n_names && !exit_now;i++,name+=strlen(name)+1) {
+        if((path=child_path(self, item->path, name)) == NULL) {
+            store_error(item->path, "Could not allocate memory to build path");
+            return "NOMEM";
+        }
+        if(item->parent != NULL)
+            status = dug_stat(item->parent->fd, name, AT_SYMLINK_NOFOLLOW, stat_mask, &meta);
+        else
+            status = dug_stat(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, stat_mask, &meta);
+        if(status != 0) {
+            if(store_error(path, "entry: Could not stat file") != 0)
+                return "MAXERRORS";
+            continue;
+        }
+
+        if(using_exclude && is_excluded(meta.st_ino)) {
+            if(verbose)
+                printf("-skip      %s is in the exclude list\n", path);
+            continue;
+        }
+        switch(meta.st_mode & S_IFMT) {
+            case S_IFLNK:
+                if(verbose)
+                    printf("+symlink   %s (%ld)\n", path, meta.st_size);
+                break;
+            case S_IFREG:
+                if(verbose)
+                    printf("+file      %s (%ld)\n", path, meta.st_size);
+                break;
+            default:
+                if(verbose)
+                    printf("-skip     %s\n", path);
+                continue;
+        }
+        if(tally(self, &self->usage, path, &meta) < 0)
+            return "NOMEM";
+    }
+    return "OK";
+}
+
+
+/* SYNOPSIS
+ *   Compute a signature of the options that change how usage is counted,
+ *   so a cache written with different options is not used
+ * ARGUMENT
+ *   None
+ * RETURN
+ *   The signature
+ */
+uint32_t cache_options() {
+    uint64_t signature = (summarize_by_user ? 1 : 0) | (size_in_blocks ? 2 : 0);
+    uint64_t excluded = 0;
+    int i;
+
+    // Excluded inodes and names are combined independently of their order
+    for(i=0;i<MAXEXCLUDE;i++) {
+        if(exclude_inodes[i] != 0)
+            excluded += (exclude_inodes[i]+1) * 0x9e3779b97f4a7c15ull;
+    }
+    for(i=0;i<exclude_names.capacity;i++) {
+        if(exclude_names.literals[i] != NULL)
+            excluded += ((uint64_t)hash_name(exclude_names.literals[i])+1) * 0xc2b2ae3d27d4eb4full;
+    }
+    for(i=0;i<exclude_names.n_globs;i++)
+        excluded += ((uint64_t)hash_name(exclude_names.globs[i])+1) * 0x165667b19e3779f9ull;
+    signature ^= excluded;
+    return (uint32_t)(signature ^ (signature >> 32));
+}
+
+
+/* SYNOPSIS
+ *   Map the incremental cache written by a previous run. A missing or
+ *   unusable cache is not an error, every directory is read instead.
+ * ARGUMENT
+ *   char* path : The cache file
+ * RETURN
+ *   Void
+ */
+void cache_load(char* path) {
+    struct stat meta;
+    const struct cache_header *header;
+    char* reason = NULL;
+    void *map;
+    int fd;
+
+    cache_start = time(NULL);
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if(fd < 0) {
+        if(verbose)
+            printf("+dug       No cache read from %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if(fstat(fd, &meta) != 0 || meta.st_size < (off_t)sizeof(struct cache_header)) {
+        if(verbose)
+            printf("+dug       No cache read from %s: file is too short\n", path);
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, meta.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        if(verbose)
+            printf("+dug       No cache read from %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    header = map;
+    if(memcmp(header->magic, CACHEMAGIC, sizeof(header->magic)) != 0)
+        reason = "not a dug cache";
+    else if(header->version != CACHEVERSION)
+        reason = "written by a different version";
+    else if(header->options != cache_options())
+        reason = "written with different options";
+    else if(header->n_records > (meta.st_size-sizeof(struct cache_header)) / sizeof(struct cache_record) ||
+            header->n_pairs != (meta.st_size-sizeof(struct cache_header)-header->n_records*sizeof(struct cache_record)) / sizeof(struct cache_pair))
+        reason = "file is truncated";
+    if(reason != NULL) {
+        if(verbose)
+            printf("+dug       No cache read from %s: %s\n", path, reason);
+        munmap(map, meta.st_size);
+        return;
+    }
+
+    cache_in = header;
+    cache_in_len = meta.st_size;
+    if(verbose)
+        printf("+dug       Read %llu directories from cache %s\n", (long long unsigned int)header->n_records, path);
+}
+
+
+/* SYNOPSIS
+ *   Find a directory in the cache read at startup
+ * ARGUMENT
+ *   struct stat *meta : Metadata of the directory
+ * RETURN
+ *   The record of the directory if the directory has not changed since
+ *   it was cached, otherwise NULL
+ */
+const struct cache_record* cache_lookup(struct stat *meta) {
+    const struct cache_record *records, *record;
+    uint64_t low = 0, high, mid;
+
+    if(cache_in == NULL)
+        return NULL;
+
+    records = (const struct cache_record *)(cache_in+1);
+    high = cache_in->n_records;
+    while(low < high) {
+        mid = low + (high-low)/2;
+        record = &records[mid];
+        if(record->dev < (uint64_t)meta->st_dev || (record->dev == (uint64_t)meta->st_dev && record->ino < (uint64_t)meta->st_ino))
+            low = mid+1;
+        else
+            high = mid;
+    }
+    if(low == cache_in->n_records)
+        return NULL;
+
+    // Adding, removing or renaming an entry updates the times of the
+    // directory, so the entries are unchanged if the times match
+    record = &records[low];
+    if(record->dev != (uint64_t)meta->st_dev || record->ino != (uint64_t)meta->st_ino ||
+       record->mtime_sec != meta->st_mtim.tv_sec || record->mtime_nsec != meta->st_mtim.tv_nsec ||
+       record->ctime_sec != meta->st_ctim.tv_sec || record->ctime_nsec != meta->st_ctim.tv_nsec ||
+       record->first > cache_in->n_pairs || record->n_pairs > cache_in->n_pairs-record->first)
+        return NULL;
+    return record;
+}
+
+
+/* SYNOPSIS
+ *   Append a directory to a collection of cache records
+ * ARGUMENT
+ *   struct cache_store *store : The records to append to
+ *   struct stat *meta : Metadata of the directory
+ *   struct id_table *usage : Usage of the entries of the directory, or
+ *                            NULL to copy the usage from cached
+ *   const struct cache_record *cached : The record read at startup
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int cache_add(struct cache_store *store, struct stat *meta, struct id_table *usage, const struct cache_record *cached) {
+    const struct cache_pair *pairs;
+    struct cache_record *record;
+    struct id_entry *entry;
+    unsigned int pos = 0;
+    size_t n_pairs = usage != NULL ? id_table_size(usage) : cached->n_pairs;
+    size_t capacity;
+    void *grown;
+
+    if(store->n_records == store->records_cap) {
+        capacity = store->records_cap == 0 ? 256 : store->records_cap*2;
+        if((grown=realloc(store->records, capacity*sizeof(struct cache_record))) == NULL)
+            return 1;
+        store->records = grown;
+        store->records_cap = capacity;
+    }
+    if(store->n_pairs+n_pairs > store->pairs_cap) {
+        capacity = store->pairs_cap == 0 ? 1024 : store->pairs_cap*2;
+        while(capacity < store->n_pairs+n_pairs)
+            capacity *= 2;
+        if((grown=realloc(store->pairs, capacity*sizeof(struct cache_pair))) == NULL)
+            return 1;
+        store->pairs = grown;
+        store->pairs_cap = capacity;
+    }
+
+    record = &store->records[store->n_records++];
+    record->dev = meta->st_dev;
+    record->ino = meta->st_ino;
+    record->mtime_sec = meta->st_mtim.tv_sec;
+    record->mtime_nsec = meta->st_mtim.tv_nsec;
+    record->ctime_sec = meta->st_ctim.tv_sec;
+    record->ctime_nsec = meta->st_ctim.tv_nsec;
+    record->first = store->n_pairs;
+    record->n_pairs = n_pairs;
+    if(usage != NULL) {
+        while((entry=id_table_next(usage, &pos)) != NULL) {
+            store->pairs[store->n_pairs].id = entry->id;
+            store->pairs[store->n_pairs].size = entry->size;
+            store->n_pairs++;
+        }
+    }
+    else if(n_pairs > 0) {
+        pairs = (const struct cache_pair *)((const struct cache_record *)(cache_in+1) + cache_in->n_records);
+        memcpy(store->pairs+store->n_pairs, pairs+cached->first, n_pairs*sizeof(struct cache_pair));
+        store->n_pairs += n_pairs;
+    }
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Move the cache records collected by a worker to the records that are
+ *   written when the walk completes
+ * ARGUMENT
+ *   struct cache_store *store : The records of the worker
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int cache_collect(struct cache_store *store) {
+    size_t i;
+    void *grown;
+
+    if(store->n_records == 0)
+        return 0;
+    if((grown=realloc(cache_out.records, (cache_out.n_records+store->n_records)*sizeof(struct cache_record))) == NULL)
+        return 1;
+    cache_out.records = grown;
+    if((grown=realloc(cache_out.pairs, (cache_out.n_pairs+store->n_pairs)*sizeof(struct cache_pair))) == NULL)
+        return 1;
+    cache_out.pairs = grown;
+
+    for(i=0;i<store->n_records;i++) {
+        cache_out.records[cache_out.n_records] = store->records[i];
+        cache_out.records[cache_out.n_records].first += cache_out.n_pairs;
+        cache_out.n_records++;
+    }
+    if(store->n_pairs > 0)
+        memcpy(cache_out.pairs+cache_out.n_pairs, store->pairs, store->n_pairs*sizeof(struct cache_pair));
+    cache_out.n_pairs += store->n_pairs;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Free a collection of cache records
+ * ARGUMENT
+ *   struct cache_store *store : The records to free
+ * RETURN
+ *   Void
+ */
+void cache_free(struct cache_store *store) {
+    free(store->records);
+    free(store->pairs);
+    memset(store, 0, sizeof(struct cache_store));
+}
+
+
+/* SYNOPSIS
+ *   Order cache records by device and inode
+ * ARGUMENT
+ *   const void *a : The first record
+ *   const void *b : The second record
+ * RETURN
+ *   <0, 0 or >0 as the first record sorts before, with or after the second
+ */
+int compare_records(const void *a, const void *b) {
+    const struct cache_record *x = a, *y = b;
+    if(x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if(x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Write the directories read or reused by this run to the cache file.
+ *   The file is written under a temporary name and renamed over the old
+ *   cache, so an interrupted run leaves the old cache in place.
+ * ARGUMENT
+ *   char* path : The cache file
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int cache_save(char* path) {
+    struct cache_header header;
+    char* temppath = malloc(strlen(path)+32);
+    FILE *out;
+    bool failed;
+
+    if(temppath == NULL) {
+        store_error(path, "Could not allocate memory to write cache");
+        return 1;
+    }
+    sprintf(temppath, "%s.%d", path, (int)getpid());
+
+    if(cache_in != NULL) {
+        munmap((void *)cache_in, cache_in_len);
+        cache_in = NULL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHEMAGIC, sizeof(header.magic));
+    header.version = CACHEVERSION;
+    header.options = cache_options();
+    header.n_records = cache_out.n_records;
+    header.n_pairs = cache_out.n_pairs;
+    qsort(cache_out.records, cache_out.n_records, sizeof(struct cache_record), compare_records);
+
+    out = fopen(temppath, "w");
+    if(out == NULL) {
+        store_error(temppath, strerror(errno));
+        free(temppath);
+        return 1;
+    }
+    failed = fwrite(&header, sizeof(header), 1, out) != 1;
+    failed = failed || fwrite(cache_out.records, sizeof(struct cache_record), cache_out.n_records, out) != cache_out.n_records;
+    failed = failed || fwrite(cache_out.pairs, sizeof(struct cache_pair), cache_out.n_pairs, out) != cache_out.n_pairs;
+    failed = (fclose(out) != 0) || failed;
+    if(failed || rename(temppath, path) != 0) {
+        store_error(path, strerror(errno));
+        unlink(temppath);
+        free(temppath);
+        return 1;
+    }
+
+    if(verbose)
+        printf("+dug       Wrote %llu directories to cache %s\n", (long long unsigned int)cache_out.n_records, path);
+    free(temppath);
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Start counting the entries of a directory. If the directory has not
+ *   changed since it was cached, its entries that are not directories are
+ *   taken from the cache and need not be stat'ed. Otherwise the entries
+ *   are counted separately so they can be stored in the cache.
+ * ARGUMENT
+ *   struct worker *self : The worker reading the directory
+ *   struct dir_scan *scan : State of the directory
+ *   char* path : Path of the directory, used in messages
+ *   struct stat *meta : Metadata of the directory
+ * RETURN
+ *   Void
+ */
+void scan_begin(struct worker *self, struct dir_scan *scan, char* path, struct stat *meta) {
+    metric_path(&self->metrics, path);
+    scan->cached = NULL;
+    scan->store = false;
+    scan->table = &self->usage;
+    if(cache_path == NULL)
+        return;
+
+    scan->meta = *meta;
+    scan->cached = cache_lookup(meta);
+    if(scan->cached != NULL) {
+        if(verbose)
+            printf("+cached    %s\n", path);
+        return;
+    }
+
+    // Directories changed within the last second may change again
+    // without their times changing, so they are not cached
+    scan->store = meta->st_mtim.tv_sec < cache_start && meta->st_ctim.tv_sec < cache_start;
+    id_table_init(&scan->usage);
+    scan->table = &scan->usage;
+}
+
+
+/* SYNOPSIS
+ *   Count an entry of a directory that is not a directory
+ * ARGUMENT
+ *   struct worker *self : The worker that encountered the entry
+ *   struct dir_scan *scan : State of the directory
+ *   char* path : Path of the entry, used in messages
+ *   struct stat *meta : Metadata of the entry
+ * RETURN
+ *   As tally
+ */
+int scan_tally(struct worker *self, struct dir_scan *scan, char* path, struct stat *meta) {
+    // Links may be counted under another directory, so directories
+    // holding them are always read
+    if(meta->st_nlink > 1)
+        scan->store = false;
+    return tally(self, scan->table, path, meta);
+}
+
+
+/* SYNOPSIS
+ *   Finish counting the entries of a directory, adding them to the usage
+ *   of the worker and recording the directory for the cache
+ * ARGUMENT
+ *   struct worker *self : The worker reading the directory
+ *   struct dir_scan *scan : State of the directory
+ *   char* path : Path of the directory, used in messages
+ *   bool complete : Whether all entries of the directory were counted
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int scan_end(struct worker *self, struct dir_scan *scan, char* path, bool complete) {
+    const struct cache_pair *pairs;
+    uint64_t i;
+    int status = 0;
+
+    if(scan->cached != NULL) {
+        pairs = (const struct cache_pair *)((const struct cache_record *)(cache_in+1) + cache_in->n_records);
+        for(i=0;i<scan->cached->n_pairs && status == 0;i++)
+            status = id_table_add(&self->usage, pairs[scan->cached->first+i].id, pairs[scan->cached->first+i].size);
+        if(status == 0 && complete)
+            status = cache_add(&self->cache, &scan->meta, NULL, scan->cached);
+    }
+    else if(scan->table == &scan->usage) {
+        status = id_table_merge(&self->usage, &scan->usage);
+        if(status == 0 && complete && scan->store)
+            status = cache_add(&self->cache, &scan->meta, &scan->usage, NULL);
+        id_table_free(&scan->usage);
+    }
+    scan->cached = NULL;
+    scan->table = &self->usage;
+
+    if(status != 0) {
+        store_error(path, "Could not allocate memory for cache");
+        exit_now = true;
+        exit_status = 4;
+    }
+    return status;
+}
+
+
+/* SYNOPSIS
+ *   Compiles a summary of file usage in a directory and all descendents,
+ *   organized by group (GID). Usage is accumulated in the worker's local
+ *   tables. When other workers are idle, subdirectories are queued as new
+ *   work items rather than walked here, so a large subtree is split among
+ *   workers at whatever depth it is encountered.
+ * ARGUMENT:
+ *  struct worker *self : The worker executing the walk
+ *  struct work_item *item : The directory to walk, and the result slot
+ *                           that its usage rolls up into
+ * RETURN
+ *   char* status: "OK" on success, and other strings on error
+ */
+static char* fts_walk(struct worker *self, struct work_item *item) {
+    FTS *stream;
+    FTSENT *entry;
+    struct stat entry_meta, *meta;
+    struct dir_scan *scan;
+    bool insert = false;
+    bool error = false;
+    int info, n;
+    char* status = "OK";
+
+    // FTS needs a null-terminated list of paths as argument
+    char *paths[2] = {item->path, NULL};
+
+    // FTS_PHSYCIAL: do not follow symbolic links
+    // FTS_XDEV    : do not descend into directories on devices
+    //               that differ from the starting directory
+    // FTS_NOCHDIR : do not chdir into each sub-directory. This
+    //               allows us use multiple fts threads from 
+    //               one process
+    // FTS_NOSTAT  : do not stat entries that readdir reports are not
+    //               directories, so we can stat them with statx
+    stream = fts_open(paths, FTS_PHYSICAL|FTS_XDEV|FTS_NOCHDIR|FTS_NOSTAT, NULL);
+    if(stream == NULL) {
+        store_error(paths[0], strerror(errno));
+        return "FTSOPENFAIL"; 
+    }
+
+    // Read from the FTS stream until it is empty
+    while((entry=fts_read(stream))) {
+        // FTS error, entry was null. We store the error and continue,
+        // but this increments number of errors and potentially sets
+        // exit_now=true if maximum errors is reached
+        if(entry == NULL) {
+            store_error("fts_error", strerror(errno));
+            continue;
+        }
+
+        // With FTS_NOSTAT fts keeps only the device, inode and link count
+        // of the directories it stat'ed, and fts_statp is not filled in, so
+        // directories walked here and the entries fts did not stat are
+        // stat'ed here with the fields the walk needs
+        info = entry->fts_info;
+        meta = &entry_meta;
+        if(info == FTS_D && entry->fts_level == 0 && skip_top(item, entry->fts_dev, entry->fts_ino))
+            break;
+        // fts has already stat'ed a directory it returns while reading its
+        // parent, so an excluded directory is only kept from being opened
+        if(using_exclude_names && entry->fts_level > 0 && info != FTS_DP && is_excluded_name(entry->fts_name)) {
+            if(verbose)
+                printf("-skip     The file %s matches an excluded name (skipping it an any descendants)\n", entry->fts_path);
+            if(info == FTS_D)
+                fts_set(stream, entry, FTS_SKIP);
+            continue;
+        }
+        if(info == FTS_D && using_exclude && is_excluded(entry->fts_ino)) {
+            if(verbose)
+                printf("-skip     The file %s is in the exclude list (skipping it an any descendants)\n", entry->fts_path);
+	    fts_set(stream, entry, FTS_SKIP);
+	    continue;
+        }
+
+        // Entries of directories that were taken from the cache are not
+        // stat'ed. With FTS_NOSTAT, fts reports the subdirectories that
+        // the link count of the parent accounts for as FTS_D, so on
+        // filesystems with correct link counts the rest are not
+        // directories.
+        scan = entry->fts_level > 0 ? entry->fts_parent->fts_pointer : NULL;
+        if(scan != NULL && scan->cached != NULL && (info == FTS_NSOK || info == FTS_F || info == FTS_SL || info == FTS_SLNONE || info == FTS_DEFAULT))
+            continue;
+
+        // Give the subtree to an idle worker instead of walking it here.
+        // The worker that receives it stats and counts the directory, so
+        // it is only stat'ed here if it is walked here, and the device fts
+        // kept decides. Directories that are reported are always walked
+        // as separate items so they roll up into their own result.
+        if(info == FTS_D && entry->fts_level > 0 && entry->fts_dev == item->devnum && (item->depth+entry->fts_level <= max_depth || should_donate(self))) {
+            if(trace)
+                printf("+donate    %s\n", entry->fts_path);
+            if(queue_work(self, entry->fts_path, NULL, item->slot, item->depth+entry->fts_level, item->devnum) == 0) {
+                fts_set(stream, entry, FTS_SKIP);
+                continue;
+            }
+        }
+
+        if(info == FTS_D || info == FTS_NSOK) {
+            if(dug_stat(AT_FDCWD, entry->fts_accpath, AT_SYMLINK_NOFOLLOW, info == FTS_D ? dir_stat_mask : stat_mask, meta) != 0) {
+                info = FTS_NS;
+                entry->fts_errno = errno;
+            }
+        }
+        if(info == FTS_NSOK) {
+            if(using_exclude && is_excluded(meta->st_ino)) {
+                if(verbose)
+                    printf("-skip     The file %s is in the exclude list (skipping it an any descendants)\n", entry->fts_path);
+                continue;
+            }
+            switch(meta->st_mode & S_IFMT) {
+                case S_IFREG:
+                    info = FTS_F;
+                    break;
+                case S_IFLNK:
+                    info = FTS_SL;
+                    break;
+                case S_IFDIR:
+                    // fts does not descend into directories it did not
+                    // stat, which happens when the link count of the
+                    // parent is wrong. Queue them so they are walked.
+                    info = FTS_DEFAULT;
+                    if(meta->st_dev == item->devnum && queue_work(self, entry->fts_path, NULL, item->slot, item->depth+entry->fts_level, item->devnum) == 0)
+                        continue;
+                    break;
+                default:
+                    info = FTS_DEFAULT;
+            }
+        }
+
+        // If maximum errors were encountered, or other unrecoverable
+        // errors occured, this indicates to terminate execution
+        if(exit_now) {
+            status = "TASKEXIT";
+            break;
+        }
+
+        // Process the file or directory
+        insert = false;
+        error = false;
+        switch(info) {
+            // Regular file
+            case FTS_F:
+                if(verbose)
+                    printf("+file      %s (%ld)\n", entry->fts_path, meta->st_size);
+		insert = true;
+                break;
+            // Directory
+            case FTS_D:
+                if(verbose)
+                    printf("+directory %s (%ld)\n", entry->fts_path, meta->st_size);
+                metric_path(&self->metrics, entry->fts_path);
+
+                // fts reads the directory when it is next called
+                throttle_op();
+                insert = true;
+                break;
+            // Symbolic link
+            case FTS_SL:
+                if(verbose)
+                    printf("+symlnk    %s (%ld)\n", entry->fts_path, meta->st_size);
+                insert = true;
+                break;
+            // Broken symlink
+            case FTS_SLNONE:
+                if(verbose)
+                    printf("+brksymlnk %s (%ld)\n", entry->fts_path, meta->st_size);
+                insert = true;
+                break;
+            // Uncategorized file
+            case FTS_DEFAULT:
+                if(verbose)
+                    printf("+uncat     %s (%ld)\n", entry->fts_path, meta->st_size);
+                insert = true;
+                break;
+            // A directory we could not descend into
+            case FTS_DNR:
+                error = true;
+                break;
+            // A directory we already traversed in pre-order
+            case FTS_DP:
+                // We already saw this directory in preorder FTS_D,
+                // so ignore it
+                break;
+            // A file we could not stat
+            case FTS_NS:
+                if(verbose)
                     printf("-stat_err  %s %s\n", entry->fts_path, strerror(errno));
                 error = true;
                 break;
-            // Unclassified error
-            case FTS_ERR:
-                if(verbose)
-                    printf("-fts_err   %s\n", entry->fts_path);
-                error = true;
+            // Unclassified error
+            case FTS_ERR:
+                if(verbose)
+                    printf("-fts_err   %s\n", entry->fts_path);
+                error = true;
+                break;
+            // Nothing else matched, so log it as skipped in verbose mode
+            default: 
+                if(verbose)
+                    printf("-fts_skip  %s\n", entry->fts_path);
+        }
+
+        // Store error, and exit if maximum errors reached 
+        if(error) {
+            if(scan != NULL)
+                scan->store = false;
+            if(store_error(entry->fts_path, strerror(entry->fts_errno)) != 0) {
+                status = "MAXERRORS";
+                break;
+            }
+        }
+
+        // Finish counting the entries of a directory
+        if((info == FTS_DP || info == FTS_DNR) && entry->fts_pointer != NULL) {
+            n = scan_end(self, entry->fts_pointer, entry->fts_path, info == FTS_DP);
+            free(entry->fts_pointer);
+            entry->fts_pointer = NULL;
+            if(n != 0) {
+                status = "NOMEM";
+                break;
+            }
+        }
+
+        // Update the running usage in the hash table. Directories are
+        // always counted by the worker, while other entries are counted
+        // through the directory that holds them.
+        if(insert) {
+            if(info == FTS_D || scan == NULL)
+                n = tally(self, &self->usage, entry->fts_path, meta);
+            else
+                n = scan_tally(self, scan, entry->fts_path, meta);
+            if(n < 0) {
+                status = "NOMEM";
+                break;
+            }
+        }
+
+        // Start counting the entries of a directory that is walked here
+        if(insert && info == FTS_D && n == 0 && cache_path != NULL && meta->st_dev == item->devnum) {
+            if((entry->fts_pointer=malloc(sizeof(struct dir_scan))) == NULL) {
+                store_error(entry->fts_path, "Could not allocate memory for cache");
+                status = "NOMEM";
+                break;
+            }
+            scan_begin(self, entry->fts_pointer, entry->fts_path, meta);
+        }
+    }
+
+    // Directories that were not finished when the walk stopped early are
+    // the ancestors of the last entry
+    for(;entry != NULL && entry->fts_level >= FTS_ROOTLEVEL;entry=entry->fts_parent) {
+        if(entry->fts_pointer != NULL) {
+            scan_end(self, entry->fts_pointer, entry->fts_path, false);
+            free(entry->fts_pointer);
+            entry->fts_pointer = NULL;
+        }
+    }
+
+    fts_close(stream);
+    return status;
+}
+
+/* SYNOPSIS
+ *   Read a buffer of entries of an open directory, after waiting for the
+ *   rate limit
+ * ARGUMENT:
+ *  int fd : The directory
+ *  char* buf : Buffer of DIRENTBUF bytes
+ * RETURN
+ *   Bytes read, 0 at the end of the directory, or -1 on error
+ */
+long read_entries(int fd, char* buf) {
+    throttle_op();
+    return syscall(SYS_getdents64, fd, buf, DIRENTBUF);
+}
+
+/* SYNOPSIS
+ *   Compiles a summary of file usage in one directory using directory file
+ *   descriptors. Entries are read with large getdents64 calls and stat'ed
+ *   relative to the open directory, so no path is resolved by the kernel
+ *   and paths are not limited in length. Subdirectories are queued as new
+ *   work items that are opened relative to this directory, and the worker
+ *   that walks a directory counts the directory itself.
+ * ARGUMENT:
+ *  struct worker *self : The worker executing the walk
+ *  struct work_item *item : The directory to walk, and the result slot
+ *                           that its usage rolls up into
+ * RETURN
+ *   char* status: "OK" on success, and other strings on error
+ */
+static char* native_walk(struct worker *self, struct work_item *item) {
+    int fd, n, pos;
+    struct stat meta;
+    struct linux_dirent64 *entry;
+    struct dir_handle *handle;
+    struct dir_scan scan;
+    char* status = "OK";
+    char* path;
+
+    // Open the directory relative to its parent when possible
+    if(item->parent != NULL) {
+        fd = openat(item->parent->fd, item->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        release_handle(item->parent);
+        item->parent = NULL;
+    }
+    else
+        fd = open(item->path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(fd < 0 || dug_stat(fd, "", AT_EMPTY_PATH, dir_stat_mask, &meta) != 0) {
+        store_error(item->path, strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return "OPENFAIL";
+    }
+
+    if(skip_top(item, meta.st_dev, meta.st_ino)) {
+        close(fd);
+        return status;
+    }
+    if(using_exclude && is_excluded(meta.st_ino)) {
+        if(verbose)
+            printf("-skip     The file %s is in the exclude list (skipping it an any descendants)\n", item->path);
+        close(fd);
+        return status;
+    }
+
+    if(verbose)
+        printf("+directory %s (%ld)\n", item->path, meta.st_size);
+    if((n=tally(self, &self->usage, item->path, &meta)) != 0) {
+        close(fd);
+        return n < 0 ? "NOMEM" : status;
+    }
+
+    // Directories on other devices are counted, but not descended into
+    if(meta.st_dev != item->devnum) {
+        close(fd);
+        return status;
+    }
+
+    // Subdirectories hold a reference to this directory until they are
+    // opened. If too many directories are held open already, they are
+    // opened by full path instead (see share_handle).
+    handle = new_handle(fd);
+    scan_begin(self, &scan, item->path, &meta);
+
+    while(!exit_now && (n=read_entries(fd, self->dirbuf)) > 0) {
+        for(pos=0;pos<n;pos+=entry->d_reclen) {
+            entry = (struct linux_dirent64 *)(self->dirbuf+pos);
+            if(entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+                continue;
+
+            // Excluded names are skipped before they are stat'ed or opened
+            if(using_exclude_names && is_excluded_name(entry->d_name)) {
+                if(verbose)
+                    printf("-skip     The file %s/%s matches an excluded name (skipping it an any descendants)\n", item->path, entry->d_name);
+                continue;
+            }
+
+            if((path=child_path(self, item->path, entry->d_name)) == NULL) {
+                store_error(item->path, "Could not allocate memory to build path");
+                status = "NOMEM";
+                break;
+            }
+
+            // Directories are counted by the worker that walks them, so
+            // they are queued without a stat when the type is known
+            if(entry->d_type == DT_DIR) {
+                if(queue_work(self, path, share_handle(handle), item->slot, item->depth+1, item->devnum) != 0) {
+                    status = "NOMEM";
+                    break;
+                }
+                continue;
+            }
+
+            // Entries of directories that were taken from the cache are
+            // only stat'ed when the type is unknown
+            if(scan.cached != NULL && entry->d_type != DT_UNKNOWN)
+                continue;
+
+            if(dug_stat(fd, entry->d_name, AT_SYMLINK_NOFOLLOW, stat_mask, &meta) != 0) {
+                scan.store = false;
+                if(verbose)
+                    printf("-stat_err  %s %s\n", path, strerror(errno));
+                if(store_error(path, strerror(errno)) != 0) {
+                    status = "MAXERRORS";
+                    break;
+                }
+                continue;
+            }
+
+            if((meta.st_mode & S_IFMT) == S_IFDIR) {
+                if(queue_work(self, path, share_handle(handle), item->slot, item->depth+1, item->devnum) != 0) {
+                    status = "NOMEM";
+                    break;
+                }
+                continue;
+            }
+            if(scan.cached != NULL)
+                continue;
+
+            if(using_exclude && is_excluded(meta.st_ino)) {
+                if(verbose)
+                    printf("-skip     The file %s is in the exclude list (skipping it an any descendants)\n", path);
+                continue;
+            }
+
+            if(verbose) {
+                switch(meta.st_mode & S_IFMT) {
+                    case S_IFREG:
+                        printf("+file      %s (%ld)\n", path, meta.st_size);
+                        break;
+                    case S_IFLNK:
+                        printf("+symlnk    %s (%ld)\n", path, meta.st_size);
+                        break;
+                    default:
+                        printf("+uncat     %s (%ld)\n", path, meta.st_size);
+                }
+            }
+
+            if(scan_tally(self, &scan, path, &meta) < 0) {
+                status = "NOMEM";
+                break;
+            }
+        }
+        if(strcmp(status, "OK") != 0)
+            break;
+    }
+    if(n < 0) {
+        store_error(item->path, strerror(errno));
+        status = "READDIRFAIL";
+    }
+    if(scan_end(self, &scan, item->path, n == 0 && strcmp(status, "OK") == 0) != 0)
+        status = "NOMEM";
+
+    if(handle != NULL)
+        release_handle(handle);
+    else
+        close(fd);
+    return status;
+}
+
+/* SYNOPSIS
+ *   Set up an io_uring and map its rings. The kernel must support statx
+ *   and openat operations on the ring.
+ * ARGUMENT
+ *   struct uring *ring : The ring to set up
+ * RETURN
+ *   0 on success, an errno value on failure
+ */
+int uring_init(struct uring *ring) {
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    int i, status = 0;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if(ring->fd < 0)
+        return errno;
+
+    // Probe for the operations we use, which appeared in Linux 5.6
+    probe = calloc(1, sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op));
+    if(probe == NULL)
+        status = ENOMEM;
+    else if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        status = errno;
+    else if(probe->last_op < IORING_OP_STATX || !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) || !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED))
+        status = EOPNOTSUPP;
+    free(probe);
+    if(status != 0) {
+        close(ring->fd);
+        return status;
+    }
+
+    ring->sq_ring_len = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+    ring->cq_ring_len = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_ring_len > ring->sq_ring_len)
+            ring->sq_ring_len = ring->cq_ring_len;
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) {
+        status = errno;
+        close(ring->fd);
+        return status;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED) {
+            status = errno;
+            munmap(ring->sq_ring, ring->sq_ring_len);
+            close(ring->fd);
+            return status;
+        }
+    }
+    ring->sqes_len = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        status = errno;
+        if(ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_len);
+        munmap(ring->sq_ring, ring->sq_ring_len);
+        close(ring->fd);
+        return status;
+    }
+
+    ring->sq_head = (unsigned int *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+
+    ring->ops = malloc(ring->entries*sizeof(struct uring_op));
+    ring->free_ops = malloc(ring->entries*sizeof(unsigned int));
+    if(ring->ops == NULL || ring->free_ops == NULL) {
+        free(ring->ops);
+        free(ring->free_ops);
+        munmap(ring->sqes, ring->sqes_len);
+        if(ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_len);
+        munmap(ring->sq_ring, ring->sq_ring_len);
+        close(ring->fd);
+        return ENOMEM;
+    }
+    for(i=0;i<ring->entries;i++)
+        ring->free_ops[i] = i;
+    ring->n_free = ring->entries;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Unmap and close an io_uring
+ * ARGUMENT
+ *   struct uring *ring : The ring to free
+ * RETURN
+ *   Void
+ */
+void uring_free(struct uring *ring) {
+    free(ring->ops);
+    free(ring->free_ops);
+    munmap(ring->sqes, ring->sqes_len);
+    if(ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    munmap(ring->sq_ring, ring->sq_ring_len);
+    close(ring->fd);
+}
+
+
+/* SYNOPSIS
+ *   Publish the queued submissions to the kernel and optionally wait for
+ *   a completion
+ * ARGUMENT
+ *   struct uring *ring : The ring
+ *   bool wait : Wait until at least one completion is available
+ * RETURN
+ *   0 on success, -1 on error
+ */
+int uring_submit(struct uring *ring, bool wait) {
+    unsigned int to_submit;
+    int status;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    ring->queued = 0;
+    to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if(to_submit == 0 && !wait)
+        return 0;
+    do {
+        status = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while(status < 0 && errno == EINTR);
+    return status < 0 ? -1 : 0;
+}
+
+
+/* SYNOPSIS
+ *   Handle the completion of an operation on a worker's ring
+ * ARGUMENT
+ *   struct worker *self : The worker that owns the ring
+ *   struct uring_op *op : The completed operation
+ *   int res : The result of the operation
+ * RETURN
+ *   Void
+ */
+void uring_complete(struct worker *self, struct uring_op *op, int res) {
+    struct uring_dir *dir = op->dir;
+    struct work_item *item = dir->item;
+    struct stat meta;
+    char* path;
+
+    count_stat(&self->metrics, op->start);
+    switch(op->kind) {
+        // Opening the directory. Subdirectories are opened relative to
+        // their parent, which can be released once the open completes
+        case URING_OPEN:
+            if(item->parent != NULL) {
+                release_handle(item->parent);
+                item->parent = NULL;
+            }
+            dir->status = res < 0 ? res : 0;
+            if(res >= 0 && (dir->handle=new_handle(res)) == NULL) {
+                close(res);
+                dir->status = -ENOMEM;
+            }
+            break;
+        // Stat of the directory itself
+        case URING_SELF:
+            dir->status = res;
+            if(res == 0)
+                statx_to_stat(&op->stx, &dir->meta);
+            break;
+        // Stat of an entry in the directory
+        case URING_ENTRY:
+            if((path=child_path(self, item->path, op->name)) == NULL) {
+                store_error(item->path, "Could not allocate memory to build path");
+                break;
+            }
+            if(res < 0) {
+                dir->scan.store = false;
+                if(verbose)
+                    printf("-stat_err  %s %s\n", path, strerror(-res));
+                store_error(path, strerror(-res));
+                break;
+            }
+            statx_to_stat(&op->stx, &meta);
+            if((meta.st_mode & S_IFMT) == S_IFDIR) {
+                queue_work(self, path, share_handle(dir->handle), item->slot, item->depth+1, item->devnum);
+                break;
+            }
+            if(dir->scan.cached != NULL)
+                break;
+            if(using_exclude && is_excluded(meta.st_ino)) {
+                if(verbose)
+                    printf("-skip     The file %s is in the exclude list (skipping it an any descendants)\n", path);
+                break;
+            }
+            if(verbose) {
+                switch(meta.st_mode & S_IFMT) {
+                    case S_IFREG:
+                        printf("+file      %s (%ld)\n", path, meta.st_size);
+                        break;
+                    case S_IFLNK:
+                        printf("+symlnk    %s (%ld)\n", path, meta.st_size);
+                        break;
+                    default:
+                        printf("+uncat     %s (%ld)\n", path, meta.st_size);
+                }
+            }
+            switch_slot(self, item->slot);
+            scan_tally(self, &dir->scan, path, &meta);
+            break;
+    }
+}
+
+
+/* SYNOPSIS
+ *   Submit queued operations and handle the completions that are available
+ * ARGUMENT
+ *   struct worker *self : The worker that owns the ring
+ *   bool wait : Wait until at least one completion is available
+ * RETURN
+ *   0 on success, 1 if the ring failed
+ */
+int uring_reap(struct worker *self, bool wait) {
+    struct uring *ring = self->ring;
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail, index;
+    int res;
+
+    if(uring_submit(ring, wait) != 0) {
+        store_error("io_uring", strerror(errno));
+        return 1;
+    }
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while(head != tail) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        index = cqe->user_data;
+        res = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        uring_complete(self, &ring->ops[index], res);
+        ring->free_ops[ring->n_free++] = index;
+    }
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Wait until all operations on a worker's ring have completed
+ * ARGUMENT
+ *   struct worker *self : The worker that owns the ring
+ * RETURN
+ *   0 on success, 1 if the ring failed
+ */
+int uring_drain(struct worker *self) {
+    while(self->ring->n_free < self->ring->entries) {
+        if(uring_reap(self, true) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Take a free operation slot and a submission entry for it, handling
+ *   completions until a slot is available
+ * ARGUMENT
+ *   struct worker *self : The worker that owns the ring
+ *   int kind : The kind of operation
+ *   struct uring_dir *dir : The directory the operation belongs to
+ * RETURN
+ *   The submission entry to fill in, or NULL if the ring failed
+ */
+struct io_uring_sqe* uring_prep(struct worker *self, int kind, struct uring_dir *dir) {
+    struct uring *ring = self->ring;
+    struct io_uring_sqe *sqe;
+    unsigned int index, op;
+
+    // Under a rate limit each stat waits for its turn with nothing left
+    // queued, so the latencies that drive the backoff are those of the
+    // filesystem rather than of the wait
+    if(throttling && kind != URING_OPEN) {
+        if(uring_drain(self) != 0)
+            return NULL;
+        throttle_op();
+    }
+
+    while(ring->n_free == 0) {
+        if(uring_reap(self, true) != 0)
+            return NULL;
+    }
+    op = ring->free_ops[--ring->n_free];
+    ring->ops[op].kind = kind;
+    ring->ops[op].dir = dir;
+    ring->ops[op].start = time_stats && kind != URING_OPEN ? now_ns() : 0;
+
+    index = (*ring->sq_tail + ring->queued) & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = op;
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+
+/* SYNOPSIS
+ *   Queue a statx operation on a worker's ring
+ * ARGUMENT
+ *   struct io_uring_sqe *sqe : Submission entry from uring_prep()
+ *   int dirfd : Directory the name is relative to
+ *   char* name : Name to stat, which must stay valid until completion
+ *   int flags : AT_* flags
+ *   struct statx *stx : Address where the result is stored
+ * RETURN
+ *   Void
+ */
+void uring_prep_statx(struct io_uring_sqe *sqe, int dirfd, char* name, int flags, unsigned int mask, struct statx *stx) {
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (unsigned long)name;
+    sqe->len = mask;
+    sqe->off = (unsigned long)stx;
+    sqe->statx_flags = flags | (dont_sync ? AT_STATX_DONT_SYNC : 0);
+}
+
+
+/* SYNOPSIS
+ *   Compiles a summary of file usage in a batch of directories using
+ *   io_uring, to keep many metadata operations in flight from one thread
+ *   on filesystems where each operation has high latency. The worker takes
+ *   up to URING_DIRS directories from its deque, opens and stats them
+ *   through the ring, then reads each directory with getdents64 and
+ *   submits a statx for every entry. Subdirectories are queued as new
+ *   work items, as in the native engine.
+ * ARGUMENT:
+ *  struct worker *self : The worker executing the walk
+ *  struct work_item *first : The first directory of the batch. Any other
+ *                            directories are taken from the worker's
+ *                            deque and completed here.
+ * RETURN
+ *   char* status: "OK" on success, and other strings on error
+ */
+static char* uring_walk(struct worker *self, struct work_item *first) {
+    struct uring_dir batch[URING_DIRS];
+    struct uring_op *op;
+    struct io_uring_sqe *sqe;
+    struct linux_dirent64 *entry;
+    struct work_item *item;
+    int i, n_dirs = 0, n = 0, pos;
+    char* path;
+    bool failed = false;
+
+    // Batches of entries of the top level of a target are stat'ed as they
+    // are taken, so they do not hold up the directories
+    batch[n_dirs++].item = first;
+    while(n_dirs < URING_DIRS && (item=deque_pop(&self->deque)) != NULL) {
+        if(item->names == NULL) {
+            batch[n_dirs++].item = item;
+            continue;
+        }
+        switch_slot(self, item->slot);
+        stat_names(self, item);
+        self->done++;
+        free_work_item(item);
+        release_work();
+    }
+
+    // Open the directories, relative to their parents when possible
+    for(i=0;i<n_dirs && !failed;i++) {
+        batch[i].handle = NULL;
+        batch[i].status = -EBADF;
+        batch[i].scan.cached = NULL;
+        batch[i].scan.table = NULL;
+        if((sqe=uring_prep(self, URING_OPEN, &batch[i])) == NULL) {
+            failed = true;
+            break;
+        }
+        sqe->opcode = IORING_OP_OPENAT;
+        item = batch[i].item;
+        sqe->fd = item->parent != NULL ? item->parent->fd : AT_FDCWD;
+        sqe->addr = (unsigned long)(item->parent != NULL ? item->name : item->path);
+        sqe->open_flags = O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC;
+    }
+    for(;i<n_dirs;i++) {
+        batch[i].handle = NULL;
+        batch[i].status = -EBADF;
+        batch[i].scan.cached = NULL;
+        batch[i].scan.table = NULL;
+    }
+    failed = failed || uring_drain(self) != 0;
+
+    // Stat the opened directories
+    for(i=0;i<n_dirs && !failed;i++) {
+        if(batch[i].status != 0)
+            continue;
+        if((sqe=uring_prep(self, URING_SELF, &batch[i])) == NULL) {
+            failed = true;
+            break;
+        }
+        op = &self->ring->ops[sqe->user_data];
+        uring_prep_statx(sqe, batch[i].handle->fd, "", AT_EMPTY_PATH, dir_stat_mask, &op->stx);
+    }
+    failed = failed || uring_drain(self) != 0;
+
+    // Count the directories, and decide which ones to read
+    for(i=0;i<n_dirs && !failed;i++) {
+        item = batch[i].item;
+        if(batch[i].status != 0) {
+            store_error(item->path, strerror(-batch[i].status));
+            continue;
+        }
+        batch[i].status = -1;
+        if(skip_top(item, batch[i].meta.st_dev, batch[i].meta.st_ino))
+            continue;
+        if(using_exclude && is_excluded(batch[i].meta.st_ino)) {
+            if(verbose)
+                printf("-skip     The file %s is in the exclude list (skipping it an any descendants)\n", item->path);
+            continue;
+        }
+        if(verbose)
+            printf("+directory %s (%ld)\n", item->path, batch[i].meta.st_size);
+        switch_slot(self, item->slot);
+        if(tally(self, &self->usage, item->path, &batch[i].meta) != 0)
+            continue;
+
+        // Directories on other devices are counted, but not descended into
+        if(batch[i].meta.st_dev != item->devnum)
+            continue;
+        batch[i].status = 0;
+        scan_begin(self, &batch[i].scan, item->path, &batch[i].meta);
+    }
+
+    // Read the directories and submit a stat for each entry. Names are
+    // copied into the operation, so the buffer can be reused while the
+    // stats are in flight.
+    for(i=0;i<n_dirs && !failed;i++) {
+        if(batch[i].status != 0)
+            continue;
+        item = batch[i].item;
+        while(!exit_now && !failed && (n=read_entries(batch[i].handle->fd, self->dirbuf)) > 0) {
+            for(pos=0;pos<n;pos+=entry->d_reclen) {
+                entry = (struct linux_dirent64 *)(self->dirbuf+pos);
+                if(entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+                    continue;
+
+                // Excluded names are skipped before they are stat'ed or opened
+                if(using_exclude_names && is_excluded_name(entry->d_name)) {
+                    if(verbose)
+                        printf("-skip     The file %s/%s matches an excluded name (skipping it an any descendants)\n", item->path, entry->d_name);
+                    continue;
+                }
+
+                if(entry->d_type == DT_DIR) {
+                    if((path=child_path(self, item->path, entry->d_name)) == NULL || queue_work(self, path, share_handle(batch[i].handle), item->slot, item->depth+1, item->devnum) != 0) {
+                        failed = true;
+                        break;
+                    }
+                    continue;
+                }
+
+                // Entries of directories that were taken from the cache
+                // are only stat'ed when the type is unknown
+                if(batch[i].scan.cached != NULL && entry->d_type != DT_UNKNOWN)
+                    continue;
+
+                if((sqe=uring_prep(self, URING_ENTRY, &batch[i])) == NULL) {
+                    failed = true;
+                    break;
+                }
+                op = &self->ring->ops[sqe->user_data];
+                snprintf(op->name, sizeof(op->name), "%s", entry->d_name);
+                uring_prep_statx(sqe, batch[i].handle->fd, op->name, AT_SYMLINK_NOFOLLOW, stat_mask, &op->stx);
+            }
+        }
+        if(n < 0)
+            store_error(item->path, strerror(errno));
+
+        // Directories that were not read to the end are not cached
+        if(n != 0)
+            batch[i].status = 1;
+    }
+    if(uring_drain(self) != 0)
+        failed = true;
+
+    // Finish counting the entries of the directories that were read
+    for(i=0;i<n_dirs;i++) {
+        if(batch[i].status != 0 && batch[i].status != 1)
+            continue;
+        switch_slot(self, batch[i].item->slot);
+        scan_end(self, &batch[i].scan, batch[i].item->path, batch[i].status == 0 && !failed);
+    }
+
+    // Release the directories, and complete the work items taken from
+    // the deque. The first item is completed by the caller.
+    for(i=0;i<n_dirs;i++) {
+        if(batch[i].handle != NULL)
+            release_handle(batch[i].handle);
+        if(i > 0) {
+            switch_slot(self, batch[i].item->slot);
+            self->done++;
+            free_work_item(batch[i].item);
+            release_work();
+        }
+    }
+
+    if(failed) {
+        exit_now = true;
+        exit_status = 1;
+        return "URINGFAIL";
+    }
+    return "OK";
+}
+
+/* SYNOPSIS
+ *   Wait until work may be available. The deques are checked again while
+ *   holding the lock, after announcing the wait, so work queued at the
+ *   same time either is found here or wakes the worker.
+ * ARGUMENT
+ *   None
+ * RETURN
+ *   Void
+ */
+void park_worker() {
+    unsigned int i, n = __atomic_load_n(&n_workers, __ATOMIC_ACQUIRE);
+    bool found = false;
+
+    pthread_mutex_lock(&park_lock);
+    __atomic_add_fetch(&n_parked, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(i=0;i<n && !found;i++)
+        found = deque_size(&workers[i].deque) > 0;
+    if(!found && !exit_now && __atomic_load_n(&pending_work, __ATOMIC_ACQUIRE) != 0)
+        pthread_cond_wait(&park_cond, &park_lock);
+    __atomic_sub_fetch(&n_parked, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&park_lock);
+}
+
+/* SYNOPSIS
+ *   Wait while the tuner has set the number of active workers at or
+ *   below the index of a worker, until it is raised again or the walk is
+ *   complete. Work left in the deque of the worker is stolen by the
+ *   others.
+ * ARGUMENT
+ *   struct worker *self : The worker
+ * RETURN
+ *   Void
+ */
+void bench_worker(struct worker *self) {
+    flush_worker(self);
+    pthread_mutex_lock(&park_lock);
+    while(!exit_now && self->id >= __atomic_load_n(&active_workers, __ATOMIC_RELAXED) && __atomic_load_n(&pending_work, __ATOMIC_ACQUIRE) != 0)
+        pthread_cond_wait(&bench_cond, &park_lock);
+    pthread_mutex_unlock(&park_lock);
+}
+
+/* SYNOPSIS
+ *   Main loop of a worker thread. The worker takes work from its own deque
+ *   and steals from other workers when its deque is empty. It exits when
+ *   no work is queued or in progress anywhere.
+ * ARGUMENT
+ *   void *arg : The worker
+ * RETURN
+ *   Always NULL
+ */
+static void* worker_main(void *arg) {
+    struct worker *self = arg;
+    struct work_item *item;
+    bool idle = false;
+
+    thread_metrics = &self->metrics;
+    thread_arena = &self->arena;
+    while(!exit_now) {
+        if(self->id >= __atomic_load_n(&active_workers, __ATOMIC_RELAXED)) {
+            if(idle) {
+                idle = false;
+                __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_RELAXED);
+            }
+            bench_worker(self);
+            if(__atomic_load_n(&pending_work, __ATOMIC_ACQUIRE) == 0)
+                break;
+            continue;
+        }
+        item = deque_pop(&self->deque);
+        if(item == NULL)
+            item = steal_work(self);
+
+        // No work available. Either the walk is finished, or other
+        // workers are busy and may share work with us soon
+        if(item == NULL) {
+            if(__atomic_load_n(&pending_work, __ATOMIC_ACQUIRE) == 0)
                 break;
-            // Nothing else matched, so log it as skipped in verbose mode
-            default: 
-                if(verbose)
-                    printf("-fts_skip  %s\n", entry->fts_path);
+            if(!idle) {
+                idle = true;
+                __atomic_add_fetch(&idle_workers, 1, __ATOMIC_RELAXED);
+
+                // Results may be waiting for the items finished here
+                flush_worker(self);
+            }
+            park_worker();
+            continue;
+        }
+        if(idle) {
+            idle = false;
+            __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_RELAXED);
+        }
+
+        // Usage is accumulated per slot, so flush when switching slots
+        switch_slot(self, item->slot);
+
+        if(item->names != NULL)
+            stat_names(self, item);
+        else if(self->ring != NULL)
+            uring_walk(self, item);
+        else if(engine != ENGINE_FTS)
+            native_walk(self, item);
+        else
+            fts_walk(self, item);
+        switch_slot(self, item->slot);
+        self->done++;
+        free_work_item(item);
+        release_work();
+    }
+
+    // Work left queued when the walk is cut short is never released, so
+    // wake the other workers to see that the walk is over
+    if(exit_now)
+        wake_workers(true);
+    if(idle)
+        __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_RELAXED);
+    flush_worker(self);
+    return NULL;
+}
+
+/* SYNOPSIS
+ *   Free the state of a worker, including any work left in its deque
+ * ARGUMENT
+ *   struct worker *w : The worker
+ * RETURN
+ *   Void
+ */
+void free_worker(struct worker *w) {
+    deque_free(&w->deque);
+    if(w->ring != NULL) {
+        uring_free(w->ring);
+        free(w->ring);
+    }
+    free(w->dirbuf);
+    free(w->pathbuf);
+    id_table_free(&w->usage);
+    id_table_free(&w->named);
+    acct_free(&w->acct);
+    hist_free(&w->hist);
+    link_free(&w->links);
+    cache_free(&w->cache);
+    arena_free(&w->arena);
+}
+
+/* SYNOPSIS
+ *   Initialize the state of a worker. With the io_uring engine, a worker
+ *   whose ring cannot be set up uses the native engine instead.
+ * ARGUMENT
+ *   struct worker *w : The worker
+ *   unsigned int id : Index of the worker
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int init_worker(struct worker *w, unsigned int id) {
+    int status;
+
+    w->id = id;
+    w->slot = NULL;
+    w->done = 0;
+    id_table_init(&w->usage);
+    id_table_init(&w->named);
+    memset(&w->acct, 0, sizeof(struct acct_table));
+    memset(&w->hist, 0, sizeof(struct hist_table));
+    id_table_init(&w->hist.index);
+    memset(&w->links, 0, sizeof(struct link_table));
+    memset(&w->metrics, 0, sizeof(struct metrics));
+    memset(&w->cache, 0, sizeof(struct cache_store));
+    w->arena.head = NULL;
+    w->pathbuf = NULL;
+    w->pathbuf_len = 0;
+    w->dirbuf = NULL;
+    w->ring = NULL;
+    if(deque_init(&w->deque) != 0)
+        return 1;
+
+    if(engine == ENGINE_FTS)
+        return 0;
+
+    if(engine == ENGINE_URING && (w->ring=malloc(sizeof(struct uring))) != NULL) {
+        if((status=uring_init(w->ring)) != 0) {
+            if(verbose)
+                printf("+dug       io_uring is not available (%s), worker %u uses the native engine\n", strerror(status), id);
+            free(w->ring);
+            w->ring = NULL;
+        }
+    }
+    if((w->dirbuf=malloc(DIRENTBUF)) == NULL) {
+        free_worker(w);
+        return 1;
+    }
+    return 0;
+}
+
+/* SYNOPSIS
+ *   Add up the counters of the launching thread and the workers
+ * ARGUMENT
+ *   struct metrics *total : Where the totals are stored. The path is not
+ *                           set.
+ * RETURN
+ *   Void
+ */
+void sum_metrics(struct metrics *total) {
+    struct metrics *m;
+    unsigned int i, j, n;
+
+    memset(total, 0, sizeof(struct metrics));
+    n = __atomic_load_n(&n_workers, __ATOMIC_ACQUIRE);
+    for(i=0;i<=n;i++) {
+        m = i < n ? &workers[i].metrics : &walk_metrics;
+        total->entries += __atomic_load_n(&m->entries, __ATOMIC_RELAXED);
+        total->bytes += __atomic_load_n(&m->bytes, __ATOMIC_RELAXED);
+        total->dirs += __atomic_load_n(&m->dirs, __ATOMIC_RELAXED);
+        total->errors += __atomic_load_n(&m->errors, __ATOMIC_RELAXED);
+        for(j=0;j<LATENCY_BUCKETS;j++)
+            total->latency[j] += __atomic_load_n(&m->latency[j], __ATOMIC_RELAXED);
+    }
+}
+
+/* SYNOPSIS
+ *   Find a percentile of the stat latencies in a histogram
+ * ARGUMENT
+ *   struct metrics *m : The counters
+ *   double fraction : The percentile as a fraction, 1 for the maximum
+ *   long long unsigned int *count : Where the number of stats is stored
+ * RETURN
+ *   Smallest latency of the bucket holding the percentile, in nanoseconds
+ */
+long long unsigned int latency_percentile(struct metrics *m, double fraction, long long unsigned int *count) {
+    long long unsigned int seen = 0, rank;
+    unsigned int i;
+
+    *count = 0;
+    for(i=0;i<LATENCY_BUCKETS;i++)
+        *count += m->latency[i];
+    rank = (long long unsigned int)(fraction * *count);
+    if(rank == 0)
+        rank = 1;
+    for(i=0;i<LATENCY_BUCKETS;i++) {
+        seen += m->latency[i];
+        if(seen >= rank && m->latency[i] > 0)
+            return bucket_latency(i);
+    }
+    return 0;
+}
+
+/* SYNOPSIS
+ *   Print the progress of the walk and the rates since the last report
+ *   to stderr
+ * ARGUMENT
+ *   struct metrics *last : Totals at the last report, updated
+ * RETURN
+ *   Void
+ */
+void print_progress(struct metrics *last) {
+    struct metrics total;
+    long long unsigned int count, p50, p99, interval;
+    char size[32];
+
+    sum_metrics(&total);
+    p50 = latency_percentile(&total, 0.5, &count);
+    p99 = latency_percentile(&total, 0.99, &count);
+    format_size(total.bytes, size);
+    fprintf(stderr, "+progress  %llus: %u/%u subdirectories, %llu directories (%llu/s), %llu entries (%llu/s), %s, %llu errors, stat p50 %lluus p99 %lluus",
+            (now_ns() - walk_start)/1000000000ull,
+            __atomic_load_n(&n_top_done, __ATOMIC_RELAXED), __atomic_load_n(&n_top, __ATOMIC_RELAXED),
+            total.dirs, (total.dirs - last->dirs)/progress_interval,
+            total.entries, (total.entries - last->entries)/progress_interval,
+            size, total.errors, p50/1000, p99/1000);
+    interval = __atomic_load_n(&throttle.interval, __ATOMIC_RELAXED);
+    if(throttling && interval > 0)
+        fprintf(stderr, ", limit %llu/s", 1000000000ull / interval);
+    fprintf(stderr, "\n");
+    *last = total;
+}
+
+/* SYNOPSIS
+ *   Append the counters of one thread to a JSON object
+ * ARGUMENT
+ *   struct out_buffer *out : The buffer
+ *   struct metrics *m : The counters
+ * RETURN
+ *   Void
+ */
+void out_metrics(struct out_buffer *out, struct metrics *m) {
+    out_str(out, "\"entries\":");
+    out_u64(out, __atomic_load_n(&m->entries, __ATOMIC_RELAXED));
+    out_str(out, ",\"bytes\":");
+    out_u64(out, __atomic_load_n(&m->bytes, __ATOMIC_RELAXED));
+    out_str(out, ",\"directories\":");
+    out_u64(out, __atomic_load_n(&m->dirs, __ATOMIC_RELAXED));
+    out_str(out, ",\"errors\":");
+    out_u64(out, __atomic_load_n(&m->errors, __ATOMIC_RELAXED));
+}
+
+/* SYNOPSIS
+ *   Write a JSON snapshot of all counters and the directory each worker
+ *   is on to the metrics file, or stderr. The metrics file is also
+ *   written when the walk finishes.
+ * ARGUMENT
+ *   None
+ * RETURN
+ *   0 on success, 1 if the snapshot could not be written
+ */
+int dump_metrics() {
+    struct out_buffer out = {0};
+    struct metrics total;
+    struct rusage usage;
+    struct iovec iov;
+    char path[MAXPATHLEN];
+    long long unsigned int count, interval;
+    unsigned int i, j, n, seq, tries;
+    int fd = STDERR_FILENO, status;
+
+    sum_metrics(&total);
+    out_str(&out, "{\"elapsed_ms\":");
+    out_u64(&out, (now_ns() - walk_start)/1000000);
+    out_str(&out, ",\"subdirectories\":");
+    out_u64(&out, __atomic_load_n(&n_top, __ATOMIC_RELAXED));
+    out_str(&out, ",\"subdirectories_done\":");
+    out_u64(&out, __atomic_load_n(&n_top_done, __ATOMIC_RELAXED));
+    out_str(&out, ",");
+    out_metrics(&out, &total);
+    out_str(&out, ",\"inode_waits\":");
+    out_u64(&out, __atomic_load_n(&inode_contention, __ATOMIC_RELAXED));
+    if(auto_threads) {
+        out_str(&out, ",\"workers_active\":");
+        out_u64(&out, __atomic_load_n(&active_workers, __ATOMIC_RELAXED));
+    }
+    if(throttling) {
+        interval = __atomic_load_n(&throttle.interval, __ATOMIC_RELAXED);
+        out_str(&out, ",\"rate_limit\":");
+        out_u64(&out, interval > 0 ? 1000000000ull / interval : 0);
+        out_str(&out, ",\"throttle_waits\":");
+        out_u64(&out, __atomic_load_n(&throttle.waits, __ATOMIC_RELAXED));
+        out_str(&out, ",\"backoffs\":");
+        out_u64(&out, __atomic_load_n(&throttle.backoffs, __ATOMIC_RELAXED));
+    }
+    if(getrusage(RUSAGE_SELF, &usage) == 0) {
+        out_str(&out, ",\"max_rss_kb\":");
+        out_u64(&out, usage.ru_maxrss);
+    }
+
+    // Latency percentiles, and the buckets as pairs of their smallest
+    // latency and count
+    out_str(&out, ",\"stat_latency_ns\":{\"p50\":");
+    out_u64(&out, latency_percentile(&total, 0.5, &count));
+    out_str(&out, ",\"p90\":");
+    out_u64(&out, latency_percentile(&total, 0.9, &count));
+    out_str(&out, ",\"p99\":");
+    out_u64(&out, latency_percentile(&total, 0.99, &count));
+    out_str(&out, ",\"max\":");
+    out_u64(&out, latency_percentile(&total, 1, &count));
+    out_str(&out, ",\"count\":");
+    out_u64(&out, count);
+    out_str(&out, ",\"buckets\":[");
+    for(i=0,j=0;i<LATENCY_BUCKETS;i++) {
+        if(total.latency[i] == 0)
+            continue;
+        out_str(&out, j++ > 0 ? ",[" : "[");
+        out_u64(&out, bucket_latency(i));
+        out_mem(&out, ",", 1);
+        out_u64(&out, total.latency[i]);
+        out_mem(&out, "]", 1);
+    }
+    out_str(&out, "]},\"workers\":[");
+
+    // Copy each path again if the worker changed it while it was copied
+    n = __atomic_load_n(&n_workers, __ATOMIC_ACQUIRE);
+    for(i=0;i<n;i++) {
+        for(tries=0;tries<8;tries++) {
+            seq = __atomic_load_n(&workers[i].metrics.seq, __ATOMIC_ACQUIRE);
+            memcpy(path, workers[i].metrics.path, MAXPATHLEN);
+            path[MAXPATHLEN-1] = '\0';
+            if(seq % 2 == 0 && __atomic_load_n(&workers[i].metrics.seq, __ATOMIC_ACQUIRE) == seq)
+                break;
+        }
+        out_str(&out, i > 0 ? ",{\"id\":" : "{\"id\":");
+        out_u64(&out, i);
+        out_mem(&out, ",", 1);
+        out_metrics(&out, &workers[i].metrics);
+        out_str(&out, ",\"path\":");
+        out_json_str(&out, path);
+        out_mem(&out, "}", 1);
+    }
+    out_str(&out, "]}\n");
+
+    if(metrics_path != NULL && (fd=open(metrics_path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "Could not open metrics file %s: %s\n", metrics_path, strerror(errno));
+        out_free(&out);
+        return 1;
+    }
+    iov.iov_base = out.data;
+    iov.iov_len = out.length;
+    status = out.failed || write_all(fd, &iov, 1) != 0;
+    if(fd != STDERR_FILENO)
+        close(fd);
+    out_free(&out);
+    return status;
+}
+
+/* SYNOPSIS
+ *   Thread that waits for SIGUSR1, which is blocked in all other threads,
+ *   and prints progress when the interval passes without one
+ * ARGUMENT
+ *   void *arg : Unused
+ * RETURN
+ *   NULL
+ */
+static void* reporter_main(void *arg) {
+    struct metrics last;
+    struct timespec interval = {progress_interval, 0};
+    sigset_t set;
+    int sig;
+
+    memset(&last, 0, sizeof(struct metrics));
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while(!__atomic_load_n(&reporter_stop, __ATOMIC_ACQUIRE)) {
+        if(progress_interval > 0)
+            sig = sigtimedwait(&set, NULL, &interval);
+        else
+            sig = sigwaitinfo(&set, NULL);
+        if(__atomic_load_n(&reporter_stop, __ATOMIC_ACQUIRE))
+            break;
+        if(sig == SIGUSR1)
+            dump_metrics();
+        else if(sig < 0 && errno == EAGAIN)
+            print_progress(&last);
+    }
+    return NULL;
+}
+
+/* SYNOPSIS
+ *   Launch the reporter thread once the workers are running
+ * ARGUMENT
+ *   None
+ * RETURN
+ *   Void
+ */
+void start_reporter() {
+    reporter_stop = false;
+    reporter_started = pthread_create(&reporter, NULL, &reporter_main, NULL) == 0;
+}
+
+/* SYNOPSIS
+ *   Stop the reporter thread before the workers are freed
+ * ARGUMENT
+ *   None
+ * RETURN
+ *   Void
+ */
+void stop_reporter() {
+    if(!reporter_started)
+        return;
+    __atomic_store_n(&reporter_stop, true, __ATOMIC_RELEASE);
+    pthread_kill(reporter, SIGUSR1);
+    pthread_join(reporter, NULL);
+    reporter_started = false;
+}
+
+/* SYNOPSIS
+ *   Find the number of workers that -t auto starts with: the online CPUs
+ *   the process may run on, lowered to the CPU quota of its cgroup
+ * ARGUMENT
+ *   None
+ * RETURN
+ *   The number of workers
+ */
+unsigned int auto_thread_count() {
+    cpu_set_t set;
+    long long int quota = -1, period = 0;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    FILE *in;
+
+    if(sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) < n)
+        n = CPU_COUNT(&set);
+
+    // cgroup v2 holds the quota and period in one file, and v1 in two
+    if((in=fopen("/sys/fs/cgroup/cpu.max", "r")) != NULL) {
+        if(fscanf(in, "%lld %lld", &quota, &period) != 2)
+            quota = -1;
+        fclose(in);
+    }
+    else if((in=fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL) {
+        if(fscanf(in, "%lld", &quota) != 1)
+            quota = -1;
+        fclose(in);
+        if((in=fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL) {
+            if(fscanf(in, "%lld", &period) != 1)
+                period = 0;
+            fclose(in);
+        }
+    }
+    if(quota > 0 && period > 0 && (quota+period-1)/period < n)
+        n = (quota+period-1)/period;
+
+    if(n < 1)
+        n = 1;
+    return n > MAXTHREADS ? MAXTHREADS : n;
+}
+
+/* SYNOPSIS
+ *   Launch workers until there are the argument number of them. Called by
+ *   the tuner thread, which is the only thread that adds workers.
+ * ARGUMENT
+ *   unsigned int target : The number of workers
+ * RETURN
+ *   The number of workers that are running
+ */
+unsigned int add_workers(unsigned int target) {
+    unsigned int i;
+
+    for(i=n_workers;i<target;i++) {
+        if(init_worker(&workers[i], i) != 0)
+            break;
+        if(pthread_create(&workers[i].thread, NULL, &worker_main, &workers[i]) != 0) {
+            free_worker(&workers[i]);
+            break;
+        }
+        __atomic_store_n(&n_workers, i+1, __ATOMIC_RELEASE);
+    }
+    return i;
+}
+
+/* SYNOPSIS
+ *   Decide the number of active workers for the next window by climbing
+ *   toward the highest rate of stats. Workers are added or removed a
+ *   quarter at a time while the rate improves by more than 5%, and the
+ *   direction is reversed when it drops by more than 5% after a change.
+ *   A drop while the number is held comes from the tree, and is ignored.
+ *   When the rate is flat, workers are removed if the mean latency rose
+ *   by more than 20%, as more workers only queue up at the filesystem,
+ *   and otherwise the number is held for TUNEHOLDS windows before probing
+ *   upward again.
+ * ARGUMENT
+ *   long long unsigned int rate : Stats per second in the window
+ *   long long unsigned int latency : Mean stat latency in the window
+ *   long long unsigned int last_rate : Stats per second in the window
+ *                                      before, or 0 for the first window
+ *   long long unsigned int last_latency : Mean latency in the window before
+ *   int *direction : Direction of the last change, updated
+ *   unsigned int *holds : Windows the number was held, updated
+ * RETURN
+ *   The number of active workers
+ */
+unsigned int tune_workers(long long unsigned int rate, long long unsigned int latency, long long unsigned int last_rate, long long unsigned int last_latency, int *direction, unsigned int *holds) {
+    unsigned int active = __atomic_load_n(&active_workers, __ATOMIC_RELAXED);
+    unsigned int step = active/4 > 0 ? active/4 : 1;
+    long long int target;
+
+    if(last_rate == 0)
+        *direction = 1;
+    else if(rate*20 > last_rate*21) {
+        if(*direction == 0)
+            *direction = 1;
+    }
+    else if(rate*20 < last_rate*19)
+        *direction = -*direction;
+    else if(latency*5 > last_latency*6)
+        *direction = -1;
+    else if(++*holds > TUNEHOLDS)
+        *direction = 1;
+    else
+        *direction = 0;
+    if(*direction != 0)
+        *holds = 0;
+
+    target = (long long int)active + *direction*(long long int)step;
+    if(target < 1)
+        target = 1;
+    if(target > MAXTHREADS)
+        target = MAXTHREADS;
+    if(target > n_workers)
+        target = add_workers(target);
+    return target;
+}
+
+/* SYNOPSIS
+ *   Thread that tunes the number of active workers with -t auto. After
+ *   each window it measures the stats the workers completed and their
+ *   mean latency, records them, and sets the workers for the next window.
+ *   It exits once the walk is complete.
+ * ARGUMENT
+ *   void *arg : Unused
+ * RETURN
+ *   NULL
+ */
+static void* tuner_main(void *arg) {
+    struct timespec deadline;
+    struct tune_step *grown;
+    long long unsigned int start = now_ns(), now, ops, ns, rate, latency, last_rate = 0, last_latency = 0;
+    unsigned int active, target, holds = 0;
+    int direction = 1;
+
+    while(true) {
+        // Work that completes the walk wakes the threads on bench_cond
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += TUNEWINDOW/1000000000ull;
+        pthread_mutex_lock(&park_lock);
+        if(!exit_now && __atomic_load_n(&pending_work, __ATOMIC_ACQUIRE) != 0)
+            pthread_cond_timedwait(&bench_cond, &park_lock, &deadline);
+        pthread_mutex_unlock(&park_lock);
+        if(exit_now || __atomic_load_n(&pending_work, __ATOMIC_ACQUIRE) == 0)
+            break;
+        now = now_ns();
+        if(now - start < TUNEWINDOW)
+            continue;
+
+        ops = __atomic_exchange_n(&tune_ops, 0, __ATOMIC_RELAXED);
+        ns = __atomic_exchange_n(&tune_ns, 0, __ATOMIC_RELAXED);
+        rate = ops*1000000000ull / (now - start);
+        latency = ops > 0 ? ns/ops : 0;
+        start = now;
+        active = __atomic_load_n(&active_workers, __ATOMIC_RELAXED);
+
+        // Nothing was stat'ed, so the workers are waiting on something
+        // other than the filesystem
+        target = ops > 0 ? tune_workers(rate, latency, last_rate, last_latency, &direction, &holds) : active;
+        if(ops > 0) {
+            last_rate = rate;
+            last_latency = latency;
+        }
+        if(verbose)
+            printf("+tune      %llums: %u workers, %llu stats/s, stat latency %lluns, next %u workers\n", (now - walk_start)/1000000, active, rate, latency, target);
+
+        if(n_tune_steps == tune_capacity) {
+            grown = realloc(tune_steps, (tune_capacity == 0 ? 64 : tune_capacity*2)*sizeof(struct tune_step));
+            if(grown != NULL) {
+                tune_steps = grown;
+                tune_capacity = tune_capacity == 0 ? 64 : tune_capacity*2;
+            }
+        }
+        if(n_tune_steps < tune_capacity) {
+            tune_steps[n_tune_steps].elapsed_ms = (now - walk_start)/1000000;
+            tune_steps[n_tune_steps].workers = active;
+            tune_steps[n_tune_steps].stats_per_sec = rate;
+            tune_steps[n_tune_steps].latency_ns = latency;
+            n_tune_steps++;
+        }
+
+        if(target != active) {
+            pthread_mutex_lock(&park_lock);
+            __atomic_store_n(&active_workers, target, __ATOMIC_RELAXED);
+            pthread_cond_broadcast(&bench_cond);
+            pthread_mutex_unlock(&park_lock);
+        }
+    }
+    return NULL;
+}
+
+/* SYNOPSIS
+ *   Allocate and launch the worker threads
+ * ARGUMENT
+ *   unsigned int max_n_threads : Number of workers to launch
+ * RETURN
+ *   0 on success, 1 on error
+ */
+int start_workers(unsigned int max_n_threads) {
+    int i, status;
+    struct rlimit limit;
+
+    // With -t auto, room is left for the workers the tuner adds
+    workers = malloc((auto_threads ? MAXTHREADS : max_n_threads)*sizeof(struct worker));
+    if(workers == NULL) {
+        store_error("workers", "Could not allocate memory for worker threads");
+        return 1;
+    }
+
+    // The native and io_uring engines hold directories open while their
+    // subdirectories are queued, so raise the descriptor limit and use
+    // half of it
+    if(engine != ENGINE_FTS && getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        if(limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+            getrlimit(RLIMIT_NOFILE, &limit);
+        }
+        max_handles = limit.rlim_cur/2 > INT_MAX ? INT_MAX : limit.rlim_cur/2;
+    }
+
+    for(i=0;i<max_n_threads;i++) {
+        if(init_worker(&workers[i], i) != 0) {
+            store_error("workers", "Could not allocate memory for worker threads");
+            while(--i >= 0)
+                free_worker(&workers[i]);
+            free(workers);
+            workers = NULL;
+            return 1;
+        }
+    }
+
+    // The launching thread holds one pending unit until it has finished
+    // queueing the top level, so workers do not exit before work arrives
+    pending_work = 1;
+    n_workers = max_n_threads;
+    active_workers = initial_workers = max_n_threads;
+    for(i=0;i<n_workers;i++) {
+        if((status=pthread_create(&workers[i].thread, NULL, &worker_main, &workers[i])) != 0) {
+            printf("tr   :Error in pthread_create(): %s\n", strerror(status));
+            exit_now = true;
+            exit_status = 1;
+            while(--i >= 0)
+                pthread_join(workers[i].thread, NULL);
+            for(i=0;i<n_workers;i++)
+                free_worker(&workers[i]);
+            free(workers);
+            workers = NULL;
+            n_workers = 0;
+            return 1;
+        }
+    }
+    start_reporter();
+    if(auto_threads)
+        tuner_started = pthread_create(&tuner, NULL, &tuner_main, NULL) == 0;
+    return 0;
+}
+
+/* SYNOPSIS
+ *   Release the pending unit held by the launching thread, wait for all
+ *   workers to finish, and free worker state
+ * ARGUMENT
+ *   None
+ * RETURN
+ *   0 if all joins are successful, number of joins that failed otherwise
+ */
+int finish_workers() {
+    int i, status, n=0;
+
+    release_work();
+    if(exit_now)
+        wake_workers(true);
+
+    // The tuner exits once the walk is complete, after which no workers
+    // are added
+    if(tuner_started) {
+        pthread_join(tuner, NULL);
+        tuner_started = false;
+        if(verbose)
+            printf("+dug       Tuned from %u to %u workers\n", initial_workers, active_workers);
+    }
+    for(i=0;i<n_workers;i++) {
+        status = pthread_join(workers[i].thread, NULL);
+        if(status != 0)
+            printf("tr   :Error in pthread_join(): %s\n", strerror(status));
+        n += status != 0;
+    }
+    stop_reporter();
+
+    // Leave the final counters in the metrics file
+    if(metrics_path != NULL)
+        dump_metrics();
+
+    // Collect the cache records, accounting and results of the workers
+    for(i=0;i<n_workers;i++) {
+        arena_merge(&result_arena, &workers[i].arena);
+        if(cache_path != NULL && cache_collect(&workers[i].cache) != 0) {
+            store_error(cache_path, "Could not allocate memory to write cache");
+            exit_status = 4;
+            cache_path = NULL;
+        }
+        if(accounting && acct_merge(&walk_acct, &workers[i].acct) != 0) {
+            store_error("accounting", "Could not allocate memory for accounting table");
+            exit_now = true;
+            exit_status = 4;
+        }
+        if(hist_merge(&walk_hist, &workers[i].hist) != 0) {
+            store_error("histograms", "Could not allocate memory for histograms");
+            exit_now = true;
+            exit_status = 4;
+        }
+        if(link_merge(&walk_links, &workers[i].links) != 0) {
+            store_error(snapshot_path, "Could not allocate memory for files with multiple links");
+            exit_now = true;
+            exit_status = 4;
+        }
+        free_worker(&workers[i]);
+    }
+    free(workers);
+    workers = NULL;
+    n_workers = 0;
+    return n;
+}
+
+/* SYNOPSIS
+ *   Compare paths with the separator sorting before all other characters,
+ *   so "a/b" sorts between "a" and "a-b" and every directory sorts
+ *   directly before its descendants
+ * ARGUMENT
+ *   const char* a : The first path
+ *   const char* b : The second path
+ * RETURN
+ *   <0, 0 or >0 as the first path sorts before, with or after the second
+ */
+int compare_paths(const char* a, const char* b) {
+    const unsigned char *p = (const unsigned char *)a, *q = (const unsigned char *)b;
+
+    while(*p != '\0' && *p == *q) {
+        p++;
+        q++;
+    }
+    return (*p == '/' ? 1 : *p) - (*q == '/' ? 1 : *q);
+}
+
+
+/* SYNOPSIS
+ *   Order results by target, so each subdirectory of a target is followed
+ *   by the directories below it, with every directory before its
+ *   descendants
+ * ARGUMENT
+ *   const void *a : Address of the first result
+ *   const void *b : Address of the second result
+ * RETURN
+ *   <0, 0 or >0 as the first result sorts before, with or after the second
+ */
+int compare_nodes(const void *a, const void *b) {
+    struct tr_args *x = *(struct tr_args **)a, *y = *(struct tr_args **)b;
+
+    if(x->root != y->root)
+        return x->root < y->root ? -1 : 1;
+    if(x->rank != y->rank)
+        return x->rank < y->rank ? -1 : 1;
+    return compare_paths(x->path, y->path);
+}
+
+
+/* SYNOPSIS
+ *   Free the results of the directories below the subdirectories of the
+ *   target, then the arena that holds all results
+ * ARGUMENT
+ *   None
+ * RETURN
+ *   Void
+ */
+void free_tree() {
+    unsigned int i;
+
+    for(i=0;i<n_tree_nodes;i++)
+        free_result(&tree_nodes[i]);
+    free(tree_nodes);
+    tree_nodes = NULL;
+    n_tree_nodes = 0;
+    tree_capacity = 0;
+    arena_free(&result_arena);
+}
+
+
+/* SYNOPSIS
+ *   Order results by path, using compare_paths
+ * ARGUMENT
+ *   const void *a : Address of the first result
+ *   const void *b : Address of the second result
+ * RETURN
+ *   <0, 0 or >0 as the first result sorts before, with or after the second
+ */
+int compare_results(const void *a, const void *b) {
+    return compare_paths((*(struct tr_args **)a)->path, (*(struct tr_args **)b)->path);
+}
+
+
+/* SYNOPSIS
+ *   Order usage entries by ID
+ * ARGUMENT
+ *   const void *a : The first entry
+ *   const void *b : The second entry
+ * RETURN
+ *   <0, 0 or >0 as the first entry sorts before, with or after the second
+ */
+int compare_ids(const void *a, const void *b) {
+    const struct id_entry *x = a, *y = b;
+    return x->id < y->id ? -1 : (x->id > y->id);
+}
+
+
+/* SYNOPSIS
+ *   Write one column of the usage pairs of a snapshot, with the pairs of
+ *   each result sorted by ID and the summary last
+ * ARGUMENT
+ *   FILE *out : The snapshot file
+ *   struct tr_args **order : The results in the order they are written
+ *   int n_dirs : Number of results
+ *   struct tr_args *summary : The summary
+ *   struct id_entry *pairs : Scratch space for the largest result
+ *   bool sizes : Write the size column rather than the ID column
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int write_snapshot_column(FILE *out, struct tr_args **order, int n_dirs, struct tr_args *summary, struct id_entry *pairs, bool sizes) {
+    struct tr_args *result;
+    uint32_t id;
+    uint64_t size;
+    int i, j, n;
+
+    for(i=0;i<=n_dirs;i++) {
+        result = i < n_dirs ? order[i] : summary;
+        n = result->n_pairs;
+        for(j=0;j<n;j++) {
+            pairs[j].id = result->pairs[2*j];
+            pairs[j].size = result->pairs[2*j+1];
+        }
+        qsort(pairs, n, sizeof(struct id_entry), compare_ids);
+        for(j=0;j<n;j++) {
+            id = pairs[j].id;
+            size = pairs[j].size;
+            if((!sizes && fwrite(&id, sizeof(id), 1, out) != 1) || (sizes && fwrite(&size, sizeof(size), 1, out) != 1))
+                return 1;
         }
+    }
+    return 0;
+}
 
-        // Store error, and exit if maximum errors reached 
-        if(error) {
-            if(store_error(entry->fts_path, strerror(entry->fts_errno)) != 0) {
-                return "MAXERRORS";
+
+/* SYNOPSIS
+ *   Write the result as a snapshot that --diff can compare with another
+ *   snapshot. Paths are stored relative to the target, sorted with
+ *   compare_paths and front coded against the previous path. IDs and
+ *   sizes are stored as separate columns that can be mapped directly.
+ * ARGUMENT
+ *   char* file : The snapshot file
+ *   struct tr_args **results : The results, with the summary last
+ *   int n_results : Number of results
+ *   long long unsigned int total : The total use across all files
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int write_snapshot(char* file, struct tr_args **results, int n_results, long long unsigned int total) {
+    struct snapshot_header header;
+    struct snapshot_dir *dirs;
+    struct snapshot_link *links;
+    struct tr_args **order, **found, *summary = results[n_results-1];
+    struct id_entry *pairs;
+    char *root = results[0]->path, *path, *previous = "";
+    size_t root_len = strlen(root), k;
+    uint64_t zero = 0, n_pairs = 0, n_links = 0;
+    int i, j, n, n_dirs = 0, max_pairs = summary->n_pairs;
+    bool failed;
+    FILE *out;
+
+    // Results are written in path order, so two snapshots can be
+    // compared by reading each once from start to end
+    order = malloc(n_results*sizeof(struct tr_args*));
+    dirs = malloc(n_results*sizeof(struct snapshot_dir));
+    links = malloc((walk_links.n_entries+1)*sizeof(struct snapshot_link));
+    if(order == NULL || dirs == NULL || links == NULL) {
+        printf("Could not allocate memory to write snapshot %s\n", file);
+        free(order);
+        free(dirs);
+        free(links);
+        return 1;
+    }
+    for(i=0;i<n_results-1;i++) {
+        if(results[i] == NULL)
+            continue;
+        order[n_dirs++] = results[i];
+        n = results[i]->n_pairs;
+        max_pairs = n > max_pairs ? n : max_pairs;
+    }
+    qsort(order+1, n_dirs-1, sizeof(struct tr_args*), compare_results);
+
+    // Each file with multiple links refers to the directory whose result
+    // it was counted in. Files of other targets are left out.
+    for(k=0;k<walk_links.n_entries;k++) {
+        found = walk_links.entries[k].slot == order[0] ? order : bsearch(&walk_links.entries[k].slot, order+1, n_dirs-1, sizeof(struct tr_args*), compare_results);
+        if(found == NULL || *found != walk_links.entries[k].slot)
+            continue;
+        links[n_links].dev = walk_links.entries[k].dev;
+        links[n_links].num = walk_links.entries[k].num;
+        links[n_links].size = walk_links.entries[k].size;
+        links[n_links].id = walk_links.entries[k].id;
+        links[n_links].dir = found - order;
+        n_links++;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPMAGIC, sizeof(header.magic));
+    header.version = SNAPVERSION;
+    header.flags = (summarize_by_user ? SNAP_BY_USER : 0) | (size_in_blocks ? SNAP_BLOCKS : 0);
+    header.created = time(NULL);
+    header.total = total;
+    header.n_dirs = n_dirs;
+    header.n_links = n_links;
+    header.root_len = root_len;
+    header.shard = shard;
+    header.n_shards = n_shards;
+
+    // Store each path as the length it shares with the previous path,
+    // and the rest of the path. The target path is stored first.
+    header.strings_len = root_len;
+    for(i=0;i<n_dirs;i++) {
+        path = order[i]->path + root_len;
+        for(j=0;path[j] != '\0' && path[j] == previous[j];j++)
+            ;
+        dirs[i].first = n_pairs;
+        dirs[i].n_pairs = order[i]->n_pairs;
+        dirs[i].depth = order[i]->depth;
+        dirs[i].shared = j;
+        dirs[i].length = strlen(path+j);
+        dirs[i].name = header.strings_len;
+        header.strings_len += dirs[i].length;
+        n_pairs += dirs[i].n_pairs;
+        previous = path;
+    }
+    header.n_summary = summary->n_pairs;
+    header.n_pairs = n_pairs + header.n_summary;
+
+    pairs = malloc((max_pairs+1)*sizeof(struct id_entry));
+    out = fopen(file, "w");
+    failed = pairs == NULL || out == NULL;
+    failed = failed || fwrite(&header, sizeof(header), 1, out) != 1;
+    failed = failed || fwrite(dirs, sizeof(struct snapshot_dir), n_dirs, out) != n_dirs;
+    failed = failed || write_snapshot_column(out, order, n_dirs, summary, pairs, false) != 0;
+    failed = failed || (header.n_pairs % 2 == 1 && fwrite(&zero, sizeof(uint32_t), 1, out) != 1);
+    failed = failed || write_snapshot_column(out, order, n_dirs, summary, pairs, true) != 0;
+    failed = failed || fwrite(links, sizeof(struct snapshot_link), n_links, out) != n_links;
+    failed = failed || fwrite(root, 1, root_len, out) != root_len;
+    for(i=0;i<n_dirs && !failed;i++)
+        failed = fwrite(order[i]->path+root_len+dirs[i].shared, 1, dirs[i].length, out) != dirs[i].length;
+    if(out != NULL && fclose(out) != 0)
+        failed = true;
+
+    if(failed) {
+        printf("Could not write snapshot %s: %s\n", file, strerror(errno));
+        exit_status = 1;
+    }
+    else if(verbose)
+        printf("+dug       Wrote %d directories to snapshot %s\n", n_dirs, file);
+    free(order);
+    free(dirs);
+    free(links);
+    free(pairs);
+    return failed ? 1 : 0;
+}
+
+
+/* SYNOPSIS
+ *   Map a snapshot and check that its layout is consistent
+ * ARGUMENT
+ *   char* file : The snapshot file
+ *   struct snapshot *snap : Where the mapped snapshot is stored
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int open_snapshot(char* file, struct snapshot *snap) {
+    struct stat meta;
+    const struct snapshot_header *header;
+    uint64_t i, name = 0, path_len = 0, ids_len, expected;
+    char* reason = NULL;
+    int fd;
+
+    fd = open(file, O_RDONLY|O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &meta) != 0) {
+        printf("Could not open snapshot %s: %s\n", file, strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return 1;
+    }
+    if(meta.st_size < (off_t)sizeof(struct snapshot_header)) {
+        printf("Could not read snapshot %s: file is too short\n", file);
+        close(fd);
+        return 1;
+    }
+    snap->map = mmap(NULL, meta.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(snap->map == MAP_FAILED) {
+        printf("Could not map snapshot %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+    snap->len = meta.st_size;
+    madvise(snap->map, snap->len, MADV_SEQUENTIAL);
+
+    header = snap->map;
+    snap->header = header;
+    if(memcmp(header->magic, SNAPMAGIC, sizeof(header->magic)) != 0)
+        reason = "not a dug snapshot";
+    else if(header->version != SNAPVERSION)
+        reason = "written by a different version";
+    else if(header->n_dirs == 0 || header->n_summary > header->n_pairs || header->shard >= header->n_shards || header->n_shards > MAXSHARDS ||
+            header->n_dirs > snap->len / sizeof(struct snapshot_dir) || header->n_pairs > snap->len / sizeof(uint64_t) ||
+            header->n_links > snap->len / sizeof(struct snapshot_link) || header->strings_len > snap->len)
+        reason = "file is damaged";
+    if(reason == NULL) {
+        ids_len = (header->n_pairs + header->n_pairs % 2) * sizeof(uint32_t);
+        expected = sizeof(struct snapshot_header) + header->n_dirs*sizeof(struct snapshot_dir) + ids_len + header->n_pairs*sizeof(uint64_t) +
+                   header->n_links*sizeof(struct snapshot_link) + header->strings_len;
+        if(expected != snap->len || header->root_len > header->strings_len)
+            reason = "file is damaged";
+    }
+    if(reason == NULL) {
+        snap->dirs = (const struct snapshot_dir *)(header+1);
+        snap->ids = (const uint32_t *)(snap->dirs + header->n_dirs);
+        snap->sizes = (const uint64_t *)((const char *)snap->ids + ids_len);
+        snap->links = (const struct snapshot_link *)(snap->sizes + header->n_pairs);
+        snap->strings = (const char *)(snap->links + header->n_links);
+
+        // Every path and usage pair must lie within the file
+        name = header->root_len;
+        for(i=0;i<header->n_dirs && reason == NULL;i++) {
+            if(snap->dirs[i].name != name || snap->dirs[i].shared > path_len || snap->dirs[i].first > header->n_pairs - header->n_summary ||
+               snap->dirs[i].n_pairs > header->n_pairs - header->n_summary - snap->dirs[i].first)
+                reason = "file is damaged";
+            name += snap->dirs[i].length;
+            path_len = snap->dirs[i].shared + snap->dirs[i].length;
+        }
+        if(reason == NULL && name != header->strings_len)
+            reason = "file is damaged";
+        for(i=0;i<header->n_links && reason == NULL;i++)
+            if(snap->links[i].dir >= header->n_dirs)
+                reason = "file is damaged";
+    }
+    if(reason != NULL) {
+        printf("Could not read snapshot %s: %s\n", file, reason);
+        munmap(snap->map, snap->len);
+        return 1;
+    }
+
+    snap->path = NULL;
+    snap->path_len = 0;
+    snap->path_cap = 0;
+    snap->next = 0;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Advance to the next directory of a snapshot, rebuilding its path
+ *   from the previous path
+ * ARGUMENT
+ *   struct snapshot *snap : The snapshot
+ *   const struct snapshot_dir **dir : Where the directory is stored, or
+ *                                     NULL at the end of the snapshot
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int next_snapshot_dir(struct snapshot *snap, const struct snapshot_dir **dir) {
+    size_t needed;
+    char* grown;
+
+    *dir = NULL;
+    if(snap->next == snap->header->n_dirs)
+        return 0;
+
+    needed = snap->dirs[snap->next].shared + snap->dirs[snap->next].length + 1;
+    if(needed > snap->path_cap) {
+        if((grown=realloc(snap->path, needed*2)) == NULL) {
+            printf("Could not allocate memory to read snapshot\n");
+            return 1;
+        }
+        snap->path = grown;
+        snap->path_cap = needed*2;
+    }
+    *dir = &snap->dirs[snap->next++];
+    memcpy(snap->path+(*dir)->shared, snap->strings+(*dir)->name, (*dir)->length);
+    snap->path_len = (*dir)->shared + (*dir)->length;
+    snap->path[snap->path_len] = '\0';
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Unmap a snapshot
+ * ARGUMENT
+ *   struct snapshot *snap : The snapshot
+ * RETURN
+ *   Void
+ */
+void close_snapshot(struct snapshot *snap) {
+    munmap(snap->map, snap->len);
+    free(snap->path);
+}
+
+
+/* SYNOPSIS
+ *   Report the IDs that grew by more than the threshold between two
+ *   snapshots, for one directory or for the summary. The pairs of each
+ *   directory are sorted by ID, so they are merged in one pass.
+ * ARGUMENT
+ *   struct snapshot *old : The older snapshot
+ *   uint64_t old_first : First usage pair in the older snapshot
+ *   uint64_t old_n : Number of usage pairs in the older snapshot, 0 if
+ *                    the directory is new
+ *   struct snapshot *new : The newer snapshot
+ *   uint64_t first : First usage pair in the newer snapshot
+ *   uint64_t n : Number of usage pairs in the newer snapshot
+ *   bool summary : Whether the pairs are the summary rather than the
+ *                  current directory of the newer snapshot
+ *   int *n_out : Number of directories reported so far
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int diff_usage(struct snapshot *old, uint64_t old_first, uint64_t old_n, struct snapshot *new, uint64_t first, uint64_t n, bool summary, int *n_out) {
+    char name[MAXNAMELEN], old_size[32], new_size[32], growth[32];
+    char *path, *escaped;
+    size_t length;
+    uint64_t i = 0, j, before, after;
+    uint32_t id;
+    int n_ids = 0;
+
+    for(j=0;j<n;j++) {
+        id = new->ids[first+j];
+        while(i < old_n && old->ids[old_first+i] < id)
+            i++;
+        before = i < old_n && old->ids[old_first+i] == id ? old->sizes[old_first+i] : 0;
+        after = new->sizes[first+j];
+        if(after <= before || after-before <= diff_threshold)
+            continue;
+
+        // The directory is printed before its first ID, with the path of
+        // the target in the newer snapshot
+        if(n_ids++ > 0 && json)
+            printf(",\n");
+        else if(n_ids == 1 && !summary) {
+            length = new->header->root_len + new->path_len;
+            path = malloc(length+1);
+            escaped = malloc(6*length+1);
+            if(path == NULL || escaped == NULL) {
+                printf("Could not allocate memory to output path\n");
+                free(path);
+                free(escaped);
+                return 1;
             }
+            memcpy(path, new->strings, new->header->root_len);
+            memcpy(path+new->header->root_len, new->path, new->path_len+1);
+            if(json) {
+                json_escape_str(path, escaped);
+                printf("%s    \"%s\": {\n", *n_out > 0 ? ",\n" : "", escaped);
+            }
+            else
+                printf("%s\n", path);
+            free(path);
+            free(escaped);
+            *n_out += 1;
         }
+        else if(n_ids == 1 && json)
+            printf("\n");
 
-        // Skip inodes that have been previously visited
-	if(insert && (entry->fts_statp->st_nlink > 1)) {
-	    if((i=insert_inode(entry->fts_statp->st_ino, table)) != 0) {
-                insert = false;
-	        if(trace)
-	            printf("-inode   %s inode %lu has already been counted\n", entry->fts_path, entry->fts_statp->st_ino);
-	    }
-	}
+        if(output_names)
+            get_name(&name_cache, id, name);
+        else
+            sprintf(name, "%u", id);
+        if(json)
+            printf("%s\"%s\": {\"old\":%llu, \"new\":%llu}", summary ? "    " : "      ", name, (long long unsigned int)before, (long long unsigned int)after);
+        else {
+            format_size(before, old_size);
+            format_size(after, new_size);
+            format_size(after-before, growth);
+            printf("%24s  %s -> %s (+%s)\n", name, old_size, new_size, growth);
+        }
+    }
+    if(n_ids > 0 && !summary)
+        printf(json ? "\n    }" : "\n");
+    return 0;
+}
 
-        // Update the running usage in the hash table
-        if(insert) {
-            // Compute size as either file size, or size of
-            // blocks the file spans
-            audit_size = entry->fts_statp->st_size;
-            if(size_in_blocks) {
-                audit_size = entry->fts_statp->st_blocks*512;
+
+/* SYNOPSIS
+ *   Compare two snapshots and report the usage by ID of each directory
+ *   that grew by more than the threshold. Both snapshots are read once
+ *   from start to end, merging their directories in path order.
+ * ARGUMENT
+ *   char* old_file : The older snapshot
+ *   char* new_file : The newer snapshot
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int diff_snapshots(char* old_file, char* new_file) {
+    struct snapshot old, new;
+    const struct snapshot_dir *old_dir, *new_dir;
+    char total[32];
+    int order, status, n_out = 0;
+
+    if(open_snapshot(old_file, &old) != 0)
+        return 1;
+    if(open_snapshot(new_file, &new) != 0) {
+        close_snapshot(&old);
+        return 1;
+    }
+    if(old.header->flags != new.header->flags) {
+        printf("Snapshots %s and %s were not taken with the same -b and -u options\n", old_file, new_file);
+        close_snapshot(&old);
+        close_snapshot(&new);
+        return 1;
+    }
+    summarize_by_user = (new.header->flags & SNAP_BY_USER) != 0;
+    if(names_path != NULL && load_names(names_path) != 0) {
+        close_snapshot(&old);
+        close_snapshot(&new);
+        return 1;
+    }
+
+    if(json)
+        printf("{\n  \"growth\": {\n");
+    else
+        printf("=================== Growth ===================\n");
+
+    status = next_snapshot_dir(&old, &old_dir) || next_snapshot_dir(&new, &new_dir);
+    while(status == 0 && new_dir != NULL) {
+        order = old_dir == NULL ? 1 : compare_paths(old.path, new.path);
+        if(order < 0) {
+            status = next_snapshot_dir(&old, &old_dir);
+            continue;
+        }
+        if(order == 0)
+            status = diff_usage(&old, old_dir->first, old_dir->n_pairs, &new, new_dir->first, new_dir->n_pairs, false, &n_out);
+        else
+            status = diff_usage(&old, 0, 0, &new, new_dir->first, new_dir->n_pairs, false, &n_out);
+        status = status || next_snapshot_dir(&new, &new_dir);
+        if(order == 0)
+            status = status || next_snapshot_dir(&old, &old_dir);
+    }
+
+    if(status == 0) {
+        printf(json ? "\n  },\n  \"summary\": {" : "\n=================== Summaries ===================\n");
+        diff_usage(&old, old.header->n_pairs - old.header->n_summary, old.header->n_summary, &new, new.header->n_pairs - new.header->n_summary, new.header->n_summary, true, &n_out);
+        if(json)
+            printf("\n  },\n  \"total\": {\"old\":%llu, \"new\":%llu}\n}\n", (long long unsigned int)old.header->total, (long long unsigned int)new.header->total);
+        else {
+            format_size(old.header->total, total);
+            printf("%24s  %s -> ", "Total", total);
+            format_size(new.header->total, total);
+            printf("%s\n", total);
+        }
+    }
+
+    close_snapshot(&old);
+    close_snapshot(&new);
+    return status;
+}
+
+
+/* SYNOPSIS
+ *   Add the usage pairs of a snapshot to a result
+ * ARGUMENT
+ *   struct snapshot *snap : The snapshot
+ *   uint64_t first : First usage pair
+ *   uint64_t n : Number of usage pairs
+ *   struct tr_args *result : The result
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int merge_usage(struct snapshot *snap, uint64_t first, uint64_t n, struct tr_args *result) {
+    uint64_t j;
+
+    for(j=0;j<n;j++)
+        if(id_table_add(&result->usage, snap->ids[first+j], snap->sizes[first+j]) != 0)
+            return 1;
+    return 0;
+}
+
+
+/* SYNOPSIS
+ *   Order the files with multiple links of a snapshot by directory
+ * ARGUMENT
+ *   const void *a : The first file
+ *   const void *b : The second file
+ * RETURN
+ *   <0, 0 or >0 as the first file sorts before, with or after the second
+ */
+int compare_links(const void *a, const void *b) {
+    const struct snapshot_link *x = a, *y = b;
+    return x->dir < y->dir ? -1 : (x->dir > y->dir);
+}
+
+
+/* SYNOPSIS
+ *   Find the files with multiple links that were counted by more than one
+ *   shard. Each file is kept by the lowest shard that counted it, and the
+ *   copies counted by the other shards are stored by snapshot, sorted by
+ *   directory, to be taken off their usage.
+ * ARGUMENT
+ *   struct snapshot *parts : The snapshots
+ *   int *owner : The snapshot of each shard
+ *   uint32_t slices : Number of shards
+ *   struct snapshot_link *copies : Where the copies are stored, with room
+ *                                  for the files of every snapshot
+ *   uint64_t *next : Where the first copy of each snapshot is stored
+ *   uint64_t *end : Where the end of the copies of each snapshot is stored
+ * RETURN
+ *   0 on success, 1 if memory could not be allocated
+ */
+int find_shared_links(struct snapshot *parts, int *owner, uint32_t slices, struct snapshot_link *copies, uint64_t *next, uint64_t *end) {
+    const struct snapshot_link *link;
+    uint64_t j, n = 0;
+    uint32_t i;
+    int part, status = 0;
+
+    if(init_inode_set() != 0)
+        return 1;
+    for(i=0;i<slices && status >= 0;i++) {
+        part = owner[i];
+        next[part] = n;
+        for(j=0;j<parts[part].header->n_links && status >= 0;j++) {
+            link = &parts[part].links[j];
+            if((status=insert_inode(link->dev, link->num)) == 1)
+                copies[n++] = *link;
+        }
+        end[part] = n;
+        qsort(copies+next[part], n-next[part], sizeof(struct snapshot_link), compare_links);
+    }
+    free_inode_set();
+    return status < 0;
+}
+
+
+/* SYNOPSIS
+ *   Combine the snapshots written by the shards of a walk with --shard
+ *   into the report of the whole target. The snapshots are read once from
+ *   start to end, merging their directories in path order, and the usage
+ *   of a directory found in several snapshots is added up. A file with
+ *   multiple links counted by several shards is taken off all but one.
+ * ARGUMENT
+ *   char** files : The snapshots
+ *   int n_files : Number of snapshots
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int merge_snapshots(char** files, int n_files) {
+    struct snapshot *parts;
+    const struct snapshot_dir **dirs;
+    struct root target;
+    struct tr_args *result, **grown;
+    unsigned int capacity = 64;
+    size_t root_len, len, path_cap = 0;
+    char* path = NULL;
+    char* bigger;
+    int i, lowest = 0, n_open = 0, status = 0;
+    int *owner = NULL;
+    uint32_t slices;
+    struct snapshot_link *copies = NULL, *copy;
+    struct tr_args *up;
+    struct id_table removed;
+    struct id_entry *entry;
+    uint64_t *next = NULL, *end = NULL, n_links = 0, removed_total = 0;
+    unsigned int k, pos = 0;
+    bool found, no_memory = false;
+
+    parts = calloc(n_files, sizeof(struct snapshot));
+    dirs = calloc(n_files, sizeof(struct snapshot_dir*));
+    memset(&target, 0, sizeof(target));
+    id_table_init(&removed);
+    target.report = malloc(capacity*sizeof(struct tr_args*));
+    if(parts == NULL || dirs == NULL || target.report == NULL) {
+        printf("Could not allocate memory to merge snapshots\n");
+        free(parts);
+        free(dirs);
+        free(target.report);
+        return 1;
+    }
+
+    // Every shard must have walked the same target with the same options
+    for(n_open=0;n_open<n_files && status == 0;n_open++) {
+        if(open_snapshot(files[n_open], &parts[n_open]) != 0) {
+            status = 1;
+            break;
+        }
+        if(parts[n_open].header->flags != parts[0].header->flags) {
+            printf("Snapshots %s and %s were not taken with the same -b and -u options\n", files[0], files[n_open]);
+            status = 1;
+        }
+        else if(parts[n_open].header->root_len != parts[0].header->root_len ||
+                memcmp(parts[n_open].strings, parts[0].strings, parts[0].header->root_len) != 0) {
+            printf("Snapshots %s and %s are not of the same directory\n", files[0], files[n_open]);
+            status = 1;
+        }
+    }
+
+    // Every slice of the walk must be merged exactly once, or its usage
+    // would be missing or counted twice
+    if(status == 0) {
+        slices = parts[0].header->n_shards;
+        if((owner=malloc(slices*sizeof(int))) == NULL) {
+            printf("Could not allocate memory to merge snapshots\n");
+            status = 1;
+        }
+        for(i=0;i<slices && status == 0;i++)
+            owner[i] = -1;
+        for(i=0;i<n_open && status == 0;i++) {
+            if(parts[i].header->n_shards != slices) {
+                printf("Snapshots %s and %s were not split into the same number of shards\n", files[0], files[i]);
+                status = 1;
             }
+            else if(owner[parts[i].header->shard] >= 0) {
+                printf("Snapshots %s and %s are both of shard %u/%u\n", files[owner[parts[i].header->shard]], files[i], parts[i].header->shard, slices);
+                status = 1;
+            }
+            else
+                owner[parts[i].header->shard] = i;
+        }
+        for(i=0;i<slices && status == 0;i++) {
+            if(owner[i] < 0) {
+                printf("The snapshot of shard %d/%u is missing\n", i, slices);
+                status = 1;
+            }
+        }
+    }
+
+    // The shards do not share the inodes they counted, so the files
+    // linked from more than one shard are found before merging
+    if(status == 0) {
+        for(i=0;i<n_open;i++)
+            n_links += parts[i].header->n_links;
+        copies = malloc((n_links+1)*sizeof(struct snapshot_link));
+        next = malloc(n_open*sizeof(uint64_t));
+        end = malloc(n_open*sizeof(uint64_t));
+        if(copies == NULL || next == NULL || end == NULL || find_shared_links(parts, owner, slices, copies, next, end) != 0) {
+            printf("Could not allocate memory to merge snapshots\n");
+            status = 1;
+        }
+    }
+    if(status == 0) {
+        summarize_by_user = (parts[0].header->flags & SNAP_BY_USER) != 0;
+        size_in_blocks = (parts[0].header->flags & SNAP_BLOCKS) != 0;
+        if(names_path != NULL && load_names(names_path) != 0)
+            status = 1;
+    }
+    root_len = status == 0 ? parts[0].header->root_len : 0;
+    target.path = strndup(status == 0 ? parts[0].strings : "", root_len);
+    if(target.path == NULL) {
+        no_memory = status == 0;
+        status = 1;
+    }
+    thread_arena = &result_arena;
+
+    for(i=0;i<n_open && status == 0;i++)
+        status = next_snapshot_dir(&parts[i], &dirs[i]);
+    while(status == 0 && !no_memory) {
+        // The next directory is the first in path order of any snapshot
+        found = false;
+        for(i=0;i<n_open && !no_memory;i++) {
+            if(dirs[i] == NULL || (found && compare_paths(parts[i].path, path+root_len) >= 0))
+                continue;
+            len = root_len + parts[i].path_len + 1;
+            if(len > path_cap) {
+                if((bigger=realloc(path, len*2)) == NULL) {
+                    no_memory = true;
+                    break;
+                }
+                path = bigger;
+                path_cap = len*2;
+            }
+            memcpy(path, target.path, root_len);
+            memcpy(path+root_len, parts[i].path, parts[i].path_len+1);
+            found = true;
+            lowest = i;
+        }
+        if(!found || no_memory)
+            break;
 
-            id = entry->fts_statp->st_gid;
-            if(summarize_by_user)
-                id = entry->fts_statp->st_uid;
+        // The last result is kept free for the summary
+        if(target.n_report+1 == capacity) {
+            if((grown=realloc(target.report, capacity*2*sizeof(struct tr_args*))) == NULL) {
+                no_memory = true;
+                break;
+            }
+            target.report = grown;
+            capacity *= 2;
+        }
+        if(init_result(&result, path) != 0) {
+            no_memory = true;
+            break;
+        }
 
-            if(insert_or_update(id, audit_size, gids, sizes) != 0) {
-                store_error(entry->fts_path, "GID table overflowed");
-                return "GID_OVERFLOW";
+        // The parent is the nearest earlier directory that is less deep.
+        // The result of the target holds only its own entries, so the
+        // subdirectories of the target have none.
+        result->depth = dirs[lowest]->depth;
+        for(up=result->depth > 1 ? target.report[target.n_report-1] : NULL;up != NULL && up->depth >= result->depth;up=up->parent)
+            ;
+        result->parent = up;
+        target.report[target.n_report++] = result;
+        for(i=0;i<n_open && status == 0 && !no_memory;i++) {
+            if(dirs[i] == NULL || strcmp(parts[i].path, path+root_len) != 0)
+                continue;
+            no_memory = merge_usage(&parts[i], dirs[i]->first, dirs[i]->n_pairs, result) != 0;
+
+            // A copy was counted in the directory and all its ancestors
+            for(;next[i] < end[i] && copies[next[i]].dir == dirs[i] - parts[i].dirs && !no_memory;next[i]++) {
+                copy = &copies[next[i]];
+                for(up=result;up != NULL && !no_memory;up=up->parent)
+                    no_memory = id_table_add(&up->usage, copy->id, -copy->size) != 0;
+                no_memory = no_memory || id_table_add(&removed, copy->id, copy->size) != 0;
+                removed_total += copy->size;
             }
+            status = next_snapshot_dir(&parts[i], &dirs[i]);
         }
+    }
 
+    // Copies are also taken off the ancestors of their directory, so a
+    // directory is complete only once all snapshots have been read
+    for(k=0;k<target.n_report && status == 0 && !no_memory;k++)
+        no_memory = pack_result(target.report[k], &target.report[k]->usage) != 0;
+
+    // The summary is the sum of the summaries of the shards
+    if(status == 0 && !no_memory && init_result(&result, "totals") == 0) {
+        target.report[target.n_report++] = result;
+        for(i=0;i<n_open && !no_memory;i++) {
+            no_memory = merge_usage(&parts[i], parts[i].header->n_pairs - parts[i].header->n_summary, parts[i].header->n_summary, result) != 0;
+            target.total += parts[i].header->total;
+        }
+        while(!no_memory && (entry=id_table_next(&removed, &pos)) != NULL)
+            no_memory = id_table_add(&result->usage, entry->id, -entry->size) != 0;
+        target.total -= removed_total;
+        no_memory = no_memory || pack_result(result, &result->usage) != 0;
+    }
+    else if(status == 0)
+        no_memory = true;
+    if(no_memory) {
+        printf("Could not allocate memory to merge snapshots\n");
+        status = 1;
     }
-    pack_result(targs, gids, sizes);
-    free_inode_table(table);
 
-    fts_close(stream);
-    return "OK";
+    if(status == 0) {
+        if(verbose)
+            printf("+dug       Merged %d snapshots into %u directories\n", n_files, target.n_report-1);
+        if(snapshot_path != NULL)
+            status = write_snapshot(snapshot_path, target.report, target.n_report, target.total);
+        if(json)
+            status |= output_json(&target, 1, false, NULL, 0);
+        else
+            status |= output_table(&target, 1, NULL, 0);
+    }
+
+    for(i=0;i<target.n_report;i++)
+        free_result(&target.report[i]);
+    free(target.report);
+    free(target.path);
+    free(path);
+    arena_free(&result_arena);
+    for(i=0;i<n_open;i++)
+        close_snapshot(&parts[i]);
+    id_table_free(&removed);
+    free(copies);
+    free(next);
+    free(end);
+    free(owner);
+    free(parts);
+    free(dirs);
+    return status;
 }
 
+
 /* SYNOPSIS
- *   Scans an argument directory to determine the number of subdirectories
- *   within it.
- * ARGUMENT
- *   char* path : The directory to scan
- *   unsigned int *n_subdirs : Address where the count is stored
- *   long long unsinged int devnum: Address to store directory device num
+ *   Pick the worker that receives the next item of the top level of a
+ *   target, round robin over the active workers
+ * ARGUMENT:
+ *   unsigned int *turn : Number of items queued so far, incremented
  * RETURN
- *   0 on success, 1 on error
+ *   The worker
  */
-int get_n_subdirs(char* path, unsigned int *n_subdirs, long long unsigned int *devnum) {
+struct worker* next_worker(unsigned int *turn) {
+    return &workers[(*turn)++ % __atomic_load_n(&active_workers, __ATOMIC_RELAXED)];
+}
+
+
+/* SYNOPSIS
+ *   Add a subdirectory of a target to its results, growing the results
+ *   as needed. The last result is kept free for the summary.
+ * ARGUMENT:
+ *   struct root *target : The target
+ *   char* path : The subdirectory
+ *   unsigned int index : The index of the target
+ * RETURN
+ *   The result of the subdirectory, or NULL if memory could not be
+ *   allocated
+ */
+struct tr_args* add_subdir(struct root *target, char* path, unsigned int index) {
+    struct tr_args **grown;
+    unsigned int i = target->subdir_count;
+
+    if(i+1 >= target->capacity) {
+        grown = realloc(target->descendents, target->capacity*2*sizeof(struct tr_args*));
+        if(grown == NULL)
+            return NULL;
+        memset(grown+target->capacity, 0, target->capacity*sizeof(struct tr_args*));
+        target->descendents = grown;
+        target->capacity *= 2;
+    }
+    if(init_result(&target->descendents[i], path) != 0)
+        return NULL;
+    target->descendents[i]->depth = 1;
+    target->descendents[i]->rank = i;
+    target->descendents[i]->root = index;
+    target->subdir_count += 1;
+    return target->descendents[i];
+}
+
+
+/* SYNOPSIS
+ *   Read the top level of a target in a single pass. The target itself is
+ *   counted here, subdirectories are queued for the workers without a
+ *   stat when readdir reports their type, and the other entries are
+ *   queued in batches that the workers stat in parallel. Top level
+ *   directories are spread round robin over the workers, and workers that
+ *   run out of work steal from the others.
+ * ARGUMENT:
+ *   struct root *target : The target
+ *   unsigned int index : The index of the target
+ * RETURN
+ *   0 on success, 1 if the target could not be read
+ */
+int scan_root(struct root *target, unsigned int index) {
     DIR *dp;
     struct dirent *entry;
     struct stat meta;
-    char* temppath = malloc(MAXPATHLEN);
-    unsigned int sd = 0;
-    int rval = 0;
+    struct dir_handle *handle;
+    struct tr_args *top, *slot;
+    int fd, status;
+    char* temppath;
+    char* dirpath;
+    char* names = NULL;
+    char* grown;
+    char* path = target->path;
+    size_t len, names_len = 0, names_size = 0;
+    unsigned int n_names = 0, turn = 0;
+    long long unsigned int audit_size;
+    unsigned int id;
+
+    metric_path(&walk_metrics, path);
 
-    // Open directory for reading or return with error
+    // Open the directory and stat it once, for the device the walk is
+    // restricted to and to count the target itself
     dp = opendir(path);
     if(dp == NULL) {
         store_error(path, strerror(errno));
-        free(temppath);
         return 1;
     }
-
-    // stat the directory to get device number
-    if(lstat(path, &meta) != 0) {
-        store_error(temppath, "Could not stat file");
+    if(dug_stat(dirfd(dp), "", AT_EMPTY_PATH, stat_mask, &meta) != 0) {
+        store_error(path, "Could not stat file");
+        closedir(dp);
+        return 1;
+    }
+    target->devnum = meta.st_dev;
+
+    // The result for the target directory is stored in position 0, and
+    // the summary after the last subdirectory
+    temppath = malloc(MAXPATHLEN);
+    dirpath = strdup(path);
+    target->capacity = 64;
+    target->descendents = calloc(target->capacity, sizeof(struct tr_args*));
+    if(temppath == NULL || dirpath == NULL || target->descendents == NULL ||
+       init_result(&target->descendents[0], path) != 0) {
+        store_error(path, "Could not allocate memory for the target");
         free(temppath);
-	return 1;
+        free(dirpath);
+        closedir(dp);
+        exit_now = true;
+        exit_status = 4;
+        return 1;
+    }
+    top = target->descendents[0];
+    top->root = index;
+    target->subdir_count = 1;
+    target->scanned = true;
+
+    // Batches of entries are stat'ed by the workers relative to the
+    // target, and named after it without the trailing separator
+    len = strlen(dirpath);
+    if(len > 0 && dirpath[len-1] == '/')
+        dirpath[len-1] = '\0';
+    fd = dup(dirfd(dp));
+    handle = fd < 0 ? NULL : new_handle(fd);
+    if(fd >= 0 && handle == NULL)
+        close(fd);
+
+    // Count the target itself before any worker adds to its result. The
+    // main thread holds the result open until the target is read.
+    top->pending = 1;
+    if(shard != 0) {
+        if(verbose)
+            printf("-skip      %s. is counted by shard 0\n", path);
+    }
+    else if(using_exclude && is_excluded(meta.st_ino)) {
+        if(verbose)
+            printf("-skip      %s. is in the exclude list\n", path);
+    }
+    else if(meta.st_nlink > 1 && (status=insert_inode(meta.st_dev, meta.st_ino)) != 0) {
+        if(status < 0) {
+            store_error(path, "Could not allocate memory to track inodes");
+            exit_now = true;
+            exit_status = 4;
+        }
+        else if(trace)
+            printf("-inode   %s. inode %lu has already been counted\n", path, meta.st_ino);
+    }
+    else {
+        if(verbose)
+            printf("+directory %s. (%ld)\n", path, meta.st_size);
+        audit_size = meta.st_size;
+        if(size_in_blocks)
+            audit_size = meta.st_blocks*512;
+        metric_add(&walk_metrics.entries, 1);
+        metric_add(&walk_metrics.bytes, audit_size);
+
+        id = meta.st_gid;
+        if(summarize_by_user)
+            id = meta.st_uid;
+
+        if(id_table_add(&top->usage, id, audit_size) != 0
+           || (accounting && acct_add(&walk_acct, (long long unsigned int)meta.st_uid << 32 | meta.st_gid, meta.st_blocks*512, meta.st_size, 1) != 0)
+           || ((n_ages > 0 || size_histogram) && hist_add(&walk_hist, id, &meta, audit_size) != 0)) {
+            store_error(path, "Could not allocate memory for usage table");
+            exit_now = true;
+            exit_status = 4;
+        }
+        prefetch_names(NULL, &top->usage);
     }
-    *devnum = meta.st_dev;
 
-    // Read the directory and count the number of subdirectories
-    // on the same device
-    while((entry=readdir(dp))) {
-        if(strcmp(".", entry->d_name) == 0 || strcmp("..", entry->d_name) == 0)
+    while(!exit_now && (entry=readdir(dp))) {
+        // Skip navigational entries
+        if(entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+            continue;
+
+        // Skip excluded names before they are stat'ed
+        if(using_exclude_names && is_excluded_name(entry->d_name)) {
+            if(verbose)
+                printf("-skip      %s%s matches an excluded name\n", path, entry->d_name);
             continue;
+        }
 
-        rval = snprintf(temppath, MAXPATHLEN, "%s/%s", path, entry->d_name);
-	if(rval < 0 || rval >= MAXPATHLEN) {
-            store_error(entry->d_name, "Could not build full path; Over maximum path length  or error occured\n");
-	    return 1;
+        status = snprintf(temppath, MAXPATHLEN, "%s%s", path, entry->d_name);
+        if(status < 0 || status >= MAXPATHLEN) {
+            store_error(entry->d_name, "Could not build full path; Over maximum path length or error occured\n");
+            exit_status = 1;
+            break;
 	}
 
-        if(lstat(temppath, &meta) != 0) {
-            store_error(temppath, "Could not stat file");
+        // Only entries of unknown type are stat'ed here, to tell the
+        // directories apart
+        if(entry->d_type == DT_UNKNOWN) {
+            if(dug_stat(dirfd(dp), entry->d_name, AT_SYMLINK_NOFOLLOW, STATX_TYPE|STATX_INO, &meta) != 0) {
+                store_error(temppath, "entry: Could not stat file");
+                continue;
+            }
+            if((meta.st_mode & S_IFMT) == S_IFDIR && meta.st_dev != target->devnum) {
+                if(verbose)
+                    printf("-skip     %s on another device\n", temppath);
+                continue;
+            }
+            if(using_exclude && is_excluded(meta.st_ino)) {
+                if(verbose)
+                    printf("-skip      %s is in the exclude list\n", temppath);
+                continue;
+            }
+            if((meta.st_mode & S_IFMT) == S_IFDIR)
+                entry->d_type = DT_DIR;
+        }
+
+        // With --shard, subdirectories go to the shard their name hashes
+        // to, and the other entries to shard 0, so every process that
+        // walks the target sees the same split
+        if(n_shards > 1 && (entry->d_type == DT_DIR ? hash_name(entry->d_name) % n_shards : 0) != shard) {
+            if(verbose)
+                printf("-skip      %s is in another shard\n", temppath);
             continue;
         }
 
-        if(using_exclude && is_excluded(meta.st_ino))
-	    continue;
+        // Queue subdirectories for the workers, which check their device
+        // and the exclude list as they open them
+        if(entry->d_type == DT_DIR) {
+            if(verbose)
+                printf("entry: Queue directory %u for processing: %s\n", target->subdir_count, temppath);
+            if((slot=add_subdir(target, temppath, index)) == NULL) {
+                store_error(temppath, "Could not allocate memory for the target");
+                exit_status = 4;
+                exit_now = true;
+                break;
+            }
+            if(queue_work(next_worker(&turn), temppath, share_handle(handle), slot, 1, target->devnum) != 0) {
+                exit_now = true;
+                break;
+            }
+            __atomic_add_fetch(&n_top, 1, __ATOMIC_RELAXED);
+            continue;
+        }
 
-	if(((meta.st_mode & S_IFMT) == S_IFDIR) && (meta.st_dev == *devnum))
-            sd += 1;
+        // Add other entries to the current batch, and queue the batch
+        // once it is full
+        len = strlen(entry->d_name)+1;
+        if(names_len+len > names_size) {
+            names_size = names_size == 0 ? NAMEBATCH*16 : names_size*2;
+            if((grown=realloc(names, names_size)) == NULL) {
+                store_error(path, "Could not allocate memory to queue directory");
+                exit_status = 4;
+                exit_now = true;
+                break;
+            }
+            names = grown;
+        }
+        memcpy(names+names_len, entry->d_name, len);
+        names_len += len;
+        if(++n_names == NAMEBATCH) {
+            status = queue_names(next_worker(&turn), dirpath, share_handle(handle), top, names, n_names);
+            names = NULL;
+            if(status != 0) {
+                exit_now = true;
+                break;
+            }
+            names_len = names_size = 0;
+            n_names = 0;
+        }
     }
- 
-    *n_subdirs = sd;
-    closedir(dp);
+    if(!exit_now && n_names > 0) {
+        if(queue_names(next_worker(&turn), dirpath, share_handle(handle), top, names, n_names) != 0)
+            exit_now = true;
+        names = NULL;
+    }
+    free(names);
     free(temppath);
+    free(dirpath);
+    if(handle != NULL)
+        release_handle(handle);
+    closedir(dp);
+
+    // The result of the target is complete once the workers have stat'ed
+    // every batch
+    release_slot(top, 1);
     return 0;
 }
 
 
 /* SYNOPSIS
- *   Sweeps an array of thread ids and attempts to join active threads
- * ARGUMENT
- *   pthread_t *thread_ids[] : Thread ids to sweep
- *   unsigned int max_n_threads : Length of thread id array
+ *   Build the report of a target: the target, its subdirectories with the
+ *   deeper directories under each of them, and its summary last
+ * ARGUMENT:
+ *   struct root *target : The target
+ *   struct tr_args **nodes : The deeper directories under the target
+ *   unsigned int n_nodes : Number of deeper directories
  * RETURN
- *   -1 if no threads were joined, index of first joined thread otherwise
+ *   0 on success, 1 on failure
  */
-int tr_recover_slots(pthread_t *thread_ids[], unsigned int max_n_threads) {
-    int i, status, n=-1;
-    for(i=0;i<max_n_threads;i++) {
-        if(thread_ids[i] == NULL)
-            continue;
+int report_root(struct root *target, struct tr_args **nodes, unsigned int n_nodes) {
+    struct tr_args **descendents = target->descendents, *result;
+    unsigned int i, n = 1;
+
+    // Drop the subdirectories the workers found on other devices or in
+    // the exclude list, keeping the others in the order they were read
+    for(i=1;i<target->subdir_count;i++) {
+        if(descendents[i]->skipped)
+            free_result(&descendents[i]);
+        else
+            descendents[n++] = descendents[i];
+    }
+    for(i=n;i<target->subdir_count;i++)
+        descendents[i] = NULL;
+    target->subdir_count = n;
+
+    // Pack the usage the workers rolled up into the target and each
+    // subdirectory. The usage of deeper directories was folded into
+    // their parents as each of them completed.
+    for(i=0;i<n+n_nodes;i++) {
+        result = i < n ? descendents[i] : nodes[i-n];
+        if(pack_result(result, &result->usage) != 0)
+            break;
+    }
+
+    // Add summary to full result
+    if(i < n+n_nodes || init_result(&descendents[n], "totals") != 0) {
+        printf("Could not allocate memory for the report\n");
+        exit_status = 4;
+        return 1;
+    }
+    if(add_summary(descendents, n+1, &target->total) != 0)
+        return 1;
 
-        status = pthread_tryjoin_np(*thread_ids[i], NULL);
-        if(status == 0) {
-            free(thread_ids[i]);
-            thread_ids[i] = NULL;
-            if(n == -1)
-                n = i;
+    // Report deeper directories after the subdirectory they are under
+    target->n_report = n+1+n_nodes;
+    target->report = descendents;
+    if(n_nodes > 0) {
+        target->report = malloc(target->n_report*sizeof(struct tr_args*));
+        if(target->report == NULL) {
+            printf("Could not allocate memory for the report\n");
+            exit_status = 4;
+            return 1;
         }
+        memcpy(target->report, descendents, n*sizeof(struct tr_args*));
+        memcpy(target->report+n, nodes, n_nodes*sizeof(struct tr_args*));
+        qsort(target->report+1, n-1+n_nodes, sizeof(struct tr_args*), compare_nodes);
+        target->report[n+n_nodes] = descendents[n];
     }
-    return n;
+    return 0;
 }
 
+
 /* SYNOPSIS
- *   Find the index of an empty array element where a thread id can be stored.
- *   The method polls until an element becomes available.
- * ARGUMENT
- *   pthread_t *thread_ids[] : Array of thread ids
- *   unsigned int max_n_threads : Length of thread id array
+ *   Sum the summaries of all targets that were reported
+ * ARGUMENT:
+ *   struct root *roots : The targets
+ *   int n_roots : Number of targets
+ *   struct tr_args **result : Address where the summary is stored
+ *   long long unsigned int *total : Address where the total is stored
  * RETURN
- *   The index of the available element
+ *   0 on success, 1 on failure
  */
-int tr_find_slot(pthread_t *thread_ids[], unsigned int max_n_threads) {
-    int i;
-    while(1) {
-        // If a slot is available, return the index
-        for(i=0;i<max_n_threads;i++) {
-            if(thread_ids[i] == NULL)
-                return i;
-        }
+int add_grand_summary(struct root *roots, int n_roots, struct tr_args **result, long long unsigned int *total) {
+    struct tr_args *summary;
+    struct id_table usage;
+    int i, j;
 
-        // Otherwise, try to recover slots from completed threads.
-        // If no slots recovered, wait a short interval. Otherwise, 
-        // return the index of the first slot we opened up. 
-        if((i=tr_recover_slots(thread_ids, max_n_threads)) == -1) {
-            usleep(10000);
+    id_table_init(&usage);
+    for(i=0;i<n_roots;i++) {
+        if(roots[i].report == NULL)
+            continue;
+        summary = roots[i].report[roots[i].n_report-1];
+        for(j=0;j<summary->n_pairs*2;j+=2) {
+            if(id_table_add(&usage, summary->pairs[j], summary->pairs[j+1]) != 0) {
+                id_table_free(&usage);
+                return 1;
+            }
         }
-        else
-            return i;
+        *total += roots[i].total;
+    }
+
+    if(init_result(result, "totals") != 0 || pack_result(*result, &usage) != 0) {
+        id_table_free(&usage);
+        return 1;
     }
+    id_table_free(&usage);
+    return 0;
 }
 
+
 /* SYNOPSIS
- *   Waits for and joins all threads with ids in the argument array.
- * ARGUMENT
- *   pthread_t *thread_ids[] : Array of thread ids
- *   unsigned int max_n_threads : Length of thread id array
+ *   Release the results of a target
+ * ARGUMENT:
+ *   struct root *target : The target
  * RETURN
- *   0 if all join are successful, number of of joins that failed otherwise
+ *   Void
  */
-int tr_finalize(pthread_t *thread_ids[], unsigned int max_n_threads) {
-    int i, status, n=0;
-    for(i=0;i<max_n_threads;i++) {
-        if(thread_ids[i] == NULL)
-            continue;
-
-        status = pthread_join(*thread_ids[i], NULL);
-        if(status != 0)
-            printf("tr   :Error in pthread_join(): %s\n", strerror(errno));
-	n += status;
-        free(thread_ids[i]);
+void free_root(struct root *target) {
+    unsigned int i;
+
+    if(target->descendents != NULL) {
+        for(i=0;i<=target->subdir_count;i++)
+            if(target->descendents[i] != NULL)
+                free_result(&target->descendents[i]);
+        if(target->report != target->descendents)
+            free(target->report);
+        free(target->descendents);
     }
-    return n;
+    target->descendents = target->report = NULL;
 }
 
+
 /* SYNOPSIS
- *   Inventories the usage in this directory and all subdirectories, organized
- *   by path and groups (gids).
+ *   Inventories the usage in the target directories and all their
+ *   subdirectories, organized by path and groups (gids). All targets share
+ *   one pool of workers and one inode set, so files linked from several
+ *   targets are counted once.
  * ARGUMENT:
- *   char* path : The path to the top level directory of the search
+ *   struct root *roots : The targets of the search
+ *   int n_roots : Number of targets
+ *   bool sections : Report each target in its own section, even if there
+ *                   is only one
  *   unsigned int max_n_threads : The number of threads to use for the search
  * RETURN
  *   0 on success, 1 on failure
  */
-int walk(char* path, unsigned int max_n_threads) {
-    DIR *dp;
-    struct dirent *entry;
-    struct stat meta;
-    int i, status, thread_i;
-    char* temppath = malloc(MAXPATHLEN);
-    bool insert, process;
-    long long unsigned int audit_size, grand_total=0, devnum=0;
-    long long unsigned int sizes[MAXGIDS];
-    unsigned int gids[MAXGIDS];
-    unsigned int id;
-    unsigned int n_subdirs = 0, subdir_count=1;
-    struct inode_entry *table[INODETABLE];
-
+int walk(struct root *roots, int n_roots, bool sections, unsigned int max_n_threads) {
+    int i, n_scanned = 0;
+    long long unsigned int grand_total=0, n_inodes;
+    unsigned int *n_nodes, *first, r;
+    struct tr_args **nodes, *grand = NULL;
+    sigset_t signals;
+
+    // SIGUSR1 is only taken by the reporter thread, so block it before
+    // any thread is launched. Until the reporter runs, it stays pending.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    walk_start = now_ns();
+    throttle.window_start = walk_start;
+    thread_metrics = &walk_metrics;
+    thread_arena = &result_arena;
+
+    for(i=0;i<n_roots;i++) {
+        roots[i].descendents = roots[i].report = NULL;
+        roots[i].scanned = false;
+        roots[i].subdir_count = 0;
+        roots[i].total = 0;
+    }
 
-    // Find the number of sub-directories under the root
-    // path
-    if((status=get_n_subdirs(path, &n_subdirs, &devnum)) != 0) {
+    // Initialize the inode set shared by all threads
+    if(init_inode_set() != 0) {
+        store_error(roots[0].path, "Could not allocate memory to track inodes");
         exit_status = 1;
         return 1;
     }
 
-    // Open the directory to enumerate files, returning
-    // if an error is encountered
-    dp = opendir(path);
-    if(dp == NULL) {
-        store_error(path, strerror(errno));
-        free(temppath);
-        exit_status = 1;
+    // Resolve the names of IDs as the walk finds them
+    start_names(&name_cache);
+
+    // Launch the workers. They wait for the subdirectories
+    // that are queued below
+    if(max_n_threads < 1)
+        max_n_threads = 1;
+    if(start_workers(max_n_threads) != 0) {
+        stop_names(&name_cache);
+        free_inode_set();
         return 1;
     }
- 
-    // Allocate results for number of subdirs
-    // plus 2, because we store the result for 
-    // the target directory in position 0 and
-    // the summary in last array element
-    struct tr_args *descendents[n_subdirs+2];
-    for(i=0;i<n_subdirs+2;i++) {
-        descendents[i] = NULL;
-    }
-    pthread_t *thread_ids[max_n_threads];
 
-    // Fill the hash table with initialization values
-    // so we can identify empty slots
-    for(i=0;i<MAXGIDS;i++) {
-        gids[i] = UINT_MAX;
-        sizes[i] = 0;
+    // Read the top level of each target while the workers walk the
+    // subdirectories of the targets before it
+    for(i=0;i<n_roots && !exit_now;i++) {
+        if(verbose)
+            printf("+dug       Auditing directory %s\n", roots[i].path);
+        if(scan_root(&roots[i], i) == 0)
+            n_scanned++;
     }
 
-    // Fill the inode lookup table with default value
-    // NULL so we can identify empty slots
-    for(i=0;i<INODETABLE;i++) {
-        table[i] = NULL;
+    // Wait for all workers to finish
+    finish_workers();
+    stop_names(&name_cache);
+    n_inodes = free_inode_set();
+    if(verbose)
+        printf("+dug       Tracked %llu inodes with multiple links, waited for the inode set %llu times\n", n_inodes, inode_contention);
+
+    // Replace the cache with the directories of this walk, unless the
+    // walk was cut short
+    if(cache_path != NULL && !exit_now && n_scanned > 0)
+        cache_save(cache_path);
+    if(cache_in != NULL)
+        munmap((void *)cache_in, cache_in_len);
+    cache_in = NULL;
+    cache_free(&cache_out);
+
+    // If any failures, return. A target that could not be read only
+    // fails the walk if no other target could be.
+    if(n_scanned == 0 && exit_status == 0)
+        exit_status = 1;
+    if(exit_status != 0 || exit_now) {
+        for(i=0;i<n_roots;i++)
+            free_root(&roots[i]);
+        free_tree();
+        return 1;
     }
 
-    // Initialize thread ID pointers to NULL so we 
-    // can identify unused slots
-    for(i=0;i<max_n_threads;i++)
-        thread_ids[i] = NULL;
+    // Every directory has been streamed, so only the summary is left
+    if(ndjson) {
+        stream_summary_line();
+        id_table_free(&stream_summary);
+        if(snapshot_path == NULL) {
+            for(i=0;i<n_roots;i++)
+                free_root(&roots[i]);
+            free_tree();
+            if(n_scanned < n_roots)
+                exit_status = 1;
+            return 0;
+        }
+    }
 
-    while((entry=readdir(dp))) {
-        // Skip parent navigational entry
-        if(strcmp("..", entry->d_name) == 0)
+    // Group the deeper directories by target
+    n_nodes = calloc(n_roots, sizeof(unsigned int));
+    first = calloc(n_roots, sizeof(unsigned int));
+    nodes = malloc((n_tree_nodes+1)*sizeof(struct tr_args*));
+    if(n_nodes == NULL || first == NULL || nodes == NULL) {
+        printf("Could not allocate memory for the report\n");
+        free(n_nodes);
+        free(first);
+        free(nodes);
+        for(i=0;i<n_roots;i++)
+            free_root(&roots[i]);
+        free_tree();
+        exit_status = 4;
+        return 1;
+    }
+    for(r=0;r<n_tree_nodes;r++)
+        n_nodes[tree_nodes[r]->root]++;
+    for(i=1;i<n_roots;i++)
+        first[i] = first[i-1] + n_nodes[i-1];
+    for(r=0;r<n_tree_nodes;r++)
+        nodes[first[tree_nodes[r]->root]++] = tree_nodes[r];
+
+    // Build the report of each target. First now holds the end of the
+    // deeper directories of each target.
+    for(i=0;i<n_roots;i++) {
+        if(!roots[i].scanned)
             continue;
-
-        if(exit_now)
+        if(report_root(&roots[i], nodes+first[i]-n_nodes[i], n_nodes[i]) != 0) {
+            free(n_nodes);
+            free(first);
+            free(nodes);
+            for(i=0;i<n_roots;i++)
+                free_root(&roots[i]);
+            free_tree();
             return 1;
-
-        // Get the file metadata
-        status = snprintf(temppath, MAXPATHLEN, "%s%s", path, entry->d_name);
-        if(status < 0 || status >= MAXPATHLEN) {
-            store_error(entry->d_name, "Could not build full path; Over maximum path length or error occured\n");
-            return 1;    
-	}
-
-        if(lstat(temppath, &meta) != 0) {
-            store_error(temppath, "entry: Could not stat file");
-            continue;
-        }
-
-        // Skip excluded files
-	if(using_exclude && is_excluded(meta.st_ino)) {
-            if(verbose)
-                printf("-skip      %s is in the exclude list\n", temppath);
-	    continue;
-	}
-
-        // Process the file or directory
-        process = insert = false;
-        switch(meta.st_mode & S_IFMT) {
-            case S_IFLNK:
-                if(verbose)
-                    printf("+symlink   %s (%ld)\n", temppath, meta.st_size);
-                insert = true; 
-                break;
-            case S_IFREG:
-                if(verbose)
-                    printf("+file      %s (%ld)\n", temppath, meta.st_size);
-                insert = true;
-                break;
-            case S_IFDIR:
-                if(meta.st_dev != devnum) {
-		    if(verbose)
-	                printf("-skip     %s on another device (%ld)\n", temppath, meta.st_size);
-		}
-		else {
-	            if(verbose)
-                        printf("+directory %s (%ld)\n", temppath, meta.st_size);
-                    if(strcmp(".", entry->d_name) == 0)
-                        insert = true;
-                    else
-                        process = true;
-		}
-                break;
-            default:
-                if(verbose)
-                    printf("-skip     %s\n", temppath);
-        }
-
-        // Skip inodes that have been previously visited
-        if((insert || process) && (meta.st_nlink > 1)) {
-            if((i=insert_inode(meta.st_ino, table)) != 0) {
-                insert = false;
-		process = false;
-                if(trace)
-                    printf("-inode   %s inode %lu has already been counted\n", temppath, meta.st_ino);
-            }
-        } 
-
-        // Update the running usage in the hash table
-        if(insert) {
-            // Compute size as either file size, or size of
-            // blocks the file spans
-            audit_size = meta.st_size;
-            if(size_in_blocks)
-                audit_size = meta.st_blocks*512;
-
-            id = meta.st_gid;
-            if(summarize_by_user)
-                id = meta.st_uid;
-
-            if(insert_or_update(id, audit_size, gids, sizes) != 0) {
-                store_error(temppath, "entry: GID table overflowed");
-                return 1;
-            }
-        }
-
-
-        // If it is a subdirectory, we need to launch a thread to process it
-        if(process) {
-             init_result(&descendents[subdir_count], temppath);
-
-             // Launch thread to walk directory
-             if(verbose)
-                 printf("entry: Launch a thread to process directory %d/%d: %s\n", subdir_count+1, n_subdirs, temppath);
-             thread_i=tr_find_slot(thread_ids, max_n_threads); 
-             thread_ids[thread_i] = malloc(sizeof(pthread_t));
-             pthread_create(thread_ids[thread_i], NULL, &fts_walk, descendents[subdir_count]);
-             subdir_count += 1; 
         }
     }
-    free(temppath);
-    free_inode_table(table);
-    closedir(dp);
-
-    // Wait for all threads to finish
-    tr_finalize(thread_ids, max_n_threads);
-
-    // If any failures, return
-    if(exit_status != 0)
-        return 1;
-
-    // Add usage from the target directory to the full result
-    init_result(&descendents[0], path);
-    pack_result(descendents[0], gids, sizes);
-
-    // Add summary to full result
-    init_result(&descendents[n_subdirs+1], "totals");
-    if((i=add_summary(descendents, n_subdirs+2, &grand_total)) != 0)
+    free(n_nodes);
+    free(first);
+    free(nodes);
+    if(grand_summary && add_grand_summary(roots, n_roots, &grand, &grand_total) != 0) {
+        for(i=0;i<n_roots;i++)
+            free_root(&roots[i]);
+        free_tree();
+        exit_status = 4;
         return 1;
+    }
 
     // Output result
-    if(json)
-        output_json(descendents, n_subdirs+2, grand_total);
-    else
-        output_table(descendents, n_subdirs+2, grand_total);
+    if(snapshot_path != NULL)
+        write_snapshot(snapshot_path, roots[0].report, roots[0].n_report, roots[0].total);
+    if(!ndjson && json)
+        output_json(roots, n_roots, sections, grand, grand_total);
+    else if(!ndjson)
+        output_table(roots, n_roots, grand, grand_total);
+
+    // A target that could not be read is listed in the errors
+    if(n_scanned < n_roots)
+        exit_status = 1;
 
     // Cleanup
-    for(i=0;i<n_subdirs+2;i++) {
-        free_result(&descendents[i]);
-    }
+    for(i=0;i<n_roots;i++)
+        free_root(&roots[i]);
+    if(grand != NULL)
+        free_result(&grand);
+    free_tree();
 
     return 0;
 }
@@ -1268,6 +8408,97 @@ int get_sanitized_path(char* arg, char* output) {
     return 0;
 }
 
+/* SYNOPSIS
+ *   Add a target directory to the list of targets
+ * ARGUMENT
+ *   char* arg : The directory as given
+ *   struct root **roots : Address of the list, grown as needed
+ *   int *n_roots : Address of the number of targets
+ *   int *capacity : Address of the capacity of the list
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int add_root(char* arg, struct root **roots, int *n_roots, int *capacity) {
+    struct root *grown;
+    char* path;
+
+    if(*n_roots == *capacity) {
+        grown = realloc(*roots, (*capacity == 0 ? 8 : *capacity*2)*sizeof(struct root));
+        if(grown == NULL) {
+            printf("Could not allocate memory for the list of directories\n");
+            return 1;
+        }
+        *roots = grown;
+        *capacity = *capacity == 0 ? 8 : *capacity*2;
+    }
+
+    path = malloc(MAXPATHLEN);
+    if(path == NULL || get_sanitized_path(arg, path) != 0) {
+        printf("Could not use input path %s. It is over the maximum length %d or it could not be formatted to process\n", arg, MAXPATHLEN);
+        free(path);
+        return 1;
+    }
+    memset(&(*roots)[*n_roots], 0, sizeof(struct root));
+    (*roots)[(*n_roots)++].path = path;
+    return 0;
+}
+
+/* SYNOPSIS
+ *   Add the target directories listed in a file, one per line. Empty
+ *   lines are skipped.
+ * ARGUMENT
+ *   char* file : The file, or - for standard input
+ *   struct root **roots : Address of the list, grown as needed
+ *   int *n_roots : Address of the number of targets
+ *   int *capacity : Address of the capacity of the list
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int read_roots(char* file, struct root **roots, int *n_roots, int *capacity) {
+    FILE *in = stdin;
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    int status = 0;
+
+    if(strcmp(file, "-") != 0 && (in=fopen(file, "r")) == NULL) {
+        printf("Could not open --paths-from %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+
+    while(status == 0 && (length=getline(&line, &size, in)) != -1) {
+        if(length > 0 && line[length-1] == '\n')
+            line[--length] = '\0';
+        if(length > 0)
+            status = add_root(line, roots, n_roots, capacity);
+    }
+
+    free(line);
+    if(in != stdin)
+        fclose(in);
+    return status;
+}
+
+/* SYNOPSIS
+ *   Lower the CPU and I/O priority of the process as requested. Threads
+ *   that are started afterwards inherit both.
+ * ARGUMENT
+ *   None
+ * RETURN
+ *   0 on success, 1 on failure
+ */
+int lower_priority() {
+    if(nice_level > 0 && setpriority(PRIO_PROCESS, 0, nice_level) != 0) {
+        printf("Could not set nice level %d: %s\n", nice_level, strerror(errno));
+        return 1;
+    }
+    if(idle_io && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+        printf("Could not use the idle I/O scheduling class: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
 /* SYNOPSIS
  *   Outputs usage information for the command
  * ARGUMENT
@@ -1276,15 +8507,61 @@ int get_sanitized_path(char* arg, char* output) {
  *   Always 0
  */
 int usage() {
-    printf("USAGE: dug [OPTIONS] <directory>\n\n");
+    printf("USAGE: dug [OPTIONS] <directory> [<directory> ...]\n\n");
     printf("OPTIONS\n");
+    printf("--accounting Also report bytes, apparent bytes and files by group, by user\n");
+    printf("             and by user and group pair\n");
+    printf("--age <field>[:<days>,...] Also report the usage of files by age of their\n");
+    printf("             atime, mtime or ctime, in buckets starting at each number of\n");
+    printf("             <days> (default is 30,90,365)\n");
     printf("  -b         Compute apparent size (default is size of blocks occupied)\n");
+    printf("--backoff <ms> Halve the rate of stat and readdir operations while the\n");
+    printf("             average stat latency is above <ms> milliseconds, and raise\n");
+    printf("             it again, up to --max-rate, once it is below\n");
+    printf("--cache <file> Reuse the usage of directories that have not changed since\n");
+    printf("             the cache <file> was written, and update the cache\n");
+    printf("--depth <int> Report directories down to <int> levels below the\n");
+    printf("             target (default is 1)\n");
+    printf("--diff <old> <new> Report the usage that grew between two snapshots\n");
+    printf("--dont-sync  Use cached attributes on network filesystems instead of\n");
+    printf("             revalidating each file with the server\n");
+    printf("  -e <name>  Traversal engine: fts, native or uring (default is fts)\n");
+    printf("--exclude-name <pattern> Do not process files or directories whose name\n");
+    printf("             matches <pattern>, or any descendants, without a stat\n");
+    printf("             (with -e fts, matching directories are still stat'ed).\n");
+    printf("             Wildcards of shell globs are allowed, and multiple\n");
+    printf("             --exclude-name can be specified.\n");
+    printf("--grand-summary Also report the usage summed over all directories\n");
     printf("  -h         Output human readable sizes (has no effect when used with -j)\n");
     printf("--help       Output usage information\n");
+    printf("--idle       Use the idle I/O scheduling class, so other I/O goes first\n");
     printf("  -j         Output result in JSON format (default is plain text)\n");
     printf("  -m  <int>  Maximum errors before terminating (default is 128)\n");
+    printf("--max-rate <int> Limit stat and readdir operations to <int> per second\n");
+    printf("             across all threads\n");
+    printf("--merge <snapshot>... Report the usage of a target from the snapshots\n");
+    printf("             written by each --shard of it\n");
+    printf("--metrics <file> Write the metrics dumped on SIGUSR1 to <file> instead of\n");
+    printf("             stderr, and time each stat\n");
     printf("  -n         Output group/user names (default output uses gids/uids)\n");
-    printf("  -t  <int>  Set number of threads to use (default is 1)\n");
+    printf("--names <file> Read names from a passwd or group <file> instead of the\n");
+    printf("             system databases (implies -n)\n");
+    printf("--ndjson     Output a line of JSON for each directory as soon as it is\n");
+    printf("             complete, followed by a line with the summary\n");
+    printf("--nice <int> Run at nice level <int>, from 1 to 19\n");
+    printf("--paths-from <file> Also audit the directories listed in <file>, one per\n");
+    printf("             line (- reads standard input)\n");
+    printf("--progress <int> Print progress to stderr every <int> seconds\n");
+    printf("--shard <i>/<N> Walk slice <i> of <N> of the subdirectories of each\n");
+    printf("             target, numbered from 0, and count the target itself\n");
+    printf("             only in slice 0\n");
+    printf("--sizes      Also report the number of files by powers of two of their size\n");
+    printf("--snapshot <file> Also write the result to a binary snapshot <file>\n");
+    printf("  -t  <int>  Set number of threads to use, up to 512 (default is 1). With\n");
+    printf("             auto, start with the CPUs available and tune the number\n");
+    printf("             while walking, up to the same limit\n");
+    printf("--threshold <size> Only report growth larger than <size> with --diff\n");
+    printf("             (suffix K, M, G, T or P for powers of 1024)\n");
     printf("  -u         Summarize usage by owner (default is summarize by group)\n");
     printf("  -v         Output information about each file encountered\n");
     printf("  -V,--version  Output version infromation\n");
@@ -1310,7 +8587,11 @@ int version() {
  */
 int main(int argc, char** argv) {
     int i;
-    char *path=malloc(MAXPATHLEN);   
+    struct root *roots = NULL;
+    int n_roots = 0, roots_capacity = 0;
+    char *diff_path = NULL, *paths_from = NULL, *end;
+    bool merge = false;
+    double backoff;
     char c; 
 
     // If run with no arguments, output usage
@@ -1329,18 +8610,151 @@ int main(int argc, char** argv) {
     static struct option long_options[] = {
         {"help",    no_argument, 0, 0},
 	{"version", no_argument, 0, 0},
+	{"dont-sync", no_argument, 0, 0},
+	{"depth",   required_argument, 0, 0},
+	{"cache",   required_argument, 0, 0},
+	{"snapshot", required_argument, 0, 0},
+	{"diff",    required_argument, 0, 0},
+	{"threshold", required_argument, 0, 0},
+	{"ndjson",  no_argument, 0, 0},
+	{"names",   required_argument, 0, 0},
+	{"progress", required_argument, 0, 0},
+	{"metrics", required_argument, 0, 0},
+	{"paths-from", required_argument, 0, 0},
+	{"grand-summary", no_argument, 0, 0},
+	{"accounting", no_argument, 0, 0},
+	{"age",     required_argument, 0, 0},
+	{"sizes",   no_argument, 0, 0},
+	{"exclude-name", required_argument, 0, 0},
+	{"max-rate", required_argument, 0, 0},
+	{"backoff", required_argument, 0, 0},
+	{"idle",    no_argument, 0, 0},
+	{"nice",    required_argument, 0, 0},
+	{"shard",   required_argument, 0, 0},
+	{"merge",   no_argument, 0, 0},
 	{0,         0,           0, 0}
     };
     int option_index = 0;
 
     // Parse arguments
-    while((c = getopt_long(argc, argv, "hjvVnbum:t:X:", long_options, &option_index)) != -1) {
+    while((c = getopt_long(argc, argv, "hjvVnbue:m:t:X:", long_options, &option_index)) != -1) {
         switch(c) {
 	    case 0:
 		if(strcmp(long_options[option_index].name, "help") == 0)
 		    return usage();
 		else if(strcmp(long_options[option_index].name, "version") == 0)
 		    return version();
+		else if(strcmp(long_options[option_index].name, "dont-sync") == 0)
+		    dont_sync = true;
+		else if(strcmp(long_options[option_index].name, "depth") == 0) {
+		    i = parse_num(optarg);
+		    if(i < 1 || i > 4096) {
+		        printf("Value for --depth %s was not in range [1,4096]\n", optarg);
+		        return 1;
+		    }
+		    max_depth = i;
+		}
+		else if(strcmp(long_options[option_index].name, "cache") == 0)
+		    cache_path = optarg;
+		else if(strcmp(long_options[option_index].name, "snapshot") == 0)
+		    snapshot_path = optarg;
+		else if(strcmp(long_options[option_index].name, "diff") == 0)
+		    diff_path = optarg;
+		else if(strcmp(long_options[option_index].name, "ndjson") == 0)
+		    ndjson = true;
+		else if(strcmp(long_options[option_index].name, "progress") == 0) {
+		    i = parse_num(optarg);
+		    if(i < 1 || i > 86400) {
+		        printf("Value for --progress %s was not in range [1,86400]\n", optarg);
+		        return 1;
+		    }
+		    progress_interval = i;
+		    time_stats = true;
+		}
+		else if(strcmp(long_options[option_index].name, "metrics") == 0) {
+		    metrics_path = optarg;
+		    time_stats = true;
+		}
+		else if(strcmp(long_options[option_index].name, "paths-from") == 0)
+		    paths_from = optarg;
+		else if(strcmp(long_options[option_index].name, "grand-summary") == 0)
+		    grand_summary = true;
+		else if(strcmp(long_options[option_index].name, "accounting") == 0)
+		    accounting = true;
+		else if(strcmp(long_options[option_index].name, "age") == 0) {
+		    if(parse_ages(optarg) != 0) {
+		        printf("Value for --age %s was not atime, mtime or ctime, optionally followed by up to %d increasing days, as in mtime:30,90,365\n", optarg, MAXAGES);
+		        return 1;
+		    }
+		}
+		else if(strcmp(long_options[option_index].name, "sizes") == 0)
+		    size_histogram = true;
+		else if(strcmp(long_options[option_index].name, "exclude-name") == 0) {
+		    if(store_exclude_name(optarg) != 0) {
+		        printf("Value for --exclude-name %s was not a file name or pattern\n", optarg);
+		        return 1;
+		    }
+		}
+		else if(strcmp(long_options[option_index].name, "max-rate") == 0) {
+		    i = parse_num(optarg);
+		    if(i < 1 || i > 100000000) {
+		        printf("Value for --max-rate %s was not in range [1,100000000]\n", optarg);
+		        return 1;
+		    }
+		    throttle.min_interval = 1000000000ull / i;
+		    throttle.interval = throttle.min_interval;
+		    throttling = true;
+		}
+		else if(strcmp(long_options[option_index].name, "backoff") == 0) {
+		    backoff = strtod(optarg, &end);
+		    if(end == optarg || *end != '\0' || !(backoff > 0 && backoff <= 60000)) {
+		        printf("Value for --backoff %s was not a number of milliseconds in range (0,60000]\n", optarg);
+		        return 1;
+		    }
+		    throttle.target = (long long unsigned int)(backoff * 1000000);
+		    throttling = true;
+		    time_stats = true;
+		}
+		else if(strcmp(long_options[option_index].name, "idle") == 0)
+		    idle_io = true;
+		else if(strcmp(long_options[option_index].name, "nice") == 0) {
+		    nice_level = parse_num(optarg);
+		    if(nice_level < 1 || nice_level > 19) {
+		        printf("Value for --nice %s was not in range [1,19]\n", optarg);
+		        return 1;
+		    }
+		}
+		else if(strcmp(long_options[option_index].name, "shard") == 0) {
+		    if(parse_shard(optarg) != 0) {
+		        printf("Value for --shard %s was not <i>/<N> with 0 <= i < N <= 65536\n", optarg);
+		        return 1;
+		    }
+		}
+		else if(strcmp(long_options[option_index].name, "merge") == 0)
+		    merge = true;
+		else if(strcmp(long_options[option_index].name, "names") == 0) {
+		    names_path = optarg;
+		    output_names = true;
+		}
+		else if(strcmp(long_options[option_index].name, "threshold") == 0) {
+		    if(parse_size(optarg, &diff_threshold) != 0) {
+		        printf("Value for --threshold %s was not a size\n", optarg);
+		        return 1;
+		    }
+		}
+		break;
+            case 'e':
+                if(strcmp(optarg, "fts") == 0)
+                    engine = ENGINE_FTS;
+                else if(strcmp(optarg, "native") == 0)
+                    engine = ENGINE_NATIVE;
+                else if(strcmp(optarg, "uring") == 0)
+                    engine = ENGINE_URING;
+                else {
+                    printf("Value for -e %s was not one of fts, native or uring\n", optarg);
+                    return 1;
+                }
+                break;
             case 'm':
                 max_errors = parse_num(optarg);
                 if(max_errors < 0 || max_errors > 65535) {
@@ -1369,9 +8783,15 @@ int main(int argc, char** argv) {
                 human_readable = true;
                 break;
             case 't':
+                if(strcmp(optarg, "auto") == 0) {
+                    auto_threads = true;
+                    time_stats = true;
+                    n_threads = auto_thread_count();
+                    break;
+                }
                 n_threads = parse_num(optarg);
-                if(n_threads < 0 || n_threads > 128) {
-                    printf("Value for -t %s was not in range [0,128]\n", optarg);
+                if(n_threads < 0 || n_threads > MAXTHREADS) {
+                    printf("Value for -t %s was not auto or in range [0,%d]\n", optarg, MAXTHREADS);
                     return 1;
                 }
                 break;
@@ -1384,24 +8804,86 @@ int main(int argc, char** argv) {
         }
     }
 
-    // Parse path, or exit if not specified
-    if (optind >= argc) {
+    // Compare two snapshots instead of walking a directory
+    if(diff_path != NULL) {
+        if(optind >= argc) {
+            printf("--diff requires an old and a new snapshot! Review usage with --help\n");
+            return 1;
+        }
+        i = diff_snapshots(diff_path, argv[optind]);
+        free_names();
+        free(error_strs);
+        return i;
+    }
+
+    // Combine the snapshots of the shards of a walk instead of walking
+    if(merge) {
+        if(optind >= argc) {
+            printf("--merge requires the snapshots of the shards! Review usage with --help\n");
+            return 1;
+        }
+        if(ndjson) {
+            printf("--merge cannot be used with --ndjson! Review usage with --help\n");
+            return 1;
+        }
+        if(n_shards > 1) {
+            printf("--merge cannot be used with --shard! Review usage with --help\n");
+            return 1;
+        }
+        i = merge_snapshots(argv+optind, argc-optind);
+        free_names();
+        free(error_strs);
+        return i;
+    }
+
+    if(names_path != NULL && load_names(names_path) != 0)
+        return 1;
+
+    // Files in directories taken from the cache are not stat'ed, so they
+    // could not be counted by user and group pair or in histograms
+    if(accounting && cache_path != NULL) {
+        printf("--accounting cannot be used with --cache! Review usage with --help\n");
+        return 1;
+    }
+    if((age_field != AGE_NONE || size_histogram) && cache_path != NULL) {
+        printf("--age and --sizes cannot be used with --cache! Review usage with --help\n");
+        return 1;
+    }
+    age_now = time(NULL);
+
+    stat_mask = compute_stat_mask();
+    dir_stat_mask = stat_mask;
+    if(cache_path != NULL) {
+        dir_stat_mask |= STATX_MTIME|STATX_CTIME;
+        cache_load(cache_path);
+    }
+
+    // Parse paths, or exit if not specified
+    for(i=optind;i<argc;i++)
+        if(add_root(argv[i], &roots, &n_roots, &roots_capacity) != 0)
+            return 1;
+    if(paths_from != NULL && read_roots(paths_from, &roots, &n_roots, &roots_capacity) != 0)
+        return 1;
+    if(n_roots == 0) {
         printf("Path argument is required! Review usage with --help\n");
         return 1;
     }
-    
-    i = get_sanitized_path(argv[optind], path);
-    if(i > 0) {
-        printf("Could not use input path. It is over the maximum length %d or it could not be formatted to process\n", MAXPATHLEN);
-	return 1;
+    if(snapshot_path != NULL && n_roots > 1) {
+        printf("--snapshot takes a single directory! Review usage with --help\n");
+        return 1;
     }
-    else if(verbose)
-        printf("+dug       Auditing directory %s\n", path);
 
-    // Compile the usage by group under path
-    i = walk(path, n_threads);
+    if(lower_priority() != 0)
+        return 1;
+
+    // Compile the usage by group under each path
+    i = walk(roots, n_roots, n_roots > 1 || paths_from != NULL || grand_summary, n_threads);
     if(i > 0) {
-        if(json) 
+        if(ndjson) {
+            stream_summary_line();
+            id_table_free(&stream_summary);
+        }
+        else if(json) 
             json_output_failure();
         else {
             for(i=0;i<n_errors;i++)
@@ -1414,7 +8896,16 @@ int main(int argc, char** argv) {
         free(error_strs[i]);
     }
     free(error_strs);
-    free(path);
+    for(i=0;i<n_roots;i++)
+        free(roots[i].path);
+    free(roots);
+    acct_free(&walk_acct);
+    hist_free(&walk_hist);
+    link_free(&walk_links);
+    free(exclude_names.literals);
+    free(exclude_names.globs);
+    free(tune_steps);
+    free_names();
 
     return exit_status;
 }